@@ -1,8 +1,17 @@
 #pragma once
 
 #include "hash.hpp"
+#include "any_hash.hpp"
 #include "chain_hash.hpp"
+#include "concurrent_rh_hash.hpp"
+#include "hash64.hpp"
+#include "hopscotch_hash.hpp"
+#include "huge_page_allocator.hpp"
 #include "lazy_lp_hash.hpp"
 #include "lp_hash.hpp"
 #include "rh_hash.hpp"
+#include "rh_soa_hash.hpp"
+#include "sharded_hash.hpp"
+#include "snapshot.hpp"
+#include "swiss_hash.hpp"
 
@@ -0,0 +1,77 @@
+#pragma once
+
+#include "hash.hpp"
+#include <cstddef>
+#include <functional>
+#include <utility> // for forward
+
+
+// Type-erased hash table, for code that needs to choose a table at
+// runtime or keep different tables behind one type. The tables
+// themselves are statically dispatched through IHash, so this is the
+// only place that pays for virtual calls.
+template <typename K, typename V>
+struct AnyHash {
+    virtual ~AnyHash() {}
+
+    virtual void put( const K& key, const V& val ) = 0;
+    virtual V get( const K& key ) = 0;
+    virtual V * find( const K& key ) = 0;
+    virtual bool contains( const K& key ) = 0;
+    virtual V get_or( const K& key, const V& def ) = 0;
+    virtual void resize( size_t newBuckets ) = 0;
+    virtual void remove( const K& key ) = 0;
+    virtual size_t erase_if( std::function<bool( const K&, V& )> pred ) = 0;
+    virtual float getLoadFactor( void ) = 0;
+};
+
+
+// Wraps any table implementing IHash. The constructor arguments are
+// passed through to the table, e.g.
+//     AnyHash<int, int> * h = new AnyHashImpl<RHHash<int, int>>( 1024, 0.9 );
+template <class Table>
+struct AnyHashImpl : public AnyHash<typename Table::key_type, typename Table::mapped_type> {
+    typedef typename Table::key_type K;
+    typedef typename Table::mapped_type V;
+
+    template <typename... Args>
+    AnyHashImpl( Args&&... args ) : table( std::forward<Args>( args )... ) {}
+
+    void put( const K& key, const V& val ) {
+        table.put( key, val );
+    }
+
+    V get( const K& key ) {
+        return table.get( key );
+    }
+
+    V * find( const K& key ) {
+        return table.find( key );
+    }
+
+    bool contains( const K& key ) {
+        return table.contains( key );
+    }
+
+    V get_or( const K& key, const V& def ) {
+        return table.get_or( key, def );
+    }
+
+    void resize( size_t newBuckets ) {
+        table.resize( newBuckets );
+    }
+
+    void remove( const K& key ) {
+        table.remove( key );
+    }
+
+    size_t erase_if( std::function<bool( const K&, V& )> pred ) {
+        return table.erase_if( pred );
+    }
+
+    float getLoadFactor( void ) {
+        return table.getLoadFactor();
+    }
+
+    Table table;
+};
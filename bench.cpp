@@ -1,11 +1,28 @@
 #include "all_hash.hpp"
 #include <iostream>
 #include <cassert>
+#include <cctype>
+#include <climits>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <exception>
 #include <random>
 #include <functional>
 #include <algorithm>
 #include <iterator>
+#include <map>
+#include <numeric>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 #include <set>
 
@@ -22,78 +39,3037 @@
 
 using namespace std;
 
-int main()
+
+void print_dib_stats( const Histogram& dibs ) {
+    cout << "[Stats]" << endl;
+    cout << "Samples: " << dibs.count() << endl;
+    cout << "Mean: " << dibs.mean() << endl;
+    cout << "Variance: " << dibs.variance() << endl;
+    cout << "Standard Deviation: " << dibs.sd() << endl;
+    cout << "p99: " << dibs.percentile( 0.99 ) << endl;
+    cout << "Max: " << dibs.max() << endl;
+    cout << endl;
+}
+
+// Probe length check. Fills the tables until they are almost full,
+// removes roughly half of the keys, and prints the DIB statistics
+// before and after the removals. Doubles as a correctness check.
+template <class Table>
+void check_table( const char * name, double table_size, double load_factor,
+        const vector<int>& inserts, const vector<int>& deletes,
+        const vector<int>& diff )
 {
-    random_device rd;
-    mt19937 gen(rd());
-    uniform_int_distribution<int> dis(0, 100000);
-    auto get_num = bind( dis, gen );
+    Table t( table_size, load_factor );
 
-    double table_size = 10000;
-    double load_factor = 0.98;
-    int max_entries = table_size * load_factor;
+    cout << "[" << name << "]" << endl;
 
-    LazyLPHash<int, int> llp(table_size, load_factor);
-    LPHash<int, int> lp (table_size, load_factor);
-    RHHash<int, int> rh (table_size, load_factor);
+    for( auto i : inserts ) {
+        t.put( i, i );
+    }
 
-    vector<int> inserts;
-    vector<int> deletes;
-    vector<int> diff;
+    for( auto i : inserts ) {
+        assert(t.get(i) == i );
+    }
 
-    for(int i = 0; i < max_entries; ++i) {
-        inserts.push_back( get_num() );
+    print_dib_stats( t.get_dib_stats() );
+
+    for( auto i : deletes ) {
+        t.remove( i );
     }
 
-    for(int i = 0; i < max_entries / 2; ++i) {
-        deletes.push_back( get_num() );
+    for( auto i : deletes ) {
+        assertex(t.get( i ) );
+        assert(t.find( i ) == nullptr );
+        assert(!t.contains( i ) );
+        assert(t.get_or( i, -1 ) == -1 );
     }
 
-    set<int> i(inserts.begin(), inserts.end());
-    set<int> d(deletes.begin(), deletes.end());
+    print_dib_stats( t.get_dib_stats() );
 
-    set_difference(
-            i.begin(), i.end(),
-            d.begin(), d.end(),
-            inserter(diff, diff.begin())
-            );
+    for( auto i : diff ) {
+        assert(t.get(i) == i );
+        assert(*t.find(i) == i );
+        assert(t.contains( i ) );
+        assert(t.get_or( i, -1 ) == i );
+    }
+}
 
-    for( auto i : inserts ) {
-        llp.put( i, i );
-        lp.put( i, i );
-        rh.put( i, i );
+// Checks put/emplace/try_emplace semantics and heterogeneous lookup
+// on a string keyed table.
+template <class Table>
+void check_string_table()
+{
+    Table t( 8, 0.7 );
+
+    for( int i = 0; i < 1000; ++i ) {
+        t.put( "key" + to_string( i ), i );
     }
 
-    for( auto i : inserts ) {
-        assert(llp.get(i) == i );
-        assert(lp.get(i) == i );
-        assert(rh.get(i) == i );
+    // overwriting must not change the number of entries
+    t.put( string( "key0" ), -1 );
+    assert(t.numEntries == 1000 );
+
+    // lookups by std::string, std::string_view and const char *
+    assert(t.get( string( "key0" ) ) == -1 );
+    assert(t.get( string_view( "key1" ) ) == 1 );
+    assert(t.get( "key2" ) == 2 );
+    assertex(t.get( "missing" ) );
+
+    auto res = t.try_emplace( "key3", 100 );
+    assert(!res.second && *res.first == 3 );
+
+    res = t.try_emplace( string( "new" ), 100 );
+    assert(res.second && *res.first == 100 );
+
+    res = t.emplace( "key3", 100 );
+    assert(!res.second && t.get( "key3" ) == 100 );
+
+    t.remove( "new" );
+    t.remove( string_view( "key3" ) );
+    assertex(t.get( "key3" ) );
+    assertex(t.get( "new" ) );
+}
+
+// Runs random puts, removes and lookups against std::unordered_map
+// with incremental resizing enabled, starting from a tiny table so
+// that most operations happen while a resize is in progress.
+template <class Table>
+void check_incremental()
+{
+    Table t( 4, 0.9 );
+    t.setIncrementalResize( true );
+
+    unordered_map<int, int> ref;
+    mt19937 gen( 42 );
+    uniform_int_distribution<int> key( 0, 20000 );
+    uniform_int_distribution<int> op( 0, 9 );
+    bool resized = false;
+
+    for( int i = 0; i < 200000; ++i ) {
+        int k = key( gen );
+        int o = op( gen );
+
+        if( o < 5 ) {
+            t.put( k, i );
+            ref[k] = i;
+        } else if( o < 7 ) {
+            t.remove( k );
+            ref.erase( k );
+        } else {
+            auto it = ref.find( k );
+            int * val = t.find( k );
+            assert(( it == ref.end() ) == ( val == nullptr ));
+            assert(!val || *val == it->second );
+        }
+
+        resized |= t.resizing();
+        assert(t.numEntries == ref.size() );
     }
 
-    llp.get_dib_stats();
-    lp.get_dib_stats();
-    rh.get_dib_stats();
+    assert(resized );
 
-    for( auto i : deletes ) {
-        llp.remove( i );
-        lp.remove( i );
-        rh.remove( i );
+    for( auto& kv : ref ) {
+        assert(t.get( kv.first ) == kv.second );
     }
 
-    for( auto i : deletes ) {
-        assertex(llp.get( i ) );
-        assertex(lp.get( i ) );
-        assertex(rh.get( i ) );
+    t.finishResize();
+    assert(!t.resizing() );
+
+    // keys sharing a bucket under weak hashers, so tables with a probe
+    // guard grow while incremental resizing is on. The value returned
+    // must be the key's own, wherever the growth left it.
+    Table c( 1024, 0.9 );
+    c.setIncrementalResize( true );
+
+    for( int i = 0; i < 200; ++i ) {
+        auto res = c.emplace( i * 1024, i );
+        assert(res.second && *res.first == i );
+        *res.first = -i;
     }
 
-    llp.get_dib_stats();
-    lp.get_dib_stats();
-    rh.get_dib_stats();
+    for( int i = 0; i < 200; ++i ) {
+        assert(c.get( i * 1024 ) == -i );
+    }
+}
 
-    for( auto i : diff ) {
-        assert(llp.get(i) == i );
-        assert(lp.get(i) == i );
-        assert(rh.get(i) == i );
+// Destroys a table of strings halfway through an incremental resize.
+// Values are too long for the small string buffer, so LeakSanitizer
+// reports any node or entry the destructor leaves in the old table.
+template <class Table>
+void check_destroy_resizing()
+{
+    Table t( 4, 0.9 );
+    t.setIncrementalResize( true );
+
+    for( int i = 0; i < 64 || !t.resizing(); ++i ) {
+        t.put( "key" + to_string( i ), string( 32, 'a' + i % 26 ) );
+    }
+
+    assert(t.resizing() );
+}
+
+// A value that counts its live copies, so a check can tell that a
+// table destroyed each value exactly once.
+struct Counted {
+    static int live;
+
+    Counted() { ++live; }
+    Counted( int _val ) : val( _val ) { ++live; }
+    Counted( const Counted& other ) : val( other.val ) { ++live; }
+    Counted& operator=( const Counted& other ) { val = other.val; return *this; }
+    ~Counted() { --live; }
+
+    int val = 0;
+};
+
+int Counted::live = 0;
+
+// Destroys a ChainedHash whose old chains still hold nodes with
+// destructors, which must each run once, and must not read a node's
+// link after its destructor has run.
+void check_destroy_chains()
+{
+    {
+        ChainedHash<string, Counted> t( 4, 0.9 );
+        t.setIncrementalResize( true );
+
+        for( int i = 0; i < 64 || !t.resizing(); ++i ) {
+            t.put( "key" + to_string( i ), Counted( i ) );
+        }
+
+        assert(t.resizing() && t.oldTable != nullptr );
+        assert(Counted::live == int( t.numEntries ) );
+    }
+
+    assert(Counted::live == 0 );
+}
+
+// Writers put and remove their own keys while readers look up keys
+// from every writer, starting from a tiny table so that puts resize it
+// under the readers. A reader may see a key or not, but never a wrong
+// value, and keys nobody removes must always be found.
+template <class Table>
+void check_concurrent()
+{
+    const int numWriters = 4;
+    const int numReaders = 4;
+    const int numKeys = 40000;
+    const int numStable = 1000;
+
+    Table t( 16, 0.9 );
+
+    // stable keys are negative, writer keys are non-negative
+    for( int k = 1; k <= numStable; ++k ) {
+        t.put( -k, -k * 3 );
+    }
+
+    vector<set<int>> owned( numWriters );
+    atomic<int> writersLeft( numWriters );
+    vector<thread> threads;
+
+    for( int w = 0; w < numWriters; ++w ) {
+        threads.emplace_back( [&, w]() {
+            mt19937 gen( w );
+            uniform_int_distribution<int> key( 0, numKeys / numWriters - 1 );
+
+            for( int i = 0; i < 100000; ++i ) {
+                int k = key( gen ) * numWriters + w;
+
+                if( gen() % 3 ) {
+                    t.put( k, k * 3 );
+                    owned[w].insert( k );
+                } else {
+                    t.remove( k );
+                    owned[w].erase( k );
+                }
+            }
+
+            --writersLeft;
+        } );
+    }
+
+    for( int r = 0; r < numReaders; ++r ) {
+        threads.emplace_back( [&, r]() {
+            mt19937 gen( 100 + r );
+            uniform_int_distribution<int> key( -numStable, numKeys - 1 );
+
+            while( writersLeft > 0 ) {
+                int k = key( gen );
+                int val = t.get_or( k, 1 );
+
+                if( k < 0 ) {
+                    assert(val == k * 3 );
+                } else {
+                    assert(val == 1 || val == k * 3 );
+                }
+            }
+        } );
+    }
+
+    for( auto& th : threads ) {
+        th.join();
+    }
+
+    size_t expected = numStable;
+
+    for( int w = 0; w < numWriters; ++w ) {
+        expected += owned[w].size();
+    }
+
+    assert(t.size() == expected );
+
+    for( int k = -numStable; k < numKeys; ++k ) {
+        bool has = k < 0 || owned[k % numWriters].count( k ) > 0;
+        assert(t.contains( k ) == has );
+    }
+}
+
+template <typename K> K to_key( int i );
+template <> int to_key<int>( int i ) { return i; }
+template <> string to_key<string>( int i ) { return "key" + to_string( i ); }
+
+// Batched operations against std::unordered_map, with repeated keys
+// inside each batch.
+template <class Table>
+void check_batch()
+{
+    Table t( 64, 0.9 );
+    unordered_map<int, int> ref;
+    mt19937 gen( 7 );
+    uniform_int_distribution<int> key( 0, 5000 );
+
+    vector<int> keys( 1000 );
+    vector<int> vals( 1000 );
+    vector<int> out( 1000 );
+    unique_ptr<bool[]> found( new bool[1000] );
+
+    for( int round = 0; round < 20; ++round ) {
+        for( size_t i = 0; i < keys.size(); ++i ) {
+            keys[i] = key( gen );
+            vals[i] = round * 10000 + int( i );
+            ref[keys[i]] = vals[i];
+        }
+
+        t.put_batch( keys.data(), vals.data(), keys.size() );
+
+        for( size_t i = 0; i < keys.size(); ++i ) {
+            keys[i] = key( gen );
+        }
+
+        size_t numFound = t.get_batch( keys.data(), out.data(), found.get(), keys.size() );
+        size_t expected = 0;
+
+        for( size_t i = 0; i < keys.size(); ++i ) {
+            auto it = ref.find( keys[i] );
+            assert(found[i] == ( it != ref.end() ) );
+            assert(!found[i] || out[i] == it->second );
+            expected += found[i];
+        }
+
+        assert(numFound == expected );
+
+        keys.resize( 300 );
+        for( size_t i = 0; i < keys.size(); ++i ) {
+            keys[i] = key( gen );
+            ref.erase( keys[i] );
+        }
+
+        t.remove_batch( keys.data(), keys.size() );
+        keys.resize( 1000 );
+    }
+
+    for( auto& kv : ref ) {
+        assert(t.get( kv.first ) == kv.second );
+    }
+}
+
+// Fills a ShardedHash through put_batch and checks that each shard's
+// keys spread over its whole array rather than a range of it, which
+// happens when the shard is picked from the same bits as the index.
+template <class Table>
+void check_shard_spread()
+{
+    static_assert( !std::is_copy_constructible<Table>::value,
+            "check_shard_spread: a copy would share the shards" );
+
+    Table t( 16, 0.9 );
+    vector<int> keys( 40000 );
+    vector<int> vals( keys.size() );
+
+    for( size_t i = 0; i < keys.size(); ++i ) {
+        keys[i] = int( i );
+        vals[i] = int( i ) * 3;
+    }
+
+    t.put_batch( keys.data(), vals.data(), keys.size() );
+    assert(t.size() == keys.size() );
+
+    for( auto& s : t.shards ) {
+        assert(s->table.get_dib_stats().max() < 64 );
+        assert(s->table.getLoadFactor() > 0.25 );
+    }
+}
+
+// Allocator that throws bad_alloc once allocationsLeft reaches zero,
+// for checking what tables leave behind when an allocation fails. A
+// negative count never throws.
+static int allocationsLeft = -1;
+
+template <typename T>
+struct ThrowingAllocator {
+    typedef T value_type;
+
+    ThrowingAllocator() {}
+
+    template <typename U>
+    ThrowingAllocator( const ThrowingAllocator<U>& ) {}
+
+    T * allocate( size_t n ) {
+        if( allocationsLeft == 0 ) throw bad_alloc();
+        if( allocationsLeft > 0 ) --allocationsLeft;
+        return std::allocator<T>().allocate( n );
+    }
+
+    void deallocate( T * ptr, size_t n ) {
+        std::allocator<T>().deallocate( ptr, n );
+    }
+};
+
+template <typename T, typename U>
+bool operator==( const ThrowingAllocator<T>&, const ThrowingAllocator<U>& ) {
+    return true;
+}
+
+template <typename T, typename U>
+bool operator!=( const ThrowingAllocator<T>&, const ThrowingAllocator<U>& ) {
+    return false;
+}
+
+// ChainedHash's node pool, with string keys so that node destructors
+// matter. Removed nodes must be reused before the pool grows, and
+// compaction must keep every entry.
+void check_node_pool()
+{
+    ChainedHash<string, int> t( 16, 0.9 );
+    t.setCompactOnResize( true );
+
+    unordered_map<string, int> ref;
+    mt19937 gen( 3 );
+    uniform_int_distribution<int> key( 0, 5000 );
+
+    for( int i = 0; i < 50000; ++i ) {
+        string k = "key" + to_string( key( gen ) );
+
+        if( gen() % 3 ) {
+            t.put( k, i );
+            ref[k] = i;
+        } else {
+            t.remove( k );
+            ref.erase( k );
+        }
+    }
+
+    assert(t.numEntries == ref.size() );
+
+    for( auto& kv : ref ) {
+        assert(t.get( kv.first ) == kv.second );
+    }
+
+    size_t bytes = t.memoryUsage();
+
+    for( auto& kv : ref ) {
+        t.remove( kv.first );
+    }
+
+    for( auto& kv : ref ) {
+        t.put( kv.first, kv.second );
+    }
+
+    assert(t.memoryUsage() == bytes );
+
+    t.compact();
+
+    for( auto& kv : ref ) {
+        assert(t.get( kv.first ) == kv.second );
+    }
+
+    // a compaction whose second slab can't be allocated must throw
+    // with every entry still in place
+    ChainedHash<string, int, HashFn<string>, ModIndex, ThrowingAllocator<char>> f( 16, 0.9 );
+
+    for( auto& kv : ref ) {
+        f.put( kv.first, kv.second );
+    }
+
+    bool threw = false;
+    allocationsLeft = 1;
+
+    try {
+        f.compact();
+    } catch( bad_alloc& ) {
+        threw = true;
+    }
+
+    allocationsLeft = -1;
+    assert(threw && f.numEntries == ref.size() );
+
+    for( auto& kv : ref ) {
+        assert(f.get( kv.first ) == kv.second );
+    }
+}
+
+// Fills a table large enough for its arrays to be mapped rather than
+// calloc'd by HugePageAllocator, which relies on the mapping being
+// zero filled.
+template <class Table>
+void check_allocator()
+{
+    Table t( 1 << 18, 0.9 );
+    int n = 200000;
+
+    for( int i = 0; i < n; ++i ) {
+        t.put( to_key<typename Table::key_type>( i ), i );
+    }
+
+    for( int i = 0; i < n; i += 2 ) {
+        t.remove( to_key<typename Table::key_type>( i ) );
+    }
+
+    for( int i = 0; i < n; ++i ) {
+        assert(t.get_or( to_key<typename Table::key_type>( i ), -1 ) == ( i % 2 ? i : -1 ) );
+    }
+
+    // grows, and frees the old arrays
+    t.resize( 1 << 19 );
+
+    for( int i = 1; i < n; i += 2 ) {
+        assert(t.get( to_key<typename Table::key_type>( i ) ) == i );
+    }
+}
+
+// Value whose default constructor throws once constructionsLeft
+// reaches zero, counting the ones alive
+static int constructionsLeft = -1;
+static int liveValues = 0;
+
+struct ThrowingValue {
+    ThrowingValue() {
+        if( constructionsLeft == 0 ) throw std::runtime_error("no more values");
+        if( constructionsLeft > 0 ) --constructionsLeft;
+        ++liveValues;
+    }
+
+    ~ThrowingValue() {
+        --liveValues;
+    }
+};
+
+// An array whose elements throw partway through construction must
+// destroy the ones it built.
+void check_failed_construction()
+{
+    LPHash<int, int> t( 16, 0.9 );
+    bool threw = false;
+    constructionsLeft = 5;
+
+    try {
+        t.allocateArray<ThrowingValue>( 10 );
+    } catch( std::runtime_error& ) {
+        threw = true;
+    }
+
+    constructionsLeft = -1;
+    assert(threw && liveValues == 0 );
+}
+
+// A resize whose new array can't be allocated must throw with the
+// table still describing, and holding, the old one.
+template <class Table>
+void check_failed_resize()
+{
+    Table t( 64, 0.9 );
+
+    for( int i = 0; i < 50; ++i ) {
+        t.put( "key" + to_string( i ), i );
+    }
+
+    size_t numBuckets = t.numBuckets;
+    bool threw = false;
+    allocationsLeft = 0;
+
+    try {
+        t.resize( 4096 );
+    } catch( bad_alloc& ) {
+        threw = true;
+    }
+
+    allocationsLeft = -1;
+    assert(threw && t.numBuckets == numBuckets && t.numEntries == 50 );
+
+    for( int i = 0; i < 50; ++i ) {
+        assert(t.get( "key" + to_string( i ) ) == i );
+    }
+
+    t.resize( 4096 );
+    for( int i = 0; i < 50; ++i ) {
+        assert(t.get( "key" + to_string( i ) ) == i );
+    }
+}
+
+// Iterates and runs erase_if on tables of many sizes and loads against
+// a map, then checks every key is still found, or not. Small tables
+// with random keys exercise clusters that wrap past the last bucket.
+template <class Table>
+void check_erase_if()
+{
+    mt19937 gen( 7 );
+
+    for( int round = 0; round < 255; ++round ) {
+        int numBuckets = round < 250 ? 16 + round % 50 : 20000;
+        int n = int( numBuckets * ( 0.5 + 0.45 * ( round % 7 ) / 6 ) );
+
+        Table t( numBuckets, 0.95 );
+        map<int, int> ref;
+
+        for( int i = 0; i < n; ++i ) {
+            int key = int( gen() % ( 4 * n ) );
+            t.put( key, i );
+            ref[key] = i;
+        }
+
+        int mod = 2 + round % 5;
+        auto doomed = [&]( int key ) { return key % mod == 0; };
+
+        // every entry exactly once, and values can be assigned
+        map<int, int> seen;
+        for( auto kv : t ) {
+            assert(seen.count( kv.first ) == 0 );
+            seen[kv.first] = kv.second;
+            kv.second += 1;
+        }
+        assert(seen == ref );
+
+        size_t expected = 0;
+        for( auto it = ref.begin(); it != ref.end(); ) {
+            if( doomed( it->first ) ) {
+                it = ref.erase( it );
+                ++expected;
+            } else {
+                ++it->second;
+                ++it;
+            }
+        }
+
+        size_t erased = t.erase_if( [&]( const int& key, int& ) { return doomed( key ); } );
+        assert(erased == expected );
+
+        size_t count = 0;
+        for( auto it = t.begin(); it != t.end(); ++it ) {
+            assert(ref.at( it->first ) == it->second );
+            ++count;
+        }
+        assert(count == ref.size() );
+
+        for( int key = 0; key < 4 * n; ++key ) {
+            assert(t.get_or( key, -1 ) == ( ref.count( key ) ? ref[key] : -1 ) );
+        }
+
+        // the table stays usable
+        for( auto& kv : ref ) {
+            t.remove( kv.first );
+        }
+        assert(t.begin() == t.end() );
+    }
+}
+
+// Checks merge, intersect and subtract against std::map, each probing
+// once per key, on tables of equal and unequal capacities. With a
+// seedable hasher, every other round gives the tables different seeds,
+// so keys are hashed again instead of reusing the stored hash.
+template <class Table>
+void check_set_ops()
+{
+    mt19937 gen( 11 );
+    auto sum = []( const int& mine, const int& theirs ) { return mine + theirs; };
+
+    for( int round = 0; round < 195; ++round ) {
+        int numBuckets = round < 190 ? 16 + round % 60 : 30000;
+        int range = numBuckets * ( 1 + round % 3 );
+        bool sameSize = round % 4 != 3;
+
+        // each table is filled to between a third and 0.9
+        auto fill = [&]( Table& t, map<int, int>& ref ) {
+            int n = int( t.numBuckets * ( 0.3 + 0.6 * ( gen() % 100 ) / 100.0 ) );
+            for( int i = 0; i < n; ++i ) {
+                int key = int( gen() % range );
+                int val = int( gen() % 1000 );
+                t.put( key, val );
+                ref[key] = val;
+            }
+        };
+
+        auto same = [&]( Table& t, const map<int, int>& ref ) {
+            assert(t.numEntries == ref.size() );
+            for( auto& kv : ref ) {
+                assert(t.get( kv.first ) == kv.second );
+            }
+            for( int key = 0; key < range; ++key ) {
+                assert(t.contains( key ) == ( ref.count( key ) > 0 ) );
+            }
+        };
+
+        for( int op = 0; op < 3; ++op ) {
+            Table a( numBuckets, 0.95 );
+            Table b( sameSize ? numBuckets : 2 * numBuckets + 1, 0.95 );
+            map<int, int> refA, refB, expected;
+
+            if( round % 2 ) {
+                setHasherSeed( b.hasher, 1 + round );
+            }
+
+            fill( a, refA );
+            fill( b, refB );
+
+            if( op == 0 ) {
+                expected = refA;
+                for( auto& kv : refB ) {
+                    auto it = expected.find( kv.first );
+                    if( it == expected.end() ) {
+                        expected[kv.first] = kv.second;
+                    } else {
+                        it->second += kv.second;
+                    }
+                }
+                a.merge( b, sum );
+            } else if( op == 1 ) {
+                for( auto& kv : refA ) {
+                    if( refB.count( kv.first ) ) {
+                        expected[kv.first] = kv.second + refB[kv.first];
+                    }
+                }
+                a.intersect( b, sum );
+            } else {
+                for( auto& kv : refA ) {
+                    if( !refB.count( kv.first ) ) {
+                        expected[kv.first] = kv.second;
+                    }
+                }
+                a.subtract( b );
+            }
+
+            same( a, expected );
+            same( b, refB );
+
+            for( size_t i = 0; i < a.numSlots(); ++i ) {
+                if( a.buckets[i].occupied() ) {
+                    size_t home = a.indexer.index( a.hashOf( a.buckets[i] ) );
+                    assert(size_t( a.distAt( i ) - 1 ) == a.probeLength( home, i ) );
+                }
+            }
+        }
+    }
+
+    // with itself, and the defaults keeping mine
+    Table t( 64, 0.9 );
+    for( int i = 0; i < 50; ++i ) t.put( i, i );
+    t.merge( t );
+    t.intersect( t );
+    assert(t.numEntries == 50 && t.get( 7 ) == 7 );
+    t.merge( t, sum );
+    assert(t.numEntries == 50 && t.get( 7 ) == 14 );
+    t.subtract( t );
+    assert(t.numEntries == 0 );
+
+    // disjoint tables whose union is past the load threshold, so the
+    // merge grows the table as it goes
+    Table big( 4096, 0.9 ), more( 4096, 0.9 );
+    int m = int( big.numBuckets * 0.85 );
+    for( int i = 0; i < m; ++i ) {
+        big.put( 2 * i, 1 );
+        more.put( 2 * i + 1, 2 );
+    }
+    big.merge( more );
+    assert(big.numEntries == size_t( 2 * m ) && big.getLoadFactor() < 0.9 );
+    for( int i = 0; i < 2 * m; ++i ) {
+        assert(big.get( i ) == 1 + i % 2 );
+    }
+}
+
+// Bulk builds with duplicate keys on several thread counts, and checks
+// the result against a map and that every entry's stored probe length
+// is its distance from home.
+template <class Table>
+void check_build()
+{
+    typedef typename Table::key_type K;
+
+    for( int n : { 0, 1000, 100000, 300000 } ) {
+        for( int numThreads : { 1, 3, 8 } ) {
+            vector<pair<K, int>> pairs;
+            unordered_map<K, int> ref;
+
+            for( int i = 0; i < n; ++i ) {
+                K key = to_key<K>( int( unsigned( i % ( n * 3 / 4 + 1 ) ) * 2654435761u ) );
+                pairs.emplace_back( key, i );
+                ref[key] = i;
+            }
+
+            Table t( 16, 0.9 );
+            t.put( to_key<K>( -1 ), -1 );
+
+            t.build( pairs.begin(), pairs.end(), numThreads );
+
+            assert(t.numEntries == ref.size() );
+            assert(!t.contains( to_key<K>( -1 ) ));
+            assert(t.getLoadFactor() < 0.9 );
+
+            for( auto& kv : ref ) {
+                assert(t.get( kv.first ) == kv.second );
+            }
+
+            for( size_t i = 0; i < t.numSlots(); ++i ) {
+                if( t.buckets[i].occupied() ) {
+                    size_t home = t.indexer.index( t.hashOf( t.buckets[i] ) );
+                    assert(size_t( t.distAt( i ) - 1 ) == t.probeLength( home, i ) );
+                }
+            }
+
+            for( auto& kv : ref ) {
+                t.remove( kv.first );
+            }
+            assert(t.numEntries == 0 );
+        }
+    }
+
+    // builds into read only snapshots throw before replacing anything
+    auto refused = [&]( Table& t, const vector<pair<K, int>>& pairs ) {
+        bool threw = false;
+        try {
+            t.build( pairs.begin(), pairs.end() );
+        } catch( std::runtime_error& ) {
+            threw = true;
+        }
+        return threw && t.numEntries == 1 && t.get( to_key<K>( 7 ) ) == 7 && !t.contains( to_key<K>( 1 ) );
+    };
+
+    if constexpr( std::is_trivially_copyable<K>::value ) {
+        const char * path = "bench_snapshot.tmp";
+        {
+            Table t( 16, 0.9 );
+            t.put( 7, 7 );
+            t.saveSnapshot( path );
+        }
+
+        Table ro;
+        ro.openSnapshot( path, SNAPSHOT_READ_ONLY );
+        assert(refused( ro, { { 1, 1 }, { 2, 2 } } ));
+        std::remove( path );
+    }
+
+    // a build whose array can't be allocated throws before replacing
+    // anything
+    RHHash<K, int, typename Table::hasher_type, typename Table::index_type, ThrowingAllocator<char>> f( 16, 0.9 );
+    f.put( to_key<K>( 7 ), 7 );
+    size_t numBuckets = f.numBuckets;
+    vector<pair<K, int>> pairs;
+    for( int i = 0; i < 1000; ++i ) {
+        pairs.emplace_back( to_key<K>( i ), i );
+    }
+
+    bool threw = false;
+    allocationsLeft = 0;
+    try {
+        f.build( pairs.begin(), pairs.end() );
+    } catch( bad_alloc& ) {
+        threw = true;
+    }
+    allocationsLeft = -1;
+    assert(threw && f.numBuckets == numBuckets && f.numEntries == 1 && f.get( to_key<K>( 7 ) ) == 7 );
+}
+
+// Hasher that throws on one key, to fail a build partway through
+struct FailingIntHashFn : public HashFn<int> {
+    unsigned int hash( int key ) {
+        if( key == -7 ) throw std::runtime_error("unhashable key");
+        return HashFn<int>::hash( key );
+    }
+};
+
+// A build that throws, on one thread or many, must rethrow with the
+// table as it was.
+void check_failed_build()
+{
+    for( int numThreads : { 1, 3 } ) {
+        RHHash<int, int, FailingIntHashFn> t( 16, 0.9 );
+        t.put( 5, 5 );
+        size_t numBuckets = t.numBuckets;
+
+        vector<pair<int, int>> pairs;
+        for( int i = 0; i < 100000; ++i ) {
+            pairs.emplace_back( i == 70000 ? -7 : i, i );
+        }
+
+        bool threw = false;
+        try {
+            t.build( pairs.begin(), pairs.end(), numThreads );
+        } catch( std::runtime_error& ) {
+            threw = true;
+        }
+
+        assert(threw && t.numBuckets == numBuckets && t.numEntries == 1 );
+        assert(t.get( 5 ) == 5 && !t.contains( 1 ) );
+    }
+}
+
+template <class Table>
+bool snapshot_opens( Table& t, const char * path, SnapshotMode mode, bool verify )
+{
+    try {
+        t.openSnapshot( path, mode, verify );
+        return true;
+    } catch( std::runtime_error& ) {
+        return false;
+    }
+}
+
+// Saves a table, and checks it reopens read only and copy on write
+// without the original, and that mismatched or corrupt snapshots fail
+// to open.
+template <class Table, class OtherHasherTable>
+void check_snapshot()
+{
+    const char * path = "bench_snapshot.tmp";
+    int n = 50000;
+
+    {
+        Table t( 1024, 0.9 );
+
+        for( int i = 0; i < n; ++i ) {
+            t.put( i, i * 3 );
+        }
+
+        for( int i = 0; i < n; i += 3 ) {
+            t.remove( i );
+        }
+
+        t.saveSnapshot( path );
+    }
+
+    auto check = [&]( Table& t ) {
+        assert(t.numEntries == size_t( n - ( n + 2 ) / 3 ) );
+
+        for( int i = 0; i < n; ++i ) {
+            assert(t.get_or( i, -1 ) == ( i % 3 ? i * 3 : -1 ) );
+        }
+    };
+
+    Table ro;
+    assert(snapshot_opens( ro, path, SNAPSHOT_READ_ONLY, true ));
+    check( ro );
+
+    bool threw = false;
+    try {
+        ro.put( n, 0 );
+    } catch( std::runtime_error& ) {
+        threw = true;
+    }
+    assert(threw);
+
+    Table cow;
+    assert(snapshot_opens( cow, path, SNAPSHOT_COPY_ON_WRITE, false ));
+    cow.remove( 1 );
+    cow.put( 2, 7 );
+    assert(cow.get( 2 ) == 7 && !cow.contains( 1 ));
+
+    // grows off the mapping
+    for( int i = n; i < 2 * n; ++i ) {
+        cow.put( i, i );
+    }
+    assert(cow.get( 2 ) == 7 && cow.get( 2 * n - 1 ) == 2 * n - 1 );
+
+    // the file is untouched by either
+    Table again;
+    assert(snapshot_opens( again, path, SNAPSHOT_READ_ONLY, true ));
+    check( again );
+
+    OtherHasherTable other;
+    assert(!snapshot_opens( other, path, SNAPSHOT_READ_ONLY, false ));
+
+    // flip a byte of the buckets
+    std::FILE * file = std::fopen( path, "r+b" );
+    std::fseek( file, SnapshotHeader::DATA_OFFSET + 100, SEEK_SET );
+    int c = std::fgetc( file );
+    std::fseek( file, SnapshotHeader::DATA_OFFSET + 100, SEEK_SET );
+    std::fputc( c ^ 0x40, file );
+    std::fclose( file );
+
+    Table corrupt;
+    corrupt.put( 1, 1 );
+    assert(!snapshot_opens( corrupt, path, SNAPSHOT_READ_ONLY, true ));
+    assert(corrupt.get( 1 ) == 1 && corrupt.numEntries == 1 );
+
+    std::remove( path );
+}
+
+// Checks the histogram's buckets, percentiles and merging.
+void check_histogram()
+{
+    for( int b = 0; b < Histogram::NUM_BUCKETS; ++b ) {
+        assert(Histogram::bucketOf( Histogram::bucketLow( b ) ) == b );
+        assert(Histogram::bucketOf( Histogram::bucketHigh( b ) ) == b );
+        if( b > 0 ) assert(Histogram::bucketLow( b ) == Histogram::bucketHigh( b - 1 ) + 1 );
+    }
+    assert(Histogram::bucketHigh( Histogram::NUM_BUCKETS - 1 ) == ~uint64_t( 0 ) );
+
+    Histogram all, low, high;
+    mt19937_64 rng( 5 );
+
+    for( int i = 0; i < 100000; ++i ) {
+        uint64_t x = rng() >> ( rng() % 64 );
+        all.record( x );
+        ( x < 1000 ? low : high ).record( x );
+    }
+
+    low.merge( high );
+    assert(low.count() == all.count() && low.max() == all.max() );
+    assert(memcmp( low.counts, all.counts, sizeof( all.counts ) ) == 0 );
+
+    // small values are exact, larger ones within a bucket's width
+    Histogram probes;
+    vector<uint64_t> values;
+
+    for( int i = 0; i < 10000; ++i ) {
+        uint64_t x = i % 10 == 0 ? 1000 + i : i % 7;
+        probes.record( x );
+        values.push_back( x );
+    }
+    sort( values.begin(), values.end() );
+
+    assert(probes.percentile( 0.5 ) == values[4999] );
+    assert(probes.percentile( 1.0 ) == probes.max() && probes.max() == values.back() );
+    uint64_t p95 = probes.percentile( 0.95 );
+    assert(p95 >= values[9499] && p95 - values[9499] <= values[9499] / Histogram::SUB_BUCKETS );
+    assert(fabs( probes.mean() - double( accumulate( values.begin(), values.end(), uint64_t( 0 ) ) ) / 10000 ) < 1e-6 );
+
+    string json;
+    probes.toJson( json );
+    assert(json.find( "\"count\":10000," ) != string::npos && json.back() == '}' );
+}
+
+#ifdef HASH_STATS
+// Checks the stats recorded by a table, which is built with
+// -DHASH_STATS. Puts made by resizes must not count, and the probe
+// lengths of get hits on a table without removes add up to its DIBs.
+template <class Table>
+void check_stats()
+{
+    Table t( 16, 0.9 );
+    int n = 20000;
+
+    for( int i = 0; i < n; ++i ) {
+        t.put( i, i );
+    }
+    t.put( 0, 1 );
+
+    assert(t.stats.probes[STAT_PUT].count() == uint64_t( n + 1 ) );
+    assert(t.stats.resizes.count() > 0 );
+
+    for( int i = 0; i < n; ++i ) {
+        assert(t.find( i ) && !t.find( -1 - i ));
+    }
+
+    Histogram dibs = t.get_dib_stats();
+    assert(t.stats.probes[STAT_GET_HIT].count() == uint64_t( n ) );
+    assert(t.stats.probes[STAT_GET_MISS].count() == uint64_t( n ) );
+    assert(t.stats.probes[STAT_GET_HIT].mean() == dibs.mean() );
+    assert(t.stats.probes[STAT_GET_HIT].max() == dibs.max() );
+
+    for( int i = 0; i < n; i += 2 ) {
+        t.remove( i );
+    }
+    assert(t.stats.probes[STAT_REMOVE].count() == uint64_t( n / 2 ) );
+
+    string json = t.stats.toJson();
+    assert(json.find( "\"remove_probes\":{\"count\":10000," ) != string::npos );
+
+    TableStats merged;
+    merged.merge( t.stats );
+    merged.merge( t.stats );
+    assert(merged.probes[STAT_PUT].count() == 2 * t.stats.probes[STAT_PUT].count() );
+
+    t.stats.clear();
+    assert(t.stats.probes[STAT_PUT].count() == 0 && t.stats.resizes.count() == 0 );
+}
+
+void check_all_stats()
+{
+    check_stats<LazyLPHash<int, int>>();
+    check_stats<LPHash<int, int>>();
+    check_stats<RHHash<int, int>>();
+    check_stats<RHSoAHash<int, int>>();
+    check_stats<SwissHash<int, int>>();
+    check_stats<HopscotchHash<int, int>>();
+
+    // swaps are only counted by RHHash and HopscotchHash, and shifts by
+    // the tables that shift on remove
+    RHHash<int, int> rh( 16, 0.9 );
+    for( int i = 0; i < 1000; ++i ) {
+        rh.put( i, i );
+    }
+    assert(rh.stats.swaps.count() == 1000 );
+    for( int i = 0; i < 1000; ++i ) {
+        rh.remove( i );
+    }
+    assert(rh.stats.shifts.count() == 1000 && rh.numEntries == 0 );
+
+    HopscotchHash<int, int> hop( 16, 0.9 );
+    for( int i = 0; i < 1000; ++i ) {
+        hop.put( i, i );
+    }
+    assert(hop.stats.swaps.count() == 1000 && hop.stats.shifts.count() == 0 );
+
+    ChainedHash<int, int> chained( 16, 0.9 );
+    for( int i = 0; i < 1000; ++i ) {
+        chained.put( i, i );
+        assert(chained.get( i ) == i );
+    }
+    assert(chained.stats.probes[STAT_PUT].count() == 1000 );
+    assert(chained.stats.probes[STAT_GET_HIT].count() == 1000 );
+
+    ShardedHash<RHHash<int, int>, 4> sharded;
+    for( int i = 0; i < 1000; ++i ) {
+        sharded.put( i, i );
+    }
+    assert(sharded.collectStats().probes[STAT_PUT].count() == 1000 );
+}
+#endif
+
+// A key type hashed by its bytes
+struct Point {
+    int32_t x, y, z;
+
+    bool operator==( const Point& other ) const {
+        return x == other.x && y == other.y && z == other.z;
+    }
+
+    bool operator!=( const Point& other ) const {
+        return !( *this == other );
+    }
+};
+
+template <class Table, typename MakeKey>
+void check_wide_keys( MakeKey makeKey )
+{
+    Table t( 16, 0.9 );
+    int n = 20000;
+
+    for( int i = 0; i < n; ++i ) {
+        t.put( makeKey( i ), i );
+    }
+
+    for( int i = 0; i < n; i += 2 ) {
+        t.remove( makeKey( i ) );
+    }
+
+    for( int i = 0; i < n; ++i ) {
+        assert(t.get_or( makeKey( i ), -1 ) == ( i % 2 ? i : -1 ) );
+    }
+}
+
+// Checks the wyhash test vectors, and Hash64 on every engine for
+// strings, integers, pairs, tuples and plain structs.
+void check_hash64()
+{
+    const char * messages[] = { "", "a", "abc", "message digest", "abcdefghijklmnopqrstuvwxyz",
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789",
+        "12345678901234567890123456789012345678901234567890123456789012345678901234567890" };
+    uint64_t expected[] = { 0x93228a4de0eec5a2ull, 0xc5bac3db178713c4ull, 0xa97f2f7b1d9b3314ull,
+        0x786d1f1df3801df4ull, 0xdca5a8138ad37c87ull, 0xb9e734f117cfaf70ull, 0x6cc5eab49a92d617ull };
+
+    for( int i = 0; i < 7; ++i ) {
+        assert(WyHash::hash( messages[i], strlen( messages[i] ), i ) == expected[i] );
+    }
+
+    Hash64<string> hs;
+    assert(hs.hash( string( "/index.html" ) ) == hs.hash( string_view( "/index.html" ) ) );
+    assert(hs.hash( "/index.html" ) == hs.hash( string( "/index.html" ) ) );
+
+    check_string_table<ChainedHash<string, int, Hash64<string>>>();
+    check_string_table<LazyLPHash<string, int, Hash64<string>>>();
+    check_string_table<LPHash<string, int, Hash64<string>>>();
+    check_string_table<RHHash<string, int, Hash64<string>>>();
+    check_string_table<RHSoAHash<string, int, Hash64<string>>>();
+    check_string_table<SwissHash<string, int, Hash64<string>, Pow2Index>>();
+
+    // keys with a stride of 4096 all land in bucket 0 of a power of
+    // two table under the identity hash
+    RHHash<int, int, Hash64<int>, Pow2Index> strided( 1 << 16, 0.9 );
+    for( int i = 0; i < 50000; ++i ) {
+        strided.put( i << 12, i );
+    }
+    assert(strided.get_dib_stats().max() < 32 );
+
+    typedef pair<int, string> Pair;
+    typedef tuple<int, int, long long> Triple;
+
+    Hash64<Pair> hp;
+    assert(hp.hash( Pair( 1, "2" ) ) != hp.hash( Pair( 2, "1" ) ) );
+
+    auto makePair = []( int i ) { return Pair( i % 97, to_string( i ) ); };
+    auto makeTriple = []( int i ) { return Triple( i % 7, i / 7, -i ); };
+    auto makePoint = []( int i ) { return Point{ i % 100, i / 100, 0 }; };
+
+    check_wide_keys<ChainedHash<Pair, int, Hash64<Pair>>>( makePair );
+    check_wide_keys<LPHash<Pair, int, Hash64<Pair>, FastRangeIndex>>( makePair );
+    check_wide_keys<RHHash<Pair, int, Hash64<Pair>>>( makePair );
+    check_wide_keys<LazyLPHash<Triple, int, Hash64<Triple>>>( makeTriple );
+    check_wide_keys<RHSoAHash<Triple, int, Hash64<Triple>, FibonacciIndex>>( makeTriple );
+    check_wide_keys<SwissHash<Point, int, Hash64<Point>>>( makePoint );
+    check_wide_keys<RHHash<Point, int, Hash64<Point>, Pow2Index>>( makePoint );
+}
+
+// Allocator reserving address space without committing memory, so a
+// check can build a table of more than 2^32 buckets and only pay for
+// the pages its keys touch. Anonymous mappings are zero filled.
+template <typename T>
+struct SparseAllocator {
+    typedef T value_type;
+
+    static const bool zero_filled = true;
+
+    template <typename U>
+    struct rebind {
+        typedef SparseAllocator<U> other;
+    };
+
+    SparseAllocator() {}
+
+    template <typename U>
+    SparseAllocator( const SparseAllocator<U>& ) {}
+
+    T * allocate( size_t n ) {
+#ifdef __linux__
+        void * mem = mmap( nullptr, n * sizeof( T ), PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 );
+        if( mem != MAP_FAILED ) return static_cast<T *>( mem );
+#else
+        (void) n;
+#endif
+        throw bad_alloc();
+    }
+
+    void deallocate( T * ptr, size_t n ) {
+#ifdef __linux__
+        munmap( ptr, n * sizeof( T ) );
+#else
+        (void) ptr;
+        (void) n;
+#endif
+    }
+};
+
+template <typename T, typename U>
+bool operator==( const SparseAllocator<T>&, const SparseAllocator<U>& ) {
+    return true;
+}
+
+template <typename T, typename U>
+bool operator!=( const SparseAllocator<T>&, const SparseAllocator<U>& ) {
+    return false;
+}
+
+// Checks that 32 bit hashers refuse capacities past 2^32, and that a
+// 64 bit hasher reaches every part of a table with 2^33 buckets.
+void check_capacity()
+{
+    const size_t BIG = ( size_t( 1 ) << 32 ) + 1;
+    bool threw = false;
+
+    try {
+        RHHash<int, int> narrow( BIG, 0.9 );
+    } catch( runtime_error& ) {
+        threw = true;
+    }
+    assert(threw);
+
+    typedef RHHash<uint64_t, uint32_t, Hash64<uint64_t>, Pow2Index, SparseAllocator<char>> Table;
+
+    try {
+        Table t( BIG, 0.9 );
+        assert(t.numBuckets == size_t( 1 ) << 33 );
+
+        const uint64_t n = 4096;
+        bool high = false;
+
+        for( uint64_t k = 0; k < n; ++k ) {
+            t.put( k << 40, uint32_t( k ) );
+            high = high || t.indexer.index( t.hasher.hash( k << 40 ) ) >> 32;
+        }
+        assert(high && t.numEntries == n );
+
+        for( uint64_t k = 0; k < n; k += 2 ) {
+            t.remove( k << 40 );
+        }
+
+        for( uint64_t k = 0; k < n; ++k ) {
+            assert(t.contains( k << 40 ) == ( k % 2 == 1 ) );
+            assert(t.get_or( k << 40, 0 ) == ( k % 2 ? uint32_t( k ) : 0 ) );
+        }
+        assert(t.numEntries == n / 2 );
+    } catch( bad_alloc& ) {
+        cerr << "check_capacity: can't reserve 2^33 buckets, skipped" << endl;
+    }
+}
+
+// Keys whose hashes under Hasher, at seed 0, all land in bucket 0 of a
+// power of two table of numBuckets.
+template <class Hasher>
+vector<int> colliding_keys( size_t numBuckets, size_t n )
+{
+    Hasher hasher;
+    vector<int> keys;
+
+    for( int k = 0; keys.size() < n; ++k ) {
+        if( ( hasher.hash( k ) & ( numBuckets - 1 ) ) == 0 ) {
+            keys.push_back( k );
+        }
+    }
+
+    return keys;
+}
+
+// Checks that keys piling into one bucket make Table rebuild, under a
+// fresh seed if its Hasher is seedable and at twice the capacity
+// otherwise, and that every key survives, put one at a time or in
+// batches.
+template <class Table>
+void check_probe_guard( const vector<int>& keys, bool seedable )
+{
+    for( int batched = 0; batched < 2; ++batched ) {
+        Table t( 1024, 0.5 );
+
+        if( batched ) {
+            t.put_batch( keys.data(), keys.data(), keys.size() );
+        } else {
+            for( int k : keys ) {
+                t.put( k, k );
+            }
+        }
+
+        assert(t.numEntries == keys.size() );
+        for( int k : keys ) {
+            assert(t.get( k ) == k );
+        }
+
+        if( seedable ) {
+            assert(t.numBuckets == 1024 && hasherSeed( t.hasher ) != 0 );
+            assert(t.get_dib_stats().max() <= t.probeLimit() );
+        } else {
+            assert(t.numBuckets == 2048 && t.guard.grew );
+        }
+    }
+}
+
+// Checks set operations and snapshots of tables that were reseeded.
+void check_reseeded( const vector<int>& keys )
+{
+    typedef RHHash<int, int, Seeded<MyIntHashFn>, Pow2Index> Table;
+    const char * path = "bench_snapshot.tmp";
+
+    auto fill = [&]( Table& t ) {
+        for( int k : keys ) {
+            t.put( k, k );
+        }
+        assert(hasherSeed( t.hasher ) != 0 );
+    };
+
+    Table others( 1024, 0.5 );
+    for( size_t i = 0; i < 100; ++i ) {
+        others.put( i < 50 ? keys[i] : -int( i ), -1 );
+    }
+
+    Table merged( 1024, 0.5 );
+    fill( merged );
+    merged.merge( others );
+    assert(merged.numEntries == keys.size() + 50 );
+    assert(merged.get( keys[0] ) == keys[0] && merged.get( -99 ) == -1 );
+
+    Table common( 1024, 0.5 );
+    fill( common );
+    common.intersect( others );
+    assert(common.numEntries == 50 && common.get( keys[49] ) == keys[49] );
+
+    Table rest( 1024, 0.5 );
+    fill( rest );
+    rest.subtract( others );
+    assert(rest.numEntries == keys.size() - 50 && !rest.contains( keys[0] ) );
+
+    rest.saveSnapshot( path );
+    Table opened;
+    opened.openSnapshot( path, SNAPSHOT_READ_ONLY );
+    assert(hasherSeed( opened.hasher ) == hasherSeed( rest.hasher ) );
+    for( size_t i = 0; i < keys.size(); ++i ) {
+        assert(opened.get_or( keys[i], -1 ) == ( i < 50 ? -1 : keys[i] ) );
+    }
+    std::remove( path );
+}
+
+// A reseed whose rebuild can't allocate must keep the old seed, under
+// which every entry is still placed, so every key put is still found.
+template <class Table>
+void check_failed_reseed( const vector<int>& keys )
+{
+    Table t( 1024, 0.9 );
+    vector<int> put;
+    bool threw = false;
+    allocationsLeft = 0;
+
+    for( int k : keys ) {
+        try {
+            t.put( k, k );
+        } catch( bad_alloc& ) {
+            threw = true;
+            break;
+        }
+        put.push_back( k );
+    }
+
+    allocationsLeft = -1;
+    assert(threw && hasherSeed( t.hasher ) == 0 && t.numBuckets == 1024 );
+    for( int k : put ) {
+        assert(t.get( k ) == k );
+    }
+
+    // the guard tries again on a later put, and this time it can
+    for( int k : keys ) {
+        t.put( k, k );
+    }
+    assert(hasherSeed( t.hasher ) != 0 && t.numEntries == keys.size() );
+}
+
+void check_probe_guards()
+{
+    vector<int> seeded = colliding_keys<Seeded<MyIntHashFn>>( 1024, 200 );
+    vector<int> identity = colliding_keys<MyIntHashFn>( 1024, 200 );
+
+    check_probe_guard<LPHash<int, int, Seeded<MyIntHashFn>, Pow2Index>>( seeded, true );
+    check_probe_guard<RHHash<int, int, Seeded<MyIntHashFn>, Pow2Index>>( seeded, true );
+    check_probe_guard<LPHash<int, int, MyIntHashFn, Pow2Index>>( identity, false );
+    check_probe_guard<RHHash<int, int, MyIntHashFn, Pow2Index>>( identity, false );
+
+    check_probe_guard<RHHash<int, int, Hash64<int>, Pow2Index>>(
+            colliding_keys<Hash64<int>>( 1024, 200 ), true );
+
+    typedef SentinelKeys<int, INT_MIN> Sentinel;
+    check_probe_guard<LPHash<int, int, Seeded<MyIntHashFn>, Pow2Index, std::allocator<char>, Sentinel>>(
+            seeded, true );
+
+    check_reseeded( seeded );
+    check_failed_reseed<LPHash<int, int, Seeded<MyIntHashFn>, Pow2Index, ThrowingAllocator<char>>>( seeded );
+    check_failed_reseed<RHHash<int, int, Seeded<MyIntHashFn>, Pow2Index, ThrowingAllocator<char>>>( seeded );
+
+    // Keys with consecutive homes under the identity, each at its home,
+    // then keys homed just before the earlier ones, in reverse. Each new
+    // key takes a one slot probe and pushes every key after it along,
+    // so only the probes of displaced keys grow past the limit.
+    RHHash<int, int, MyIntHashFn, Pow2Index> rh( 1024, 0.9 );
+
+    for( int h = 0; h < 400; ++h ) {
+        rh.put( h, h );
+    }
+    for( int h = 398; h >= 200; --h ) {
+        rh.put( 1024 + h, h );
+    }
+
+    assert(rh.numBuckets == 2048 && rh.guard.grew );
+    assert(rh.get_dib_stats().max() <= rh.probeLimit() );
+    for( int h = 0; h < 400; ++h ) {
+        assert(rh.get( h ) == h && rh.get_or( 1024 + h, -1 ) == ( h >= 200 && h < 399 ? h : -1 ) );
+    }
+
+    // LPHash's limit follows the current load, so keys colliding under
+    // a seedable hasher are caught long before the table nears its
+    // threshold, where the limit is thousands of slots
+    vector<int> adversarial = colliding_keys<Seeded<HashFn<int>>>( 1024, 200 );
+    LPHash<int, int, Seeded<HashFn<int>>, Pow2Index> lp( 1024, 0.9 );
+
+    for( int k : adversarial ) {
+        lp.put( k, k );
+    }
+
+    assert(hasherSeed( lp.hasher ) != 0 && lp.numBuckets == 1024 );
+    assert(lp.get_dib_stats().max() <= lp.probeLimit() );
+    for( int k : adversarial ) {
+        assert(lp.get( k ) == k );
+    }
+}
+
+// Keys that all share the last bucket spill into the tail past it,
+// which grows to hold them rather than wrapping to the first bucket.
+// Lookups, erase_if and snapshots all see the grown tail.
+template <class Table>
+void check_tail()
+{
+    const char * path = "bench_snapshot.tmp";
+    Table t( 1024, 0.9 );
+    t.guard.factor = 0;
+
+    size_t firstTail = t.tail;
+    vector<int> keys;
+    for( int i = 0; i < 200; ++i ) {
+        keys.push_back( i * 1024 + 1023 );
+        t.put( keys.back(), i );
+    }
+
+    assert(t.numBuckets == 1024 && t.maxDist == 200 );
+    assert(t.tail > firstTail && t.tail >= 200 && !t.buckets[0].occupied() );
+    for( int i = 0; i < 200; ++i ) {
+        assert(t.get( keys[i] ) == i );
+    }
+    assert(!t.contains( 200 * 1024 + 1023 ) && !t.contains( 0 ));
+
+    t.saveSnapshot( path );
+    Table opened;
+    opened.openSnapshot( path, SNAPSHOT_READ_ONLY, true );
+    assert(opened.tail == t.tail && opened.maxDist == t.maxDist );
+    for( int i = 0; i < 200; ++i ) {
+        assert(opened.get( keys[i] ) == i );
+    }
+    std::remove( path );
+
+    assert(t.erase_if( []( const int&, int& v ) { return v % 2 == 1; } ) == 100 );
+    for( int i = 0; i < 200; ++i ) {
+        assert(t.get_or( keys[i], -1 ) == ( i % 2 ? -1 : i ) );
+    }
+    size_t seen = 0;
+    for( auto it = t.begin(); it != t.end(); ++it ) {
+        ++seen;
+    }
+    assert(seen == 100 );
+}
+
+// Strings built from the blocks "Aa" and "B@" all share a djb2 hash,
+// so no RHSoAHash can hold more than MAX_DIST + 1 of them. The insert
+// past that must throw after MAX_GROWS growths, keeping the keys it has.
+void check_soa_same_hash()
+{
+    typedef RHSoAHash<string, int> Table;
+
+    vector<string> keys;
+    for( int bits = 0; keys.size() < 300; ++bits ) {
+        string key;
+        for( int b = 0; b < 9; ++b ) {
+            key += ( bits >> b ) & 1 ? "B@" : "Aa";
+        }
+        keys.push_back( key );
+    }
+
+    HashFn<string> hasher;
+    assert(hasher.hash( keys[0] ) == hasher.hash( keys[299] ) );
+
+    Table t( 1024, 0.9 );
+    size_t fit = 0;
+    bool threw = false;
+
+    for( auto& key : keys ) {
+        try {
+            t.put( key, int( fit ) );
+            ++fit;
+        } catch( std::runtime_error& ) {
+            threw = true;
+            break;
+        }
+    }
+
+    assert(threw && fit == size_t( Table::MAX_DIST + 1 ) );
+    assert(t.numEntries == fit && t.numBuckets <= size_t( 1024 << Table::MAX_GROWS ) );
+
+    for( size_t i = 0; i < fit; ++i ) {
+        assert(t.get( keys[i] ) == int( i ) );
+    }
+
+    // a key whose own probe fits but which pushes an entry it displaces
+    // past MAX_DIST must throw before moving anything
+    RHSoAHash<int, int, MyIntHashFn, Pow2Index> d( 1024, 0.9 );
+    vector<int> in;
+    for( int k = 0; k < 99; ++k ) in.push_back( k << 20 );
+    for( int k = 0; k < 100; ++k ) in.push_back( 1 + ( k << 20 ) );
+    for( int k = 0; k < 58; ++k ) in.push_back( 2 + ( k << 20 ) );
+    for( int key : in ) {
+        d.put( key, key );
+    }
+
+    threw = false;
+    try {
+        d.put( 99 << 20, 0 );
+    } catch( std::runtime_error& ) {
+        threw = true;
+    }
+    assert(threw && d.numEntries == in.size() && !d.contains( 99 << 20 ) );
+    for( int key : in ) {
+        assert(d.get( key ) == key );
+    }
+
+    // a resize that can't complete leaves the table as it was, whether
+    // its keys don't fit in any size it may try or an allocation fails
+    RHSoAHash<string, int, HashFn<string>, ModIndex, ThrowingAllocator<char>> s( 1024, 0.9 );
+    for( size_t i = 0; i < fit; ++i ) {
+        s.put( keys[i], int( i ) );
+    }
+
+    for( int failAlloc = 0; failAlloc < 2; ++failAlloc ) {
+        threw = false;
+        allocationsLeft = failAlloc ? 2 : -1;
+
+        try {
+            s.resize( failAlloc ? 4096 : 1 );
+        } catch( std::runtime_error& ) {
+            threw = !failAlloc;
+        } catch( bad_alloc& ) {
+            threw = failAlloc;
+        }
+
+        allocationsLeft = -1;
+        assert(threw && s.numBuckets == 1024 && s.numEntries == fit );
+        for( size_t i = 0; i < fit; ++i ) {
+            assert(s.get( keys[i] ) == int( i ) );
+        }
+    }
+}
+
+// Fills a HopscotchHash close to its load threshold and checks every
+// entry sits within the neighborhood of its home bucket. Keys that all
+// share one home bucket fill its neighborhood, and the next one throws
+// once growing can't split them, leaving the others in place.
+void check_hopscotch()
+{
+    typedef HopscotchHash<int, int> Hop;
+    Hop t( 1 << 16, 0.95 );
+    size_t n = size_t( t.numBuckets * 0.94 );
+    unordered_map<int, int> ref;
+    mt19937 gen( 5 );
+
+    while( ref.size() < n ) {
+        int key = int( gen() );
+        t.put( key, key / 2 );
+        ref[key] = key / 2;
+    }
+
+    Histogram dibs = t.get_dib_stats();
+    assert(dibs.count() == n && dibs.max() < Hop::NEIGHBORHOOD );
+    for( auto& kv : ref ) {
+        assert(t.get( kv.first ) == kv.second );
+    }
+
+    HopscotchHash<int, int, MyIntHashFn, Pow2Index> same( 1024, 0.9 );
+    for( int i = 0; i < Hop::NEIGHBORHOOD; ++i ) {
+        same.put( i << 20, i );
+    }
+    assert(same.numBuckets == 1024 );
+
+    bool threw = false;
+    try {
+        same.put( Hop::NEIGHBORHOOD << 20, 0 );
+    } catch( std::runtime_error& ) {
+        threw = true;
+    }
+    assert(threw && same.numEntries == size_t( Hop::NEIGHBORHOOD ) );
+    assert(same.numBuckets <= size_t( 1024 << Hop::MAX_GROWS ) );
+
+    for( int i = 0; i < Hop::NEIGHBORHOOD; ++i ) {
+        assert(same.get( i << 20 ) == i );
+    }
+
+    // a resize that can't complete leaves the table as it was, whether
+    // its keys don't fit in any size it may try or an allocation fails
+    HopscotchHash<string, int, HashFn<string>, ModIndex, ThrowingAllocator<char>> s( 1024, 0.9 );
+    for( int i = 0; i < 200; ++i ) {
+        s.put( "key" + to_string( i ), i );
+    }
+
+    for( int failAlloc = 0; failAlloc < 2; ++failAlloc ) {
+        threw = false;
+        allocationsLeft = failAlloc ? 2 : -1;
+
+        try {
+            s.resize( failAlloc ? 4096 : 1 );
+        } catch( std::runtime_error& ) {
+            threw = !failAlloc;
+        } catch( bad_alloc& ) {
+            threw = failAlloc;
+        }
+
+        allocationsLeft = -1;
+        assert(threw && s.numBuckets == 1024 && s.numEntries == 200 );
+        for( int i = 0; i < 200; ++i ) {
+            assert(s.get( "key" + to_string( i ) ) == i );
+        }
+    }
+}
+
+// Keys sharing a SwissHash group must not share fingerprints, or every
+// full slot of the group matches and each probe compares every key.
+// FibonacciIndex picks groups from the top bits of a product of the
+// hash, which is where fingerprints used to come from.
+template <class Table>
+void check_fingerprints()
+{
+    Table t( 1 << 16, 0.875 );
+
+    for( int i = 0; i < 40000; ++i ) {
+        t.put( i, i );
+    }
+
+    size_t pairs = 0, equal = 0;
+
+    for( size_t g = 0; g < t.numGroups; ++g ) {
+        const int8_t * group = t.ctrl + g * Table::GROUP_SIZE;
+
+        for( int i = 0; i < Table::GROUP_SIZE; ++i ) {
+            for( int j = i + 1; j < Table::GROUP_SIZE; ++j ) {
+                if( group[i] >= 0 && group[j] >= 0 ) {
+                    ++pairs;
+                    equal += group[i] == group[j];
+                }
+            }
+        }
+    }
+
+    // about 1 in 128 for independent 7 bit fingerprints
+    assert(pairs > 0 && equal * 32 < pairs );
+}
+
+// Checks the SentinelKeys layout: an <int, int> entry is a key and a
+// value, the reserved keys can't be put and are never found, and
+// tables whose EMPTY key is 0 use zero filled memory as it is.
+template <class Table>
+void check_sentinel_keys()
+{
+    static_assert( sizeof( typename Table::HashEntry ) == 8,
+            "check_sentinel_keys: entries carry more than the key and value" );
+    static_assert( !Table::ZERO_IS_EMPTY,
+            "check_sentinel_keys: INT_MIN keys aren't zero" );
+
+    Table t( 16, 0.9 );
+
+    for( int i = -1000; i < 1000; ++i ) {
+        t.put( i, i );
+    }
+
+    for( int key : { INT_MIN, INT_MIN + 1 } ) {
+        bool threw = false;
+        try {
+            t.put( key, 0 );
+        } catch( std::runtime_error& ) {
+            threw = true;
+        }
+        assert(threw);
+
+        assert(!t.contains( key ));
+        t.remove( key );
+    }
+
+    assert(t.numEntries == 2000 );
+
+    for( int i = -1000; i < 1000; i += 2 ) {
+        t.remove( i );
+    }
+
+    for( int i = -1000; i < 1000; ++i ) {
+        assert(t.get_or( i, INT_MIN ) == ( i % 2 ? i : INT_MIN ) );
+    }
+
+    typedef LPHash<int, int, HashFn<int>, Pow2Index, SparseAllocator<char>,
+            SentinelKeys<int, 0>> Zeroed;
+    static_assert( Zeroed::ZERO_IS_EMPTY, "check_sentinel_keys: 0 keys are zero" );
+
+    Zeroed z( 1 << 16, 0.9 );
+    for( int i = 1; i <= 50000; ++i ) {
+        z.put( i, -i );
+    }
+    for( int i = 0; i <= 50000; ++i ) {
+        assert(z.get_or( i, 0 ) == -i );
+    }
+}
+
+void api_check()
+{
+    check_histogram();
+    check_hash64();
+    check_capacity();
+    check_probe_guards();
+
+    typedef std::allocator<char> Std;
+    typedef SentinelKeys<int, INT_MIN, INT_MIN + 1> Sentinel;
+    check_tail<RHHash<int, int, MyIntHashFn, Pow2Index>>();
+    check_hopscotch();
+    check_soa_same_hash();
+    check_fingerprints<SwissHash<int, int, HashFn<int>, FibonacciIndex>>();
+    check_fingerprints<SwissHash<int, int, Hash64<int>, FibonacciIndex>>();
+    check_fingerprints<SwissHash<int, int>>();
+    check_sentinel_keys<LazyLPHash<int, int, HashFn<int>, ModIndex, Std, Sentinel>>();
+    check_sentinel_keys<LPHash<int, int, HashFn<int>, ModIndex, Std, Sentinel>>();
+#ifdef HASH_STATS
+    check_all_stats();
+#endif
+
+    check_string_table<ChainedHash<string, int>>();
+    check_string_table<LazyLPHash<string, int>>();
+    check_string_table<LPHash<string, int>>();
+    check_string_table<RHHash<string, int>>();
+    check_string_table<RHSoAHash<string, int>>();
+    check_string_table<SwissHash<string, int>>();
+    check_string_table<HopscotchHash<string, int>>();
+
+    check_node_pool();
+
+    typedef HugePageAllocator<char> Huge;
+    check_allocator<ChainedHash<int, int, HashFn<int>, ModIndex, Huge>>();
+    check_allocator<ChainedHash<string, int, HashFn<string>, ModIndex, Huge>>();
+    check_allocator<LazyLPHash<int, int, HashFn<int>, ModIndex, Huge>>();
+    check_allocator<LPHash<int, int, HashFn<int>, ModIndex, Huge>>();
+    check_allocator<RHHash<int, int, HashFn<int>, Pow2Index, Huge>>();
+    check_allocator<RHHash<string, int, HashFn<string>, ModIndex, Huge>>();
+    check_allocator<RHSoAHash<int, int, HashFn<int>, ModIndex, Huge>>();
+    check_allocator<SwissHash<int, int, HashFn<int>, ModIndex, Huge>>();
+    check_allocator<HopscotchHash<int, int, HashFn<int>, ModIndex, Huge>>();
+    check_failed_construction();
+    check_failed_resize<ChainedHash<string, int, HashFn<string>, ModIndex, ThrowingAllocator<char>>>();
+    check_failed_resize<LazyLPHash<string, int, HashFn<string>, ModIndex, ThrowingAllocator<char>>>();
+    check_failed_resize<LPHash<string, int, HashFn<string>, ModIndex, ThrowingAllocator<char>>>();
+    check_failed_resize<RHHash<string, int, HashFn<string>, ModIndex, ThrowingAllocator<char>>>();
+    check_failed_resize<RHSoAHash<string, int, HashFn<string>, ModIndex, ThrowingAllocator<char>>>();
+    check_failed_resize<SwissHash<string, int, HashFn<string>, ModIndex, ThrowingAllocator<char>>>();
+    check_failed_resize<HopscotchHash<string, int, HashFn<string>, ModIndex, ThrowingAllocator<char>>>();
+
+    check_snapshot<RHHash<int, int>, RHHash<int, int, MyIntHashFn>>();
+    check_snapshot<RHHash<int, int, HashFn<int>, Pow2Index>, RHHash<int, int>>();
+    check_snapshot<LPHash<int, int>, LPHash<int, int, MyIntHashFn>>();
+    check_snapshot<LPHash<int, int, HashFn<int>, Pow2Index, Std, Sentinel>,
+            LPHash<int, int, HashFn<int>, Pow2Index, Std, SentinelKeys<int, -1>>>();
+
+    check_erase_if<ChainedHash<int, int>>();
+    check_erase_if<ChainedHash<int, int, HashFn<int>, Pow2Index>>();
+    check_erase_if<LazyLPHash<int, int>>();
+    check_erase_if<LPHash<int, int>>();
+    check_erase_if<LPHash<int, int, HashFn<int>, Pow2Index>>();
+    check_erase_if<RHHash<int, int>>();
+    check_erase_if<RHHash<int, int, HashFn<int>, FastRangeIndex>>();
+    check_erase_if<LazyLPHash<int, int, HashFn<int>, ModIndex, Std, Sentinel>>();
+    check_erase_if<LPHash<int, int, HashFn<int>, Pow2Index, Std, Sentinel>>();
+    check_erase_if<RHSoAHash<int, int>>();
+    check_erase_if<SwissHash<int, int>>();
+    check_erase_if<HopscotchHash<int, int>>();
+    check_erase_if<HopscotchHash<int, int, HashFn<int>, FastRangeIndex>>();
+
+    {
+        ShardedHash<RHHash<int, int>, 16> t;
+
+        for( int i = 0; i < 10000; ++i ) {
+            t.put( i, i );
+        }
+
+        assert(t.erase_if( []( const int& key, int& ) { return key % 3 == 0; } ) == 3334 );
+        assert(t.size() == 6666 && !t.contains( 3 ) && t.get( 4 ) == 4 );
+
+        AnyHashImpl<SwissHash<int, int>> erased( 16, 0.875 );
+        erased.put( 1, 1 );
+        erased.put( 2, 2 );
+        assert(erased.erase_if( []( const int& key, int& ) { return key == 1; } ) == 1 );
+        assert(!erased.contains( 1 ) && erased.contains( 2 ));
+    }
+
+    check_set_ops<RHHash<int, int>>();
+    check_set_ops<RHHash<int, int, HashFn<int>, Pow2Index>>();
+    check_set_ops<RHHash<int, int, HashFn<int>, FastRangeIndex>>();
+    check_set_ops<RHHash<int, int, Hash64<int>, Pow2Index>>();
+
+    check_build<RHHash<int, int>>();
+    check_build<RHHash<int, int, HashFn<int>, Pow2Index>>();
+    check_build<RHHash<int, int, HashFn<int>, FastRangeIndex>>();
+    check_build<RHHash<string, int>>();
+    check_failed_build();
+
+    check_incremental<ChainedHash<int, int>>();
+    check_incremental<ChainedHash<int, int, HashFn<int>, Pow2Index>>();
+    check_incremental<RHHash<int, int>>();
+    check_incremental<RHHash<int, int, HashFn<int>, Pow2Index>>();
+    check_incremental<RHHash<int, int, MyIntHashFn, Pow2Index>>();
+    check_destroy_resizing<ChainedHash<string, string>>();
+    check_destroy_resizing<RHHash<string, string>>();
+    check_destroy_chains();
+
+    check_concurrent<ConcurrentRHHash<int, int>>();
+    check_concurrent<ConcurrentRHHash<int, int, HashFn<int>, Pow2Index>>();
+    check_concurrent<ShardedHash<RHHash<int, int>, 16>>();
+    check_concurrent<ShardedHash<ChainedHash<int, int>, 8>>();
+    check_concurrent<ShardedHash<LPHash<int, int, HashFn<int>, FastRangeIndex>, 4>>();
+    check_concurrent<ShardedHash<RHHash<int, int, HashFn<int>, FibonacciIndex>, 8>>();
+
+    check_batch<ChainedHash<int, int>>();
+    check_batch<LazyLPHash<int, int>>();
+    check_batch<LPHash<int, int>>();
+    check_batch<RHHash<int, int>>();
+    check_batch<LazyLPHash<int, int, HashFn<int>, ModIndex, Std, Sentinel>>();
+    check_batch<LPHash<int, int, HashFn<int>, ModIndex, Std, Sentinel>>();
+    check_batch<RHSoAHash<int, int>>();
+    check_batch<SwissHash<int, int>>();
+    check_batch<HopscotchHash<int, int>>();
+    check_batch<ShardedHash<RHHash<int, int>, 16>>();
+    check_batch<ShardedHash<SwissHash<int, int>, 1>>();
+    check_batch<ShardedHash<RHHash<int, int, HashFn<int>, FibonacciIndex>, 8>>();
+
+    check_shard_spread<ShardedHash<RHHash<int, int, HashFn<int>, FibonacciIndex>, 8>>();
+    check_shard_spread<ShardedHash<RHHash<int, int, HashFn<int>, Pow2Index>, 8>>();
+    check_shard_spread<ShardedHash<LPHash<int, int, HashFn<int>, FastRangeIndex>, 4>>();
+}
+
+void dib_check()
+{
+    random_device rd;
+    mt19937 gen(rd());
+    uniform_int_distribution<int> dis(0, 100000);
+    auto get_num = bind( dis, gen );
+
+    double table_size = 10000;
+    double load_factor = 0.98;
+    int max_entries = table_size * load_factor;
+
+    vector<int> inserts;
+    vector<int> deletes;
+    vector<int> diff;
+
+    for(int i = 0; i < max_entries; ++i) {
+        inserts.push_back( get_num() );
+    }
+
+    for(int i = 0; i < max_entries / 2; ++i) {
+        deletes.push_back( get_num() );
+    }
+
+    set<int> i(inserts.begin(), inserts.end());
+    set<int> d(deletes.begin(), deletes.end());
+
+    set_difference(
+            i.begin(), i.end(),
+            d.begin(), d.end(),
+            inserter(diff, diff.begin())
+            );
+
+    check_table<LazyLPHash<int, int>>( "LazyLPHash",
+            table_size, load_factor, inserts, deletes, diff );
+    check_table<LPHash<int, int>>( "LPHash",
+            table_size, load_factor, inserts, deletes, diff );
+    check_table<RHHash<int, int>>( "RHHash",
+            table_size, load_factor, inserts, deletes, diff );
+    check_table<RHSoAHash<int, int>>( "RHSoAHash",
+            table_size, load_factor, inserts, deletes, diff );
+    check_table<SwissHash<int, int>>( "SwissHash",
+            table_size, load_factor, inserts, deletes, diff );
+    check_table<HopscotchHash<int, int>>( "HopscotchHash",
+            table_size, load_factor, inserts, deletes, diff );
+
+    // index policies
+    check_table<LPHash<int, int, HashFn<int>, Pow2Index>>( "LPHash/pow2",
+            table_size, load_factor, inserts, deletes, diff );
+    check_table<RHHash<int, int, HashFn<int>, Pow2Index>>( "RHHash/pow2",
+            table_size, load_factor, inserts, deletes, diff );
+    check_table<RHHash<int, int, MyIntHashFn, FibonacciIndex>>( "RHHash/fibonacci",
+            table_size, load_factor, inserts, deletes, diff );
+    check_table<RHHash<int, int, HashFn<int>, FastRangeIndex>>( "RHHash/fastrange",
+            table_size, load_factor, inserts, deletes, diff );
+    check_table<SwissHash<int, int, HashFn<int>, Pow2Index>>( "SwissHash/pow2",
+            table_size, load_factor, inserts, deletes, diff );
+
+    // sentinel keys
+    typedef SentinelKeys<int, INT_MIN, INT_MIN + 1> Sentinel;
+    check_table<LazyLPHash<int, int, HashFn<int>, ModIndex, std::allocator<char>, Sentinel>>(
+            "LazyLPHash/sentinel", table_size, load_factor, inserts, deletes, diff );
+    check_table<LPHash<int, int, HashFn<int>, ModIndex, std::allocator<char>, Sentinel>>(
+            "LPHash/sentinel", table_size, load_factor, inserts, deletes, diff );
+}
+
+
+// Wall-clock benchmark. For every table size, load factor and key
+// distribution, each engine is filled to the load factor and then
+// timed on get hits, one by one and through get_batch(), misses
+// through both find() and get(), and removes. Every workload runs
+// twice: once timing the whole loop for throughput, and once timing
+// each operation individually for the latency percentiles.
+
+// Adapter giving std::unordered_map the same interface as the engines,
+// so it can be used as a baseline.
+template <typename K, typename V>
+struct StdHash {
+    // numBuckets buckets that grow past loadThreshold, as in the engines
+    StdHash( size_t numBuckets, float loadThreshold ) {
+        map.max_load_factor( loadThreshold );
+        map.rehash( numBuckets );
+    }
+
+    void put( K key, V val ) {
+        map[key] = val;
+    }
+
+    V get( K key ) {
+        auto it = map.find( key );
+
+        if( it == map.end() ) {
+            throw std::runtime_error("Key doesn't exist.");
+        }
+
+        return it->second;
+    }
+
+    V * find( K key ) {
+        auto it = map.find( key );
+        return it == map.end() ? nullptr : &it->second;
+    }
+
+    size_t get_batch( const K * keys, V * vals, bool * found, size_t n ) {
+        size_t numFound = 0;
+
+        for( size_t i = 0; i < n; ++i ) {
+            auto it = map.find( keys[i] );
+
+            found[i] = it != map.end();
+            if( found[i] ) {
+                vals[i] = it->second;
+                ++numFound;
+            }
+        }
+
+        return numFound;
+    }
+
+    void remove( K key ) {
+        map.erase( key );
+    }
+
+    template <class Pred>
+    size_t erase_if( Pred pred ) {
+        size_t erased = 0;
+
+        for( auto it = map.begin(); it != map.end(); ) {
+            if( pred( it->first, it->second ) ) {
+                it = map.erase( it );
+                ++erased;
+            } else {
+                ++it;
+            }
+        }
+
+        return erased;
+    }
+
+    std::unordered_map<K, V> map;
+};
+
+
+// Calls a table through the type-erased AnyHash interface, to measure
+// the cost of virtual dispatch.
+template <class Table>
+struct Erased {
+    typedef typename Table::key_type K;
+    typedef typename Table::mapped_type V;
+
+    Erased( int numBuckets, float loadThreshold )
+        : table( new AnyHashImpl<Table>( numBuckets, loadThreshold ) ) {}
+
+    void put( K key, V val ) {
+        table->put( key, val );
+    }
+
+    V get( K key ) {
+        return table->get( key );
+    }
+
+    V * find( K key ) {
+        return table->find( key );
+    }
+
+    size_t get_batch( const K * keys, V * vals, bool * found, size_t n ) {
+        size_t numFound = 0;
+
+        for( size_t i = 0; i < n; ++i ) {
+            V * val = table->find( keys[i] );
+
+            found[i] = val != nullptr;
+            if( val ) {
+                vals[i] = *val;
+                ++numFound;
+            }
+        }
+
+        return numFound;
+    }
+
+    void remove( K key ) {
+        table->remove( key );
+    }
+
+    template <class Pred>
+    size_t erase_if( Pred pred ) {
+        return table->erase_if( pred );
+    }
+
+    std::unique_ptr<AnyHash<K, V>> table;
+};
+
+
+// Compacts ChainedHash's nodes on every resize.
+template <class Table>
+struct Compacting : public Table {
+    Compacting( int numBuckets, float loadThreshold )
+        : Table( numBuckets, loadThreshold ) {
+        this->setCompactOnResize( true );
+    }
+};
+
+
+// Enables incremental resizing on tables that support it.
+template <class Table>
+struct Incremental : public Table {
+    Incremental( int numBuckets, float loadThreshold )
+        : Table( numBuckets, loadThreshold ) {
+        this->setIncrementalResize( true );
+    }
+};
+
+
+// Shares a single threaded table between threads behind one lock, as a
+// baseline for the concurrent tables. Readers take the lock shared when
+// Mutex is a shared_mutex.
+template <class Table, class Mutex>
+struct Locked {
+    typedef typename Table::key_type K;
+    typedef typename Table::mapped_type V;
+
+    Locked( int numBuckets, float loadThreshold )
+        : table( numBuckets, loadThreshold ) {}
+
+    void put( K key, V val ) {
+        lock_guard<Mutex> lock( m );
+        table.put( key, val );
+    }
+
+    V get_or( K key, V def ) {
+        shared_lock<Mutex> lock( m );
+        return table.get_or( key, def );
+    }
+
+    void remove( K key ) {
+        lock_guard<Mutex> lock( m );
+        table.remove( key );
+    }
+
+    Table table;
+    Mutex m;
+};
+
+// shared_lock needs lock_shared(), which std::mutex lacks
+struct ExclusiveMutex : public mutex {
+    void lock_shared() { lock(); }
+    void unlock_shared() { unlock(); }
+};
+
+
+enum Dist { UNIFORM, SEQUENTIAL, ZIPFIAN };
+enum Op { PUT, PUT_GROW, GET_HIT, GET_BATCH, FIND_MISS, GET_MISS, REMOVE, ERASE_IF, NUM_OPS };
+
+const char * distNames[] = { "uniform", "sequential", "zipfian" };
+const char * opNames[] = { "put", "put-grow", "get-hit", "get-batch", "find-miss", "get-miss", "remove", "erase-if" };
+
+typedef chrono::steady_clock Clock;
+
+static inline uint64_t now_ns() {
+    return chrono::duration_cast<chrono::nanoseconds>(
+            Clock::now().time_since_epoch() ).count();
+}
+
+// Keeps the compiler from discarding the results of get()
+static volatile long long sink;
+
+
+// murmur3's 32 bit finalizer. It is a bijection, so scrambling distinct
+// indices gives distinct pseudo-random keys.
+static inline uint32_t scramble( uint32_t x ) {
+    x ^= x >> 16;
+    x *= 0x85ebca6b;
+    x ^= x >> 13;
+    x *= 0xc2b2ae35;
+    x ^= x >> 16;
+    return x;
+}
+
+
+// Zipfian generator over [0, n) from Gray et al., "Quickly Generating
+// Billion-Record Synthetic Databases", as used by YCSB.
+struct Zipf {
+    Zipf( uint64_t n, double theta = 0.99 ) : n(n), theta(theta) {
+        double zeta2 = zeta( 2 );
+        zetan = zeta( n );
+        alpha = 1.0 / ( 1.0 - theta );
+        eta = ( 1.0 - pow( 2.0 / n, 1.0 - theta ) ) / ( 1.0 - zeta2 / zetan );
+    }
+
+    double zeta( uint64_t count ) {
+        double sum = 0;
+        for( uint64_t i = 1; i <= count; ++i ) {
+            sum += 1.0 / pow( double(i), theta );
+        }
+        return sum;
+    }
+
+    template <class Gen>
+    uint64_t operator()( Gen& gen ) {
+        double u = uniform_real_distribution<double>( 0.0, 1.0 )( gen );
+        double uz = u * zetan;
+
+        if( uz < 1.0 ) return 0;
+        if( uz < 1.0 + pow( 0.5, theta ) ) return 1;
+
+        uint64_t rank = uint64_t( n * pow( eta * u - eta + 1.0, alpha ) );
+        return rank < n ? rank : n - 1;
+    }
+
+    uint64_t n;
+    double theta, zetan, alpha, eta;
+};
+
+
+// Keys and access orders shared by every engine for one configuration.
+struct Workload {
+    Workload( int capacity, double load, Dist dist, size_t maxOps )
+        : capacity(capacity), load(load), dist(dist) {
+        mt19937_64 gen( 12345 );
+        size_t n = size_t( capacity * load );
+        size_t ops = min( n, maxOps );
+
+        // the upper half of the key space is never inserted, so it
+        // provides the misses
+        for( size_t i = 0; i < n; ++i ) {
+            keys.push_back( dist == SEQUENTIAL ? int(i) : int( scramble( i ) ) );
+            misses.push_back( dist == SEQUENTIAL ?
+                    int( n + i ) : int( scramble( n + i ) ) );
+        }
+
+        if( dist == SEQUENTIAL ) {
+            for( size_t i = 0; i < ops; ++i ) {
+                hitOrder.push_back( i );
+                missOrder.push_back( i );
+                removeOrder.push_back( i );
+            }
+        } else if( dist == UNIFORM ) {
+            uniform_int_distribution<size_t> dis( 0, n - 1 );
+            for( size_t i = 0; i < ops; ++i ) {
+                hitOrder.push_back( dis( gen ) );
+                missOrder.push_back( dis( gen ) );
+            }
+        } else {
+            Zipf zipf( n );
+            for( size_t i = 0; i < ops; ++i ) {
+                hitOrder.push_back( zipf( gen ) );
+                missOrder.push_back( zipf( gen ) );
+            }
+        }
+
+        // removes must hit distinct keys to stay meaningful
+        if( dist != SEQUENTIAL ) {
+            vector<size_t> perm( n );
+            for( size_t i = 0; i < n; ++i ) perm[i] = i;
+            shuffle( perm.begin(), perm.end(), gen );
+            removeOrder.assign( perm.begin(), perm.begin() + ops );
+        }
+    }
+
+    int capacity;
+    double load;
+    Dist dist;
+    vector<int> keys;
+    vector<int> misses;
+    vector<size_t> hitOrder;
+    vector<size_t> missOrder;
+    vector<size_t> removeOrder;
+};
+
+
+struct OpResult {
+    double opsPerSec = 0;
+    double p50 = 0, p99 = 0, p999 = 0, max = 0;
+};
+
+
+// Median cost of reading the clock twice, subtracted from every latency
+// sample so that fast operations are not dominated by the timer.
+static uint64_t timer_overhead() {
+    static uint64_t overhead = ~0ULL;
+
+    if( overhead == ~0ULL ) {
+        vector<uint64_t> samples( 10001 );
+        for( auto& s : samples ) {
+            uint64_t t0 = now_ns();
+            s = now_ns() - t0;
+        }
+        nth_element( samples.begin(), samples.begin() + samples.size() / 2,
+                samples.end() );
+        overhead = samples[samples.size() / 2];
+    }
+
+    return overhead;
+}
+
+static double percentile( vector<uint64_t>& lat, double p ) {
+    size_t k = min( lat.size() - 1, size_t( p * lat.size() ) );
+    nth_element( lat.begin(), lat.begin() + k, lat.end() );
+    return double( lat[k] );
+}
+
+template <class Fn>
+void time_op( size_t n, bool perOp, Fn fn, OpResult& res ) {
+    if( n == 0 ) return;
+
+    if( !perOp ) {
+        uint64_t start = now_ns();
+        for( size_t i = 0; i < n; ++i ) fn( i );
+        uint64_t elapsed = max<uint64_t>( now_ns() - start, 1 );
+        res.opsPerSec = double( n ) * 1e9 / double( elapsed );
+        return;
+    }
+
+    uint64_t overhead = timer_overhead();
+    vector<uint64_t> lat( n );
+
+    for( size_t i = 0; i < n; ++i ) {
+        uint64_t t0 = now_ns();
+        fn( i );
+        uint64_t t = now_ns() - t0;
+        lat[i] = t > overhead ? t - overhead : 0;
+    }
+
+    res.p50 = percentile( lat, 0.50 );
+    res.p99 = percentile( lat, 0.99 );
+    res.p999 = percentile( lat, 0.999 );
+    res.max = double( *max_element( lat.begin(), lat.end() ) );
+}
+
+template <class Table>
+void run_pass( const Workload& w, bool perOp, OpResult res[NUM_OPS] ) {
+    Table t( w.capacity, float( w.load ) );
+
+    time_op( w.keys.size(), perOp, [&]( size_t i ) {
+        t.put( w.keys[i], w.keys[i] );
+    }, res[PUT] );
+
+    // the same puts into a table that starts small, so they include
+    // every resize on the way; resize pauses show up in the max latency
+    {
+        Table grown( 16, float( w.load ) );
+
+        time_op( w.keys.size(), perOp, [&]( size_t i ) {
+            grown.put( w.keys[i], w.keys[i] );
+        }, res[PUT_GROW] );
+    }
+
+    time_op( w.hitOrder.size(), perOp, [&]( size_t i ) {
+        sink += t.get( w.keys[w.hitOrder[i]] );
+    }, res[GET_HIT] );
+
+    // the same hits through get_batch(). Each sample is a whole batch,
+    // and is scaled back to a per-key rate and latency.
+    {
+        const size_t batch = 256;
+        size_t numBatches = w.hitOrder.size() / batch;
+        vector<int> keys( numBatches * batch );
+        vector<int> vals( batch );
+        unique_ptr<bool[]> found( new bool[batch] );
+
+        for( size_t i = 0; i < keys.size(); ++i ) {
+            keys[i] = w.keys[w.hitOrder[i]];
+        }
+
+        time_op( numBatches, perOp, [&]( size_t i ) {
+            sink += t.get_batch( keys.data() + i * batch, vals.data(), found.get(), batch );
+        }, res[GET_BATCH] );
+
+        if( perOp ) {
+            res[GET_BATCH].p50 /= batch;
+            res[GET_BATCH].p99 /= batch;
+            res[GET_BATCH].p999 /= batch;
+            res[GET_BATCH].max /= batch;
+        } else {
+            res[GET_BATCH].opsPerSec *= batch;
+        }
+    }
+
+    time_op( w.missOrder.size(), perOp, [&]( size_t i ) {
+        sink += t.find( w.misses[w.missOrder[i]] ) != nullptr;
+    }, res[FIND_MISS] );
+
+    // misses through get() pay for unwinding an exception each, so
+    // fewer of them are timed
+    time_op( min<size_t>( w.missOrder.size(), 10000 ), perOp, [&]( size_t i ) {
+        try {
+            sink += t.get( w.misses[w.missOrder[i]] );
+        } catch( const exception& e ) {}
+    }, res[GET_MISS] );
+
+    time_op( w.removeOrder.size(), perOp, [&]( size_t i ) {
+        t.remove( w.keys[w.removeOrder[i]] );
+    }, res[REMOVE] );
+
+    // a single erase_if of about a fifth of the keys from a full table,
+    // scaled back to a per-key rate and latency
+    {
+        Table full( w.capacity, float( w.load ) );
+        size_t erased = 0;
+
+        for( int k : w.keys ) {
+            full.put( k, k );
+        }
+
+        time_op( 1, perOp, [&]( size_t ) {
+            erased = full.erase_if( []( const int& key, int& ) { return key % 5 == 0; } );
+        }, res[ERASE_IF] );
+
+        double scale = double( max<size_t>( erased, 1 ) );
+
+        if( perOp ) {
+            res[ERASE_IF].p50 /= scale;
+            res[ERASE_IF].p99 /= scale;
+            res[ERASE_IF].p999 /= scale;
+            res[ERASE_IF].max /= scale;
+        } else {
+            res[ERASE_IF].opsPerSec *= scale;
+        }
+    }
+}
+
+struct Options {
+    vector<int> sizes;
+    vector<int> threads;
+    vector<double> loads;
+    vector<Dist> dists;
+    size_t maxOps;
+    bool csv;
+    bool check;
+    bool bench;
+    bool scaling;
+    size_t hugeKeys;
+};
+
+template <class Table>
+void run_engine( const char * name, const Workload& w, const Options& opt ) {
+    OpResult res[NUM_OPS];
+    run_pass<Table>( w, false, res );
+    run_pass<Table>( w, true, res );
+
+    for( int op = 0; op < NUM_OPS; ++op ) {
+        const char * fmt = opt.csv ?
+            "%s,%s,%d,%.2f,%s,%.0f,%.0f,%.0f,%.0f,%.0f\n" :
+            "%-16s %-11s %10d %5.2f %-9s %12.0f %8.0f %8.0f %8.0f %10.0f\n";
+
+        printf( fmt, name, distNames[w.dist], w.capacity, w.load,
+                opNames[op], res[op].opsPerSec,
+                res[op].p50, res[op].p99, res[op].p999, res[op].max );
+    }
+}
+
+void run_benchmarks( const Options& opt ) {
+    printf( opt.csv ?
+            "engine,dist,buckets,load,op,ops_per_sec,p50_ns,p99_ns,p999_ns,max_ns\n" :
+            "%-16s %-11s %10s %5s %-9s %12s %8s %8s %8s %10s\n",
+            "engine", "dist", "buckets", "load", "op",
+            "ops/sec", "p50 ns", "p99 ns", "p999 ns", "max ns" );
+
+    // no workload key is INT_MIN or INT_MIN + 1
+    typedef SentinelKeys<int, INT_MIN> Sentinel;
+
+    for( int size : opt.sizes ) {
+        for( double load : opt.loads ) {
+            for( Dist dist : opt.dists ) {
+                Workload w( size, load, dist, opt.maxOps );
+
+                run_engine<StdHash<int, int>>( "unordered", w, opt );
+                run_engine<LazyLPHash<int, int>>( "LazyLPHash", w, opt );
+                run_engine<LPHash<int, int>>( "LPHash", w, opt );
+                run_engine<ChainedHash<int, int>>( "ChainedHash", w, opt );
+                run_engine<Incremental<ChainedHash<int, int>>>( "ChainedHash/incr", w, opt );
+                run_engine<Compacting<ChainedHash<int, int>>>( "ChainedHash/cmpct", w, opt );
+                run_engine<RHHash<int, int>>( "RHHash", w, opt );
+                run_engine<Incremental<RHHash<int, int>>>( "RHHash/incr", w, opt );
+                run_engine<RHSoAHash<int, int>>( "RHSoAHash", w, opt );
+                run_engine<SwissHash<int, int>>( "SwissHash", w, opt );
+                run_engine<HopscotchHash<int, int>>( "HopscotchHash", w, opt );
+                run_engine<Erased<RHHash<int, int>>>( "RHHash/virtual", w, opt );
+                run_engine<RHHash<int, int, HashFn<int>, ModIndex, HugePageAllocator<char>>>(
+                        "RHHash/huge", w, opt );
+                run_engine<RHHash<int, int, HashFn<int>, Pow2Index>>(
+                        "RHHash/pow2", w, opt );
+                run_engine<RHHash<int, int, HashFn<int>, FibonacciIndex>>(
+                        "RHHash/fib", w, opt );
+                run_engine<RHHash<int, int, HashFn<int>, FastRangeIndex>>(
+                        "RHHash/frange", w, opt );
+                run_engine<LPHash<int, int, HashFn<int>, ModIndex, std::allocator<char>, Sentinel>>(
+                        "LPHash/sentinel", w, opt );
+
+                fflush( stdout );
+            }
+        }
+    }
+}
+
+// Set operation benchmark: two RHHash tables of the same capacity, at
+// half load and sharing half of their keys, are subtracted, intersected
+// and merged, and the same results are built by loops over the public
+// API. merge-grow merges tables with a 0.7 load threshold, which their
+// union passes, so the table grows partway. Reports the keys of both
+// tables processed per second.
+void run_set_op_benchmarks( const Options& opt ) {
+    printf( opt.csv ?
+            "\nengine,buckets,op,keys_per_sec\n" :
+            "\n%-16s %10s %-12s %12s\n",
+            "engine", "buckets", "op", "keys/sec" );
+
+    typedef RHHash<int, int> RH;
+
+    for( int size : opt.sizes ) {
+        Workload w( size, 1.0, UNIFORM, 0 );
+        size_t n = w.keys.size() / 2;
+        size_t shared = n / 2;
+
+        auto fill = [&]( RH& a, RH& b ) {
+            for( size_t i = 0; i < n; ++i ) {
+                a.put( w.keys[i], 1 );
+                b.put( w.keys[n - shared + i], 2 );
+            }
+        };
+
+        auto report = [&]( const char * name, const char * op, uint64_t elapsed ) {
+            double keysPerSec = double( 2 * n ) * 1e9 / double( max<uint64_t>( elapsed, 1 ) );
+            printf( opt.csv ? "%s,%d,%s,%.0f\n" : "%-16s %10d %-12s %12.0f\n",
+                    name, size, op, keysPerSec );
+        };
+
+        auto sum = []( const int& mine, const int& theirs ) { return mine + theirs; };
+
+        for( int op = 0; op < 4; ++op ) {
+            const char * opName = op == 0 ? "subtract" : op == 1 ? "intersect" :
+                op == 2 ? "merge" : "merge-grow";
+            float threshold = op == 3 ? 0.7f : 0.9f;
+
+            {
+                RH a( size, threshold ), b( size, threshold );
+                fill( a, b );
+
+                uint64_t start = now_ns();
+                if( op == 0 ) a.subtract( b );
+                else if( op == 1 ) a.intersect( b, sum );
+                else a.merge( b, sum );
+                report( "RHHash/setop", opName, now_ns() - start );
+            }
+
+            {
+                RH a( size, threshold ), b( size, threshold );
+                fill( a, b );
+
+                uint64_t start = now_ns();
+                if( op == 0 ) {
+                    for( auto kv : b ) a.remove( kv.first );
+                } else if( op == 1 ) {
+                    a.erase_if( [&]( const int& key, int& val ) {
+                        int * theirs = b.find( key );
+                        if( theirs ) val += *theirs;
+                        return theirs == nullptr;
+                    } );
+                } else {
+                    for( auto kv : b ) {
+                        auto res = a.try_emplace( kv.first, kv.second );
+                        if( !res.second ) *res.first += kv.second;
+                    }
+                }
+                report( "RHHash/loop", opName, now_ns() - start );
+            }
+        }
+
+        fflush( stdout );
+    }
+}
+
+// URL-like string keys, about 70 bytes each
+vector<string> make_urls( size_t n ) {
+    mt19937_64 rng( 11 );
+    vector<string> urls;
+    char buf[128];
+
+    for( size_t i = 0; i < n; ++i ) {
+        snprintf( buf, sizeof( buf ), "https://www.example.com/catalog/%u/item/%zu?ref=%016llx&page=%u",
+                unsigned( rng() % 500 ), i, (unsigned long long) rng(), unsigned( rng() % 20 ) );
+        urls.push_back( buf );
+    }
+
+    return urls;
+}
+
+// Times one hasher on URL-like keys: hashing alone, and get hits in a
+// Robin Hood and a linear probing table. Also reports the longest probe
+// in the linear probing table.
+template <class Hasher>
+void run_hasher( const char * name, const vector<string>& urls, const vector<size_t>& order,
+        const Options& opt ) {
+    auto report = [&]( const char * engine, const char * op, uint64_t elapsed, uint64_t maxDib ) {
+        double keysPerSec = double( urls.size() ) * 1e9 / double( max<uint64_t>( elapsed, 1 ) );
+        printf( opt.csv ? "%s,%s,%s,%.0f,%llu\n" : "%-16s %-8s %-6s %12.0f %8llu\n",
+                name, engine, op, keysPerSec, (unsigned long long) maxDib );
+    };
+
+    Hasher hasher;
+    uint64_t start = now_ns();
+    for( size_t i : order ) {
+        sink += hasher.hash( urls[i] );
+    }
+    report( "-", "hash", now_ns() - start, 0 );
+
+    int capacity = int( urls.size() / 0.9 ) + 1;
+
+    RHHash<string, int, Hasher> rh( capacity, 0.95 );
+    LPHash<string, int, Hasher> lp( capacity, 0.95 );
+
+    for( size_t i = 0; i < urls.size(); ++i ) {
+        rh.put( urls[i], int( i ) );
+        lp.put( urls[i], int( i ) );
+    }
+
+    start = now_ns();
+    for( size_t i : order ) {
+        sink += *rh.find( urls[i] );
+    }
+    report( "RHHash", "get", now_ns() - start, rh.get_dib_stats().max() );
+
+    start = now_ns();
+    for( size_t i : order ) {
+        sink += *lp.find( urls[i] );
+    }
+    report( "LPHash", "get", now_ns() - start, lp.get_dib_stats().max() );
+}
+
+void run_hash_benchmarks( const Options& opt ) {
+    printf( opt.csv ?
+            "\nhasher,engine,op,keys_per_sec,max_dib\n" :
+            "\n%-16s %-8s %-6s %12s %8s\n",
+            "hasher", "engine", "op", "keys/sec", "max dib" );
+
+    size_t n = 1 << 18;
+    vector<string> urls = make_urls( n );
+    vector<size_t> order( n );
+
+    for( size_t i = 0; i < n; ++i ) {
+        order[i] = i;
+    }
+    shuffle( order.begin(), order.end(), mt19937( 3 ) );
+
+    run_hasher<HashFn<string>>( "HashFn(djb2)", urls, order, opt );
+    run_hasher<Hash64<string>>( "Hash64(wyhash)", urls, order, opt );
+
+    fflush( stdout );
+}
+
+// Puts and gets keys that all collide in bucket 0 of a fresh table
+// under seed 0, with the probe guard on and off.
+template <class Table>
+void run_guarded( const char * name, const vector<int>& keys, const Options& opt ) {
+    for( int on = 1; on >= 0; --on ) {
+        Table t( 8192, 0.9 );
+        t.guard.factor = on ? t.guard.factor : 0;
+
+        uint64_t start = now_ns();
+        for( int k : keys ) {
+            t.put( k, k );
+        }
+        for( int k : keys ) {
+            sink += t.get( k );
+        }
+        uint64_t elapsed = now_ns() - start;
+
+        double keysPerSec = double( keys.size() ) * 1e9 / double( max<uint64_t>( elapsed, 1 ) );
+        printf( opt.csv ? "%s,%s,%.0f,%llu\n" : "%-8s %-6s %12.0f %8llu\n",
+                name, on ? "on" : "off", keysPerSec,
+                (unsigned long long) t.get_dib_stats().max() );
+    }
+}
+
+void run_guard_benchmarks( const Options& opt ) {
+    printf( opt.csv ?
+            "\nengine,guard,keys_per_sec,max_dib\n" :
+            "\n%-8s %-6s %12s %8s\n",
+            "engine", "guard", "keys/sec", "max dib" );
+
+    vector<int> keys = colliding_keys<Hash64<int>>( 8192, 4096 );
+
+    run_guarded<LPHash<int, int, Hash64<int>, Pow2Index>>( "LPHash", keys, opt );
+    run_guarded<RHHash<int, int, Hash64<int>, Pow2Index>>( "RHHash", keys, opt );
+
+    fflush( stdout );
+}
+
+// 64 byte cache line holding the byte at p
+inline uintptr_t cache_line( const void * p ) {
+    return uintptr_t( p ) / 64;
+}
+
+// Number of cache lines a lookup of key reads from the table's arrays,
+// found by reading the same slots the lookup does. A Robin Hood lookup
+// reads every slot from home to the key, or to the first entry closer
+// to its own home than the probe for a miss.
+template <typename K, typename V, class H, class I, class A>
+size_t lines_read( RHHash<K, V, H, I, A>& t, const K& key ) {
+    auto hash = t.hasher.hash( key );
+    size_t home = t.indexer.index( hash );
+    size_t last = t.lookup( key, hash );
+
+    if( last == NOT_FOUND ) {
+        size_t end = home + size_t( t.maxDist );
+        last = home;
+        for( int dist = 1; last + 1 < end && t.distAt( last ) >= dist; ++last, ++dist ) {}
+    }
+
+    return cache_line( &t.buckets[last] ) - cache_line( &t.buckets[home] ) + 1;
+}
+
+// A hopscotch lookup reads the home bucket's bitmap, then the entries
+// it marks, in order, up to the key.
+template <typename K, typename V, class H, class I, class A>
+size_t lines_read( HopscotchHash<K, V, H, I, A>& t, const K& key ) {
+    typedef HopscotchHash<K, V, H, I, A> Table;
+    size_t home = t.indexer.index( t.hasher.hash( key ) );
+    size_t lines = 1;
+    uintptr_t line = 0;
+
+    for( typename Table::HopBits hop = t.hops[home]; hop; hop &= hop - 1 ) {
+        size_t idx = home + Table::lowestBit( hop );
+
+        if( cache_line( &t.entries[idx] ) != line ) {
+            line = cache_line( &t.entries[idx] );
+            ++lines;
+        }
+
+        if( t.entries[idx].key == key ) break;
+    }
+
+    return lines;
+}
+
+// Bounded lookup benchmark: hopscotch and Robin Hood tables filled to
+// load 0.95 with uniform keys, timed on get hits and find misses.
+// Reports the load each table ends at, as a hopscotch table that can't
+// place a key grows early, the mean number of cache lines each hit and
+// miss reads, from lines_read(), and the mean and longest distance of
+// its entries from their home buckets, from get_dib_stats().
+template <class Table>
+void run_bounded( const char * name, const Workload& w, const Options& opt ) {
+    Table t( w.capacity, float( w.load ) );
+
+    for( int k : w.keys ) {
+        t.put( k, k );
+    }
+
+    auto rate = [&]( size_t n, uint64_t elapsed ) {
+        return double( n ) * 1e9 / double( max<uint64_t>( elapsed, 1 ) );
+    };
+
+    uint64_t start = now_ns();
+    for( size_t i : w.hitOrder ) {
+        sink += *t.find( w.keys[i] );
+    }
+    double hits = rate( w.hitOrder.size(), now_ns() - start );
+
+    start = now_ns();
+    for( size_t i : w.missOrder ) {
+        sink += t.find( w.misses[i] ) != nullptr;
+    }
+    double misses = rate( w.missOrder.size(), now_ns() - start );
+
+    size_t hitLines = 0, missLines = 0;
+    for( size_t i : w.hitOrder ) {
+        hitLines += lines_read( t, w.keys[i] );
+    }
+    for( size_t i : w.missOrder ) {
+        missLines += lines_read( t, w.misses[i] );
+    }
+
+    Histogram dibs = t.get_dib_stats();
+
+    printf( opt.csv ? "%s,%d,%.3f,%.0f,%.0f,%.2f,%.2f,%.2f,%llu\n" :
+            "%-16s %10d %5.3f %12.0f %12.0f %9.2f %10.2f %8.2f %8llu\n",
+            name, w.capacity, t.getLoadFactor(), hits, misses,
+            double( hitLines ) / double( max<size_t>( w.hitOrder.size(), 1 ) ),
+            double( missLines ) / double( max<size_t>( w.missOrder.size(), 1 ) ),
+            dibs.mean(), (unsigned long long) dibs.max() );
+}
+
+void run_bounded_benchmarks( const Options& opt ) {
+    printf( opt.csv ?
+            "\nengine,buckets,load,get_hit_per_sec,find_miss_per_sec,hit_lines,miss_lines,mean_dib,max_dib\n" :
+            "\n%-16s %10s %5s %12s %12s %9s %10s %8s %8s\n",
+            "engine", "buckets", "load", "hits/sec", "misses/sec", "hit lines", "miss lines",
+            "mean dib", "max dib" );
+
+    for( int size : opt.sizes ) {
+        Workload w( size, 0.95, UNIFORM, opt.maxOps );
+
+        run_bounded<RHHash<int, int>>( "RHHash", w, opt );
+        run_bounded<HopscotchHash<int, int>>( "HopscotchHash", w, opt );
+
+        fflush( stdout );
+    }
+}
+
+// Benchmark of a table with billions of keys, far past 2^31 entries,
+// which needs size_t capacities and a 64 bit hash past 2^32 buckets.
+// Keys are i times an odd constant, so they are unique, and entries
+// take 32 bytes, so 3 billion keys need 128 GB. Fails cleanly when the
+// memory isn't there.
+void run_huge_benchmark( size_t n, const Options& opt ) {
+    typedef RHHash<uint64_t, uint32_t, Hash64<uint64_t>, Pow2Index, HugePageAllocator<char>> Table;
+    const uint64_t STRIDE = 0x9e3779b97f4a7c15ull;
+    const size_t numGets = min<size_t>( n, 100000000 );
+
+    auto report = [&]( const char * op, size_t buckets, size_t keys, uint64_t elapsed ) {
+        double keysPerSec = double( keys ) * 1e9 / double( max<uint64_t>( elapsed, 1 ) );
+        printf( opt.csv ? "%s,%zu,%zu,%s,%.0f\n" : "%-8s %14zu %14zu %-6s %12.0f\n",
+                "RHHash", n, buckets, op, keysPerSec );
+        fflush( stdout );
+    };
+
+    printf( opt.csv ?
+            "\nengine,keys,buckets,op,keys_per_sec\n" :
+            "\n%-8s %14s %14s %-6s %12s\n",
+            "engine", "keys", "buckets", "op", "keys/sec" );
+
+    try {
+        Table t( size_t( n / 0.9 ) + 1, 0.95 );
+
+        uint64_t start = now_ns();
+        for( size_t i = 0; i < n; ++i ) {
+            t.put( i * STRIDE, uint32_t( i ) );
+        }
+        report( "put", t.numBuckets, n, now_ns() - start );
+
+        mt19937_64 rng( 1 );
+        start = now_ns();
+        for( size_t j = 0; j < numGets; ++j ) {
+            sink += t.get_or( ( rng() % n ) * STRIDE, 0 );
+        }
+        report( "get", t.numBuckets, numGets, now_ns() - start );
+
+        start = now_ns();
+        for( size_t j = 0; j < numGets; ++j ) {
+            sink += t.get_or( ( n + rng() % n ) * STRIDE, 0 );
+        }
+        report( "miss", t.numBuckets, numGets, now_ns() - start );
+
+        assert(t.numEntries == n );
+    } catch( bad_alloc& ) {
+        cerr << "run_huge_benchmark: not enough memory for " << n << " keys" << endl;
+    }
+}
+
+// Multithreaded scaling benchmark. A table is filled halfway with the
+// workload's keys, then every thread runs its share of a fixed number
+// of operations, mixing get_or() with puts and removes of random keys.
+// Reports the total throughput of all threads.
+template <class Table>
+void run_scaling( const char * name, const Workload& w, int numThreads,
+        int readPercent, const Options& opt ) {
+    Table t( w.capacity, 0.9 );
+
+    for( int k : w.keys ) {
+        t.put( k, k );
+    }
+
+    const size_t totalOps = 4000000;
+    size_t opsPerThread = totalOps / numThreads;
+    vector<thread> threads;
+
+    uint64_t start = now_ns();
+
+    for( int id = 0; id < numThreads; ++id ) {
+        threads.emplace_back( [&, id]() {
+            uint32_t rng = scramble( id + 1 );
+            long long sum = 0;
+            bool removeNext = false;
+
+            for( size_t i = 0; i < opsPerThread; ++i ) {
+                // xorshift, cheap enough not to hide the table
+                rng ^= rng << 13;
+                rng ^= rng >> 17;
+                rng ^= rng << 5;
+
+                int k = w.keys[rng % w.keys.size()];
+
+                if( int( ( rng >> 8 ) % 100 ) < readPercent ) {
+                    sum += t.get_or( k, 0 );
+                } else if( removeNext ) {
+                    t.remove( k );
+                } else {
+                    t.put( k, k );
+                }
+
+                removeNext ^= int( ( rng >> 8 ) % 100 ) >= readPercent;
+            }
+
+            sink += sum;
+        } );
+    }
+
+    for( auto& th : threads ) {
+        th.join();
+    }
+
+    uint64_t elapsed = max<uint64_t>( now_ns() - start, 1 );
+    double opsPerSec = double( opsPerThread * numThreads ) * 1e9 / double( elapsed );
+
+    printf( opt.csv ? "%s,%d,%d,%d,%.0f\n" : "%-16s %10d %8d %6d %12.0f\n",
+            name, w.capacity, numThreads, readPercent, opsPerSec );
+}
+
+void run_scaling_benchmarks( const Options& opt ) {
+    printf( opt.csv ?
+            "engine,buckets,threads,read_pct,ops_per_sec\n" :
+            "%-16s %10s %8s %6s %12s\n",
+            "engine", "buckets", "threads", "read%", "ops/sec" );
+
+    typedef RHHash<int, int> RH;
+
+    for( int size : opt.sizes ) {
+        Workload w( size, 0.5, UNIFORM, 0 );
+
+        for( int readPercent : { 90, 99 } ) {
+            for( int numThreads : opt.threads ) {
+                run_scaling<Locked<RH, ExclusiveMutex>>( "RHHash/mutex",
+                        w, numThreads, readPercent, opt );
+                run_scaling<Locked<RH, shared_mutex>>( "RHHash/rwlock",
+                        w, numThreads, readPercent, opt );
+                run_scaling<ConcurrentRHHash<int, int>>( "ConcurrentRH",
+                        w, numThreads, readPercent, opt );
+                run_scaling<ShardedHash<RH, 64>>( "ShardedRH/64",
+                        w, numThreads, readPercent, opt );
+
+                fflush( stdout );
+            }
+        }
+    }
+}
+
+// Bulk build benchmark: loads the workload's keys into an empty table
+// with a put loop, which resizes along the way, and with build() on a
+// growing number of threads.
+void run_build_benchmarks( const Options& opt ) {
+    printf( opt.csv ?
+            "\nengine,buckets,threads,keys_per_sec\n" :
+            "\n%-16s %10s %8s %12s\n",
+            "engine", "buckets", "threads", "keys/sec" );
+
+    typedef RHHash<int, int> RH;
+
+    auto report = [&]( const char * name, const Workload& w, int numThreads, uint64_t elapsed ) {
+        double keysPerSec = double( w.keys.size() ) * 1e9 / double( max<uint64_t>( elapsed, 1 ) );
+        printf( opt.csv ? "%s,%d,%d,%.0f\n" : "%-16s %10d %8d %12.0f\n",
+                name, w.capacity, numThreads, keysPerSec );
+    };
+
+    for( int size : opt.sizes ) {
+        Workload w( size, 0.9, UNIFORM, 0 );
+        vector<pair<int, int>> pairs;
+
+        for( int k : w.keys ) {
+            pairs.emplace_back( k, k );
+        }
+
+        {
+            RH t( 16, 0.9 );
+            uint64_t start = now_ns();
+            for( auto& kv : pairs ) {
+                t.put( kv.first, kv.second );
+            }
+            report( "RHHash/put", w, 1, now_ns() - start );
+        }
+
+        for( int numThreads : opt.threads ) {
+            RH t( 16, 0.9 );
+            uint64_t start = now_ns();
+            t.build( pairs.begin(), pairs.end(), numThreads );
+            report( "RHHash/build", w, numThreads, now_ns() - start );
+        }
+
+        fflush( stdout );
+    }
+}
+
+void usage( const char * prog ) {
+    cerr << "usage: " << prog << " [--full] [--csv] [--no-check] [--no-bench] [--threads] [--huge [N]]" << endl
+         << "  --full      sweep table sizes well past the LLC and more load factors" << endl
+         << "  --csv       print benchmark results as CSV" << endl
+         << "  --no-check  skip the probe length check" << endl
+         << "  --no-bench  only run the probe length check" << endl
+         << "  --threads   run the multithreaded scaling benchmark instead" << endl
+         << "  --huge [N]  fill one table with N keys, 3 billion by default, instead" << endl;
+}
+
+int main( int argc, char ** argv )
+{
+    Options opt;
+    opt.sizes = { 1 << 11, 1 << 14, 1 << 18 };
+    opt.loads = { 0.5, 0.9, 0.98 };
+    opt.dists = { UNIFORM, SEQUENTIAL, ZIPFIAN };
+    opt.maxOps = 200000;
+    opt.csv = false;
+    opt.check = true;
+    opt.bench = true;
+    opt.scaling = false;
+    opt.hugeKeys = 0;
+    opt.threads = { 1, 2, 4, 8, 16, 32, 64 };
+
+    for( int i = 1; i < argc; ++i ) {
+        if( !strcmp( argv[i], "--full" ) ) {
+            // 2K buckets fit in L1, 16M buckets are far past any LLC
+            opt.sizes = { 1 << 11, 1 << 14, 1 << 18, 1 << 21, 1 << 24 };
+            opt.loads = { 0.5, 0.7, 0.9, 0.95, 0.98 };
+        } else if( !strcmp( argv[i], "--csv" ) ) {
+            opt.csv = true;
+        } else if( !strcmp( argv[i], "--no-check" ) ) {
+            opt.check = false;
+        } else if( !strcmp( argv[i], "--no-bench" ) ) {
+            opt.bench = false;
+        } else if( !strcmp( argv[i], "--threads" ) ) {
+            opt.scaling = true;
+        } else if( !strcmp( argv[i], "--huge" ) ) {
+            opt.hugeKeys = 3000000000ull;
+            if( i + 1 < argc && isdigit( (unsigned char) argv[i + 1][0] ) ) {
+                opt.hugeKeys = strtoull( argv[++i], nullptr, 10 );
+            }
+        } else {
+            usage( argv[0] );
+            return 1;
+        }
+    }
+
+    if( opt.check ) {
+        api_check();
+        dib_check();
+    }
+
+    if( opt.bench && opt.hugeKeys ) {
+        run_huge_benchmark( opt.hugeKeys, opt );
+    } else if( opt.bench && opt.scaling ) {
+        run_scaling_benchmarks( opt );
+        run_build_benchmarks( opt );
+    } else if( opt.bench ) {
+        run_benchmarks( opt );
+        run_set_op_benchmarks( opt );
+        run_hash_benchmarks( opt );
+        run_guard_benchmarks( opt );
+        run_bounded_benchmarks( opt );
     }
 
     return 0;
@@ -1,127 +1,449 @@
 #pragma once
 
 #include "hash.hpp"
+#include "hash_stats.hpp"
+#include <cstddef>
+#include <memory> // for allocator_traits
+#include <new>
+#include <type_traits>
+#include <utility> // for forward, move, swap
+#include <vector>
 
 
 // Template for a hash table using separate chaining for collision
-// resolution.
-template<typename K, typename V, class Hasher = HashFn<K>>
-struct ChainedHash : public IHash<K, V, Hasher> {
+// resolution. Each node keeps the full hash of its key, so chain walks
+// skip the key compare unless the hashes match, and resizing relinks
+// nodes without rehashing their keys.
+// Nodes come from a per-table slab pool rather than from new and
+// delete, so puts and removes stay off malloc, nodes allocated
+// together sit together, and the table frees all of them at once.
+template<typename K, typename V, class Hasher = HashFn<K>, class Index = ModIndex,
+         class Allocator = std::allocator<char>>
+struct ChainedHash : public IHash<ChainedHash<K, V, Hasher, Index, Allocator>, K, V, Hasher, Index, Allocator> {
+    HASH_STATS_INIT
+
+    typedef HashValueOf<Hasher, K> HashValue;
+
     struct HashNode {
-        HashNode( K key, V val ) : key(key), val(val), next(nullptr) {}
+        template <typename KK, typename... Args>
+        HashNode( HashValue hash, KK&& key, Args&&... args ) :
+            key( std::forward<KK>( key ) ),
+            val( std::forward<Args>( args )... ),
+            hash(hash),
+            next(nullptr) {}
 
         K key;
         V val;
+        HashValue hash;
         HashNode * next;
-    }; 
+    };
 
-    ChainedHash( int _numBuckets, float _loadThreshold ) {
-        this->numBuckets = _numBuckets;
-        this->loadThreshold = _loadThreshold;
-        this->numEntries = 0;
+    typedef typename std::allocator_traits<Allocator>::template rebind_alloc<HashNode> NodeAllocator;
+
+    // Slab allocator for nodes. Slabs start at MIN_SLAB nodes and double
+    // up to MAX_SLAB, come from the table's allocator, and are only freed
+    // by release(). Destroyed nodes go on an intrusive free list, threaded
+    // through their storage, and are reused before the current slab is.
+    struct NodePool {
+        static const size_t MIN_SLAB = 64;
+        static const size_t MAX_SLAB = 1 << 16;
+
+        struct FreeNode {
+            FreeNode * next;
+        };
+
+        NodePool() {}
+        NodePool( const NodeAllocator& alloc ) : alloc(alloc) {}
+        NodePool( const NodePool& ) = delete;
+        NodePool& operator=( const NodePool& ) = delete;
+
+        ~NodePool() {
+            release();
+        }
+
+        template <typename... Args>
+        HashNode * create( Args&&... args ) {
+            void * slot = allocate();
+
+            try {
+                return new (slot) HashNode( std::forward<Args>( args )... );
+            } catch( ... ) {
+                deallocate( slot );
+                throw;
+            }
+        }
+
+        void destroy( HashNode * node ) {
+            node->~HashNode();
+            deallocate( node );
+        }
+
+        void * allocate() {
+            if( freeList ) {
+                FreeNode * slot = freeList;
+                freeList = slot->next;
+                return slot;
+            }
+
+            if( used == slabSize ) {
+                slabSize = slabCapacity( slabs.size() );
+                slabs.push_back( std::allocator_traits<NodeAllocator>::allocate( alloc, slabSize ) );
+                slabBytes += slabSize * sizeof( HashNode );
+                used = 0;
+            }
 
-        this->buckets = new HashNode* [this->numBuckets];
+            return slabs.back() + used++;
+        }
 
-        for( int i = 0; i < this->numBuckets; ++i ) {
-            buckets[i] = nullptr;
+        void deallocate( void * slot ) {
+            FreeNode * node = new (slot) FreeNode;
+            node->next = freeList;
+            freeList = node;
         }
+
+        // frees every slab without running any node's destructor, so
+        // the owner must destroy live nodes first, unless they are
+        // trivially destructible
+        void release() {
+            for( size_t i = 0; i < slabs.size(); ++i ) {
+                std::allocator_traits<NodeAllocator>::deallocate(
+                        alloc, slabs[i], slabCapacity( i ) );
+            }
+
+            slabs.clear();
+            freeList = nullptr;
+            slabSize = used = slabBytes = 0;
+        }
+
+        static size_t slabCapacity( size_t i ) {
+            size_t n = MIN_SLAB;
+            for( ; i > 0 && n < MAX_SLAB; --i ) n *= 2;
+            return n;
+        }
+
+        void swap( NodePool& other ) {
+            std::swap( alloc, other.alloc );
+            slabs.swap( other.slabs );
+            std::swap( freeList, other.freeList );
+            std::swap( slabSize, other.slabSize );
+            std::swap( used, other.used );
+            std::swap( slabBytes, other.slabBytes );
+        }
+
+        NodeAllocator alloc;
+        std::vector<HashNode *> slabs;
+        FreeNode * freeList = nullptr;
+        size_t slabSize = 0;
+        size_t used = 0;
+        size_t slabBytes = 0;
+    };
+
+    // number of old buckets migrated by each put, get or remove while
+    // an incremental resize is in progress
+    static const int MIGRATE_STEP = 8;
+
+    // whether compact() can move nodes without risking an exception
+    // halfway through one
+    static const bool NOTHROW_MOVE =
+        std::is_nothrow_move_constructible<K>::value &&
+        std::is_nothrow_move_constructible<V>::value;
+
+    ChainedHash( size_t _numBuckets, float _loadThreshold,
+            const Allocator& _allocator = Allocator() ) {
+        this->allocator = _allocator;
+        this->pool.alloc = NodeAllocator( _allocator );
+        this->setBuckets( _numBuckets );
+        this->loadThreshold = _loadThreshold;
+        this->numEntries = 0;
+
+        this->buckets = this->template allocateArray<HashNode *, true>( this->numBuckets );
     }
 
     ChainedHash() : ChainedHash(10, 0.7) {}
 
+    // An unfinished incremental resize isn't migrated first: the nodes
+    // of the old chains are destroyed where they are.
     ~ChainedHash() {
-        HashNode * next;
+        destroyChains( buckets, this->numBuckets );
+
+        if( oldTable ) {
+            destroyChains( oldTable, oldNumBuckets );
+            this->deallocateArray( oldTable, oldNumBuckets );
+        }
 
-        for( int i = 0; i < this->numBuckets; ++i ) {
-            if( this->buckets[i] ) next = this->buckets[i]->next;
+        pool.release();
 
-            while( this->buckets[i] ) {
-                delete this->buckets[i];
-                this->buckets[i] = next;
+        this->deallocateArray( buckets, this->numBuckets );
+    }
+
+    // nodes only need visiting if they have a destructor to run,
+    // otherwise the pool frees them all at once
+    static void destroyChains( HashNode ** chains, size_t count ) {
+        if( !std::is_trivially_destructible<HashNode>::value ) {
+            for( size_t i = 0; i < count; ++i ) {
+                HashNode * ptr = chains[i];
+
+                while( ptr ) {
+                    HashNode * next = ptr->next;
+                    ptr->~HashNode();
+                    ptr = next;
+                }
             }
         }
-
-        delete [] buckets;
     }
 
-    void resize(int newBuckets ) {
+    void resize( size_t newBuckets ) {
+        HASH_STATS_RESIZE
+        finishResize();
+
+        // the table is only changed once the new array exists
+        size_t capacity = this->capacityFor( newBuckets );
+        HashNode ** grown = this->template allocateArray<HashNode *, true>( capacity );
+
         HashNode ** old = this->buckets;
-        int oldBuckets = this->numBuckets;
-        this->numBuckets = newBuckets;
+        size_t oldBuckets = this->numBuckets;
+        Index oldIndex = this->indexer;
+        this->setBuckets( capacity );
+        this->buckets = grown;
+
+        if( incremental ) {
+            oldTable = old;
+            oldNumBuckets = oldBuckets;
+            oldIndexer = oldIndex;
+            migrateNext = 0;
+            return;
+        }
+
+        for( size_t i = 0; i < oldBuckets; ++i ) {
+            migrateChain( old[i] );
+        }
+
+        this->deallocateArray( old, oldBuckets );
+
+        if( compactOnResize ) {
+            compact();
+        }
+    }
+
+    // Moves every node into a fresh pool, chain by chain, so the nodes
+    // of each chain end up next to each other in bucket order, and the
+    // old pool is freed as a whole. Every new node is allocated, then
+    // built, before any chain is relinked, so if an allocation or copy
+    // throws, the table is left as it was. Keys and values are moved
+    // only if neither move can throw, and copied otherwise.
+    void compact() {
+        finishResize();
+
+        NodePool fresh( pool.alloc );
+        std::vector<HashNode *> nodes( this->numEntries );
+
+        for( size_t i = 0; i < nodes.size(); ++i ) {
+            nodes[i] = static_cast<HashNode *>( fresh.allocate() );
+        }
+
+        size_t built = 0;
+
+        try {
+            for( size_t i = 0; i < this->numBuckets; ++i ) {
+                for( HashNode * old = this->buckets[i]; old; old = old->next ) {
+                    if constexpr( NOTHROW_MOVE ) {
+                        new (nodes[built]) HashNode( old->hash,
+                                std::move( old->key ), std::move( old->val ) );
+                    } else {
+                        new (nodes[built]) HashNode( old->hash,
+                                static_cast<const K&>( old->key ),
+                                static_cast<const V&>( old->val ) );
+                    }
+                    ++built;
+                }
+            }
+        } catch( ... ) {
+            for( size_t i = 0; i < built; ++i ) {
+                nodes[i]->~HashNode();
+            }
+            throw;
+        }
+
+        // nothing below throws
+        size_t next = 0;
+
+        for( size_t i = 0; i < this->numBuckets; ++i ) {
+            HashNode ** link = &this->buckets[i];
+
+            while( *link ) {
+                HashNode * old = *link;
+                HashNode * node = nodes[next++];
+
+                node->next = old->next;
+                old->~HashNode();
+
+                *link = node;
+                link = &node->next;
+            }
+        }
+
+        pool.swap( fresh );
+    }
+
+    // also compact the nodes on every non-incremental resize
+    void setCompactOnResize( bool enable ) {
+        compactOnResize = enable;
+    }
 
-        this->buckets = new HashNode* [this->numBuckets];
+    // exact number of bytes held by the table: the bucket arrays, every
+    // slab, including free and unused nodes, and the pool's vector of
+    // slab pointers. The free list is threaded through the free nodes,
+    // so it takes no memory of its own.
+    size_t memoryUsage() const {
+        size_t bytes = pool.slabBytes + pool.slabs.capacity() * sizeof( HashNode * ) +
+            this->numBuckets * sizeof( HashNode * );
 
-        for( int i = 0; i < this->numBuckets; ++i ) {
-            this->buckets[i] = nullptr;
+        if( oldTable ) {
+            bytes += oldNumBuckets * sizeof( HashNode * );
         }
 
+        return bytes;
+    }
+
+    // relinks every node of an old chain into the current buckets, so
+    // no key or value is copied
+    void migrateChain( HashNode *& chain ) {
         HashNode * next;
 
-        this->numEntries = 0;
+        while( chain ) {
+            next = chain->next;
 
-        for( int i = 0; i < oldBuckets; ++i ) {
-            while( old[i] ) {
-                put( old[i]->key, old[i]->val );
+            size_t idx = this->indexer.index( chain->hash );
+            chain->next = this->buckets[idx];
+            this->buckets[idx] = chain;
 
-                next = old[i]->next;
-                delete old[i];
+            chain = next;
+        }
+    }
+
+    // Incremental resizing. Instead of relinking every chain at once,
+    // resize() keeps the old bucket array, and each later put, get and
+    // remove migrates MIGRATE_STEP old chains in order. It also migrates
+    // the old chain its own key hashes to, so the operation itself only
+    // needs to look at the current buckets.
+    void setIncrementalResize( bool enable ) {
+        if( !enable ) finishResize();
+        incremental = enable;
+    }
+
+    bool resizing() const {
+        return oldTable != nullptr;
+    }
 
-                old[i] = next;
+    void finishResize() {
+        while( oldTable ) {
+            migrate( MIGRATE_STEP );
+        }
+    }
+
+    void migrate( int steps ) {
+        for( ; steps > 0 && oldTable; --steps ) {
+            migrateChain( oldTable[migrateNext] );
+
+            if( ++migrateNext == oldNumBuckets ) {
+                this->deallocateArray( oldTable, oldNumBuckets );
+                oldTable = nullptr;
             }
         }
+    }
+
+    void migrateKey( HashValue hash ) {
+        migrate( MIGRATE_STEP );
 
-        delete [] old;
+        if( oldTable ) {
+            migrateChain( oldTable[oldIndexer.index( hash )] );
+        }
     }
 
-    void put( K key, V val ) {
+    template <bool Assign, typename KK, typename... Args>
+    std::pair<V *, bool> insertHashed( HashValue hash, KK&& key, Args&&... args ) {
         if( this->getLoadFactor() >= this->loadThreshold ) {
             resize( this->numBuckets * 2 );
         }
 
-        int idx = this.hash( key );
+        if( oldTable ) {
+            migrateKey( hash );
+        }
+
+        size_t idx = this->indexer.index( hash );
 
         HashNode * prev = nullptr;
         HashNode * ptr = this->buckets[idx];
+        HASH_STATS_SET( probe, 0 )
 
         while( ptr ) {
-            if( ptr->key == key ) {
-                ptr->val = val;
-                return;
+            if( ptr->hash == hash && ptr->key == key ) {
+                HASH_STATS_OP( STAT_PUT )
+                if( Assign ) {
+                    ptr->val = V( std::forward<Args>( args )... );
+                }
+                return std::make_pair( &ptr->val, false );
             }
             prev = ptr;
             ptr = ptr->next;
+            HASH_STATS_INC( probe )
         }
 
+        HASH_STATS_OP( STAT_PUT )
+
+        ptr = pool.create( hash, std::forward<KK>( key ), std::forward<Args>( args )... );
+
         if( prev ) {
-            prev->next = new HashNode( key, val );
+            prev->next = ptr;
         } else {
-            this->buckets[idx] = new HashNode( key, val );
+            this->buckets[idx] = ptr;
         }
 
         ++this->numEntries;
+
+        return std::make_pair( &ptr->val, true );
     }
 
-    V get( K key ) {
-        int idx = this->hash( key );
+    template <typename Q>
+    V * findHashed( const Q& key, HashValue hash ) {
+        if( oldTable ) {
+            migrateKey( hash );
+        }
+
+        size_t idx = this->indexer.index( hash );
 
         HashNode * ptr = this->buckets[idx];
+        HASH_STATS_SET( probe, 0 )
 
         while( ptr ) {
-            if( ptr->key == key ) return ptr->val;
+            if( ptr->hash == hash && ptr->key == key ) {
+                HASH_STATS_OP( STAT_GET_HIT )
+                return &ptr->val;
+            }
             ptr = ptr->next;
+            HASH_STATS_INC( probe )
         }
 
-        throw std::runtime_error("Key doesn't exist.");
+        HASH_STATS_OP( STAT_GET_MISS )
+        return nullptr;
     }
 
-    void remove( K key ) {
-        int idx = this->hash( key );
+    template <typename Q>
+    void removeHashed( const Q& key, HashValue hash ) {
+        if( oldTable ) {
+            migrateKey( hash );
+        }
+
+        size_t idx = this->indexer.index( hash );
 
         HashNode * prev = nullptr;
         HashNode * ptr = this->buckets[idx];
+        HASH_STATS_SET( probe, 0 )
 
         while( ptr ) {
-            if( ptr->key == key ) {
+            if( ptr->hash == hash && ptr->key == key ) {
+                HASH_STATS_OP( STAT_REMOVE )
+
                 if( !prev ) {
                     // update buckets if first elem deleted
                     this->buckets[idx] = ptr->next;
@@ -130,18 +452,130 @@ struct ChainedHash : public IHash<K, V, Hasher> {
                     prev->next = ptr->next;
                 }
 
-                delete ptr;
+                pool.destroy( ptr );
                 --this->numEntries;
                 return;
             }
 
             prev = ptr;
             ptr = ptr->next;
+            HASH_STATS_INC( probe )
         }
 
+        HASH_STATS_OP( STAT_REMOVE )
+
         // Key does not exist, nothing removed
     }
 
+    // Iteration, in bucket order and then chain order. begin() finishes
+    // any incremental resize, so that every node is in the current
+    // buckets.
+    struct iterator {
+        typedef std::forward_iterator_tag iterator_category;
+        typedef KeyValueRef<K, V> value_type;
+        typedef KeyValueRef<K, V> reference;
+        typedef typename SlotIterator<ChainedHash>::pointer pointer;
+        typedef std::ptrdiff_t difference_type;
+
+        iterator( ChainedHash * table, size_t bucket, HashNode * node ) :
+            table(table), bucket(bucket), node(node) {}
+
+        reference operator*() const {
+            return reference{ node->key, node->val };
+        }
+
+        pointer operator->() const {
+            return pointer{ **this };
+        }
+
+        iterator& operator++() {
+            node = node->next;
+
+            while( !node && ++bucket < table->numBuckets ) {
+                node = table->buckets[bucket];
+            }
+
+            return *this;
+        }
+
+        iterator operator++( int ) {
+            iterator prev = *this;
+            ++*this;
+            return prev;
+        }
+
+        bool operator==( const iterator& other ) const {
+            return node == other.node;
+        }
+
+        bool operator!=( const iterator& other ) const {
+            return node != other.node;
+        }
+
+        ChainedHash * table;
+        size_t bucket;
+        HashNode * node;
+    };
+
+    iterator begin() {
+        finishResize();
+
+        for( size_t i = 0; i < this->numBuckets; ++i ) {
+            if( this->buckets[i] ) {
+                return iterator( this, i, this->buckets[i] );
+            }
+        }
+
+        return end();
+    }
+
+    iterator end() {
+        return iterator( this, this->numBuckets, nullptr );
+    }
+
+    // Removes every entry for which pred( key, val ) is true, and
+    // returns how many were removed, unlinking nodes in a single walk
+    // of every chain.
+    template <class Pred>
+    size_t erase_if( Pred pred ) {
+        finishResize();
+
+        size_t erased = 0;
+
+        for( size_t i = 0; i < this->numBuckets; ++i ) {
+            HashNode ** link = &this->buckets[i];
+
+            while( *link ) {
+                HashNode * node = *link;
+
+                if( pred( node->key, node->val ) ) {
+                    *link = node->next;
+                    pool.destroy( node );
+                    ++erased;
+                } else {
+                    link = &node->next;
+                }
+            }
+        }
+
+        this->numEntries -= erased;
+        return erased;
+    }
+
+    // only the bucket's head pointer can be prefetched, as the nodes
+    // themselves aren't known until it arrives
+    void prefetch( HashValue hash ) {
+        prefetchLine( &this->buckets[this->indexer.index( hash )] );
+    }
+
     HashNode ** buckets;
+    NodePool pool;
+    bool compactOnResize = false;
+
+    bool incremental = false;
+    HashNode ** oldTable = nullptr;
+    size_t oldNumBuckets = 0;
+    Index oldIndexer = Index();
+    size_t migrateNext = 0;
 };
 
@@ -0,0 +1,558 @@
+#pragma once
+
+#include "hash.hpp"
+#include "hash_stats.hpp"
+#include <atomic>
+#include <memory> // for unique_ptr
+#include <stdexcept>
+#include <thread> // for yield
+#include <type_traits>
+#include <utility> // for swap
+#include <vector>
+
+
+// Template for a concurrent hash using Robin Hood hashing with
+// backwards shifting, for tables shared by many readers and a few
+// writers.
+
+// Key Concepts:
+// 1. The buckets are split into segments of SEGMENT_SIZE entries, each
+// with a version counter that doubles as the segment's lock. An odd
+// version means a writer holds the segment.
+// 2. Reads take no locks. A get records the version of every segment
+// its probe passes through, reads the entries, then checks that none
+// of the versions changed, and retries if one did. It can't observe a
+// half-finished swap chain or backward shift, as the writer holds every
+// segment it touches for the whole operation.
+// 3. Put and remove lock every segment from the key's desired index up
+// to the first empty entry after it. Robin Hood displacement and the
+// backward shift never go past that entry, so this covers every entry
+// they may move. Segments are always locked in increasing order, so
+// writers can't deadlock, even when their ranges wrap around the end.
+// 4. Resizing locks every segment of the current buckets and publishes
+// new ones. The old segments are never unlocked, which sends readers
+// and writers still using them back to the new buckets. Old buckets are
+// freed with the table, since a reader may still be scanning them.
+
+// Entries are read while writers may be changing them, so keys and
+// values are kept in std::atomic and must be trivially copyable. For
+// the same reason the table hands out copies of values rather than
+// pointers into the buckets, and doesn't implement IHash.
+template<typename K, typename V, class Hasher = HashFn<K>, class Index = ModIndex>
+struct ConcurrentRHHash {
+    static_assert( std::is_base_of<HashFn<K>, Hasher>::value,
+            "ConcurrentRHHash: Hasher does not hash type of key given!" );
+    static_assert( std::is_trivially_copyable<K>::value &&
+            std::is_trivially_copyable<V>::value,
+            "ConcurrentRHHash: keys and values must be trivially copyable" );
+
+
+    typedef K key_type;
+    typedef V mapped_type;
+    typedef Hasher hasher_type;
+    typedef Index index_type;
+    typedef HashValueOf<Hasher, K> HashValue;
+
+    // entries covered by one version counter
+    static const int SEGMENT_SIZE = 64;
+
+    // segments a lock-free get may pass through before it falls back
+    // to locking them
+    static const int MAX_READ_SEGMENTS = 16;
+
+    // spins on a held segment before yielding the thread
+    static const int SPIN_LIMIT = 64;
+
+    struct HashEntry {
+        HashEntry() : key( K() ), val( V() ), hash(0), dist(-1) {}
+
+        std::atomic<K> key;
+        std::atomic<V> val;
+        std::atomic<HashValue> hash;
+
+        // probe length, or -1 if the entry is empty
+        std::atomic<int> dist;
+    };
+
+    // padded so writers on neighbouring segments don't share a cache line
+    struct alignas(64) Segment {
+        std::atomic<unsigned int> version{ 0 };
+    };
+
+    struct Buckets {
+        Buckets( size_t _numBuckets ) {
+            numBuckets = Index::capacity( _numBuckets );
+            indexer.setCapacity( numBuckets );
+            numSegments = ( numBuckets + SEGMENT_SIZE - 1 ) / SEGMENT_SIZE;
+
+            // entries is freed if the segments can't be allocated
+            std::unique_ptr<HashEntry[]> held( new HashEntry[numBuckets] );
+            segments = new Segment[numSegments];
+            entries = held.release();
+        }
+
+        ~Buckets() {
+            delete [] entries;
+            delete [] segments;
+        }
+
+        size_t segment( size_t idx ) const {
+            return idx / SEGMENT_SIZE;
+        }
+
+        size_t numBuckets;
+        size_t numSegments;
+        Index indexer;
+        HashEntry * entries;
+        Segment * segments;
+    };
+
+    ConcurrentRHHash( size_t _numBuckets, float _loadThreshold ) {
+        this->loadThreshold = _loadThreshold;
+        this->numEntries = 0;
+        this->table = new Buckets( _numBuckets );
+    }
+
+    ConcurrentRHHash() : ConcurrentRHHash(10, 0.7) {}
+
+    ~ConcurrentRHHash() {
+        delete table.load();
+
+        for( Buckets * b : retired ) {
+            delete b;
+        }
+    }
+
+    void put( const K& key, const V& val ) {
+        HashValue hash = this->hasher.hash( key );
+
+        for(;;) {
+            Buckets * b = table.load( std::memory_order_acquire );
+
+            if( getLoadFactor( b ) >= this->loadThreshold ) {
+                grow( b, b->numBuckets * 2 );
+                continue;
+            }
+
+            bool full = false;
+
+            withLocks( hash, [&]( Buckets * t, bool hasEmpty ) {
+                size_t idx = lookup( t, key, hash );
+
+                if( idx != NOT_FOUND ) {
+                    t->entries[idx].val.store( val, std::memory_order_relaxed );
+                } else if( hasEmpty ) {
+                    place( t, key, val, hash );
+                    this->numEntries.fetch_add( 1, std::memory_order_relaxed );
+                } else {
+                    full = true;
+                }
+            } );
+
+            // concurrent puts may all pass the load check at once, and
+            // fill the buckets before any of them grows it
+            if( !full ) return;
+
+            grow( b, b->numBuckets * 2 );
+        }
+    }
+
+    // copies the value for key into val, and returns whether it exists
+    bool find( const K& key, V& val ) {
+        HashValue hash = this->hasher.hash( key );
+
+        for( int spins = 0; ; ++spins ) {
+            Buckets * b = table.load( std::memory_order_acquire );
+
+            int found = tryFind( b, key, hash, val );
+
+            if( found == RETRY_LOCKED ) {
+                withLocks( hash, [&]( Buckets * t, bool ) {
+                    size_t idx = lookup( t, key, hash );
+                    found = idx != NOT_FOUND;
+                    if( found ) val = t->entries[idx].val.load( std::memory_order_relaxed );
+                } );
+            }
+
+            if( found >= 0 ) return found;
+
+            backoff( spins );
+        }
+    }
+
+    // throws if key doesn't exist. Prefer find, contains or get_or
+    // when misses are expected, as they don't throw.
+    V get( const K& key ) {
+        V val;
+
+        if( !find( key, val ) ) {
+            throw std::runtime_error("Key doesn't exist.");
+        }
+
+        return val;
+    }
+
+    bool contains( const K& key ) {
+        V val;
+        return find( key, val );
+    }
+
+    // returns def if key doesn't exist
+    V get_or( const K& key, const V& def ) {
+        V val;
+        return find( key, val ) ? val : def;
+    }
+
+    void remove( const K& key ) {
+        HashValue hash = this->hasher.hash( key );
+
+        withLocks( hash, [&]( Buckets * t, bool ) {
+            size_t i = lookup( t, key, hash );
+
+            // Key does not exist, nothing removed.
+            if( i == NOT_FOUND ) return;
+
+            erase( t, i );
+            this->numEntries.fetch_sub( 1, std::memory_order_relaxed );
+        } );
+    }
+
+    void resize( size_t newBuckets ) {
+        Buckets * b;
+
+        do {
+            b = table.load( std::memory_order_acquire );
+        } while( !grow( b, newBuckets ) );
+    }
+
+    float getLoadFactor( void ) {
+        return getLoadFactor( table.load( std::memory_order_acquire ) );
+    }
+
+    float getLoadFactor( Buckets * b ) {
+        return float( this->numEntries.load( std::memory_order_relaxed ) ) / b->numBuckets;
+    }
+
+    size_t size() {
+        return this->numEntries.load( std::memory_order_relaxed );
+    }
+
+    // histogram of the probe lengths of the entries in the table. Not
+    // safe to call while other threads use the table. Unlike the single
+    // threaded tables, this table has no stats member, as threads would
+    // contend on it.
+    Histogram get_dib_stats() {
+        Buckets * b = table.load();
+        Histogram dibs;
+
+        for( size_t i = 0; i < b->numBuckets; ++i ) {
+            int dist = b->entries[i].dist.load( std::memory_order_relaxed );
+            if( dist >= 0 ) {
+                dibs.record( dist );
+            }
+        }
+
+        return dibs;
+    }
+
+    enum { MISSING = 0, FOUND = 1, RETRY = -1, RETRY_LOCKED = -2 };
+
+    // Lock-free lookup in b. Returns FOUND or MISSING if the probe saw a
+    // consistent state, RETRY if a writer interfered, and RETRY_LOCKED
+    // if the probe passed through too many segments to validate.
+    int tryFind( Buckets * b, const K& key, HashValue hash, V& val ) {
+        unsigned int versions[MAX_READ_SEGMENTS];
+        int numRead = 0;
+        size_t first = NOT_FOUND;
+        size_t last = NOT_FOUND;
+
+        int result = MISSING;
+        size_t idx = b->indexer.index( hash );
+
+        for( int currentProbeLength = 0; ; ++currentProbeLength ) {
+            // a probe through torn entries may not terminate by itself
+            if( size_t( currentProbeLength ) >= b->numBuckets ) return RETRY;
+
+            size_t s = b->segment( idx );
+
+            if( s != last ) {
+                if( numRead == MAX_READ_SEGMENTS ) return RETRY_LOCKED;
+
+                versions[numRead] = b->segments[s].version.load( std::memory_order_acquire );
+                if( versions[numRead] & 1 ) return RETRY;
+
+                if( first == NOT_FOUND ) first = s;
+                last = s;
+                ++numRead;
+            }
+
+            HashEntry& e = b->entries[idx];
+
+            if( currentProbeLength > e.dist.load( std::memory_order_relaxed ) ) break;
+
+            if( e.hash.load( std::memory_order_relaxed ) == hash &&
+                    e.key.load( std::memory_order_relaxed ) == key ) {
+                val = e.val.load( std::memory_order_relaxed );
+                result = FOUND;
+                break;
+            }
+
+            idx = b->indexer.next( idx );
+        }
+
+        // the entries read are only valid if no segment changed since
+        // its version was read
+        std::atomic_thread_fence( std::memory_order_acquire );
+
+        for( int i = 0; i < numRead; ++i ) {
+            size_t s = ( first + i ) % b->numSegments;
+            if( b->segments[s].version.load( std::memory_order_relaxed ) != versions[i] ) {
+                return RETRY;
+            }
+        }
+
+        return result;
+    }
+
+    // Runs fn( buckets, hasEmpty ) with every segment locked from the
+    // desired index of hash to the first empty entry after it, or with
+    // all segments locked and hasEmpty false if there is no empty entry.
+    template <class Fn>
+    void withLocks( HashValue hash, Fn fn ) {
+        for( int spins = 0; ; ++spins ) {
+            Buckets * b = table.load( std::memory_order_acquire );
+            size_t home = b->indexer.index( hash );
+            size_t first = b->segment( home );
+
+            // the first pass runs unlocked, so it is only a guess
+            bool hasEmpty;
+            size_t count = span( b, home, hasEmpty );
+
+            while( lockSegments( b, first, count ) ) {
+                size_t needed = span( b, home, hasEmpty );
+
+                if( needed <= count ) {
+                    fn( b, hasEmpty );
+                    unlockSegments( b, first, count );
+                    return;
+                }
+
+                // the run grew before we locked it
+                unlockSegments( b, first, count );
+                count = needed;
+            }
+
+            // b was resized while we waited
+            backoff( spins );
+        }
+    }
+
+    // number of segments from the one holding home to the one holding
+    // the first empty entry at or after home
+    size_t span( Buckets * b, size_t home, bool& hasEmpty ) {
+        size_t idx = home;
+
+        for( size_t i = 0; i < b->numBuckets; ++i ) {
+            if( b->entries[idx].dist.load( std::memory_order_relaxed ) < 0 ) {
+                hasEmpty = true;
+                return ( b->segment( idx ) - b->segment( home ) + b->numSegments ) %
+                    b->numSegments + 1;
+            }
+
+            idx = b->indexer.next( idx );
+        }
+
+        hasEmpty = false;
+        return b->numSegments;
+    }
+
+    // Locks count segments starting at first, in increasing index order.
+    // Fails, holding none of them, if b is resized while waiting.
+    bool lockSegments( Buckets * b, size_t first, size_t count ) {
+        size_t n = b->numSegments;
+        size_t wrapped = first + count > n ? first + count - n : 0;
+
+        for( size_t s = 0; s < wrapped; ++s ) {
+            if( !lockSegment( b, s ) ) {
+                unlockSegments( b, 0, s );
+                return false;
+            }
+        }
+
+        for( size_t s = first; s < first + count && s < n; ++s ) {
+            if( !lockSegment( b, s ) ) {
+                unlockSegments( b, first, s - first );
+                if( wrapped > 0 ) unlockSegments( b, 0, wrapped );
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    void unlockSegments( Buckets * b, size_t first, size_t count ) {
+        for( size_t i = 0; i < count; ++i ) {
+            std::atomic<unsigned int>& version =
+                b->segments[( first + i ) % b->numSegments].version;
+            version.store( version.load( std::memory_order_relaxed ) + 1,
+                    std::memory_order_release );
+        }
+    }
+
+    bool lockSegment( Buckets * b, size_t s ) {
+        std::atomic<unsigned int>& version = b->segments[s].version;
+
+        for( int spins = 0; ; ++spins ) {
+            unsigned int v = version.load( std::memory_order_relaxed );
+
+            if( !( v & 1 ) && version.compare_exchange_weak( v, v + 1,
+                        std::memory_order_acquire, std::memory_order_relaxed ) ) {
+                // keeps the writes to entries from becoming visible
+                // before the odd version
+                std::atomic_thread_fence( std::memory_order_release );
+                return true;
+            }
+
+            // segments of resized buckets stay locked for good
+            if( table.load( std::memory_order_acquire ) != b ) return false;
+
+            backoff( spins );
+        }
+    }
+
+    static void backoff( int spins ) {
+        if( spins >= SPIN_LIMIT ) {
+            std::this_thread::yield();
+        }
+    }
+
+    // Replaces b with new buckets of newBuckets entries. Returns false
+    // if b had already been replaced. If the new buckets, or the room to
+    // retire b, can't be allocated, b's segments are unlocked again
+    // before the exception leaves, so b stays in use.
+    bool grow( Buckets * b, size_t newBuckets ) {
+        if( !lockSegments( b, 0, b->numSegments ) ) return false;
+
+        std::unique_ptr<Buckets> nb;
+
+        try {
+            // the new buckets must keep an empty entry
+            size_t minBuckets = this->numEntries.load( std::memory_order_relaxed ) + 1;
+            nb.reset( new Buckets( newBuckets > minBuckets ? newBuckets : minBuckets ) );
+            retired.reserve( retired.size() + 1 );
+        } catch( ... ) {
+            unlockSegments( b, 0, b->numSegments );
+            throw;
+        }
+
+        // entries are unique, so they are placed without a lookup
+        for( size_t i = 0; i < b->numBuckets; ++i ) {
+            HashEntry& e = b->entries[i];
+
+            if( e.dist.load( std::memory_order_relaxed ) >= 0 ) {
+                place( nb.get(),
+                        e.key.load( std::memory_order_relaxed ),
+                        e.val.load( std::memory_order_relaxed ),
+                        e.hash.load( std::memory_order_relaxed ) );
+            }
+        }
+
+        // retired before publishing, so the next resize sees it
+        retired.push_back( b );
+        table.store( nb.release(), std::memory_order_release );
+
+        return true;
+    }
+
+    // The operations below expect the caller to hold the segments they
+    // touch, and mirror RHHash.
+
+    // returns the index of key, or NOT_FOUND if it doesn't exist
+    size_t lookup( Buckets * b, const K& key, HashValue hash ) {
+        size_t idx = b->indexer.index( hash );
+
+        for( int currentProbeLength = 0; ; ++currentProbeLength ) {
+            HashEntry& e = b->entries[idx];
+
+            if( currentProbeLength > e.dist.load( std::memory_order_relaxed ) ) break;
+
+            if( e.hash.load( std::memory_order_relaxed ) == hash &&
+                    e.key.load( std::memory_order_relaxed ) == key ) {
+                return idx;
+            }
+
+            idx = b->indexer.next( idx );
+        }
+
+        return NOT_FOUND;
+    }
+
+    // places an entry whose key is not in b
+    void place( Buckets * b, K key, V val, HashValue hash ) {
+        size_t idx = b->indexer.index( hash );
+        int currentProbeLength = 0;
+
+        for(;;) {
+            HashEntry& e = b->entries[idx];
+            int existingProbeLength = e.dist.load( std::memory_order_relaxed );
+
+            if( existingProbeLength < 0 ) break;
+
+            // steal from the rich, give to the poor
+            if( existingProbeLength < currentProbeLength ) {
+                K k = e.key.load( std::memory_order_relaxed );
+                V v = e.val.load( std::memory_order_relaxed );
+                HashValue h = e.hash.load( std::memory_order_relaxed );
+
+                store( e, key, val, hash, currentProbeLength );
+
+                key = k;
+                val = v;
+                hash = h;
+                currentProbeLength = existingProbeLength;
+            }
+
+            idx = b->indexer.next( idx );
+            ++currentProbeLength;
+        }
+
+        store( b->entries[idx], key, val, hash, currentProbeLength );
+    }
+
+    // backward shift, as in RHHash
+    void erase( Buckets * b, size_t i ) {
+        size_t j = b->indexer.next( i );
+
+        for(;;) {
+            HashEntry& e = b->entries[j];
+            int dist = e.dist.load( std::memory_order_relaxed );
+
+            if( dist <= 0 ) break;
+
+            store( b->entries[i],
+                    e.key.load( std::memory_order_relaxed ),
+                    e.val.load( std::memory_order_relaxed ),
+                    e.hash.load( std::memory_order_relaxed ),
+                    dist - 1 );
+
+            i = j;
+            j = b->indexer.next( j );
+        }
+
+        b->entries[i].dist.store( -1, std::memory_order_relaxed );
+    }
+
+    static void store( HashEntry& e, const K& key, const V& val,
+            HashValue hash, int dist ) {
+        e.key.store( key, std::memory_order_relaxed );
+        e.val.store( val, std::memory_order_relaxed );
+        e.hash.store( hash, std::memory_order_relaxed );
+        e.dist.store( dist, std::memory_order_relaxed );
+    }
+
+    std::atomic<Buckets *> table;
+    std::vector<Buckets *> retired;
+    std::atomic<size_t> numEntries;
+    float loadThreshold;
+    Hasher hasher;
+};
@@ -1,8 +1,17 @@
 #pragma once
 
+#include <algorithm> // for min
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iterator> // for forward_iterator_tag
+#include <memory> // for allocator, allocator_traits
+#include <new>
 #include <stdexcept>
 #include <type_traits>
 #include <string>
+#include <string_view>
+#include <utility> // for forward, pair
 
 
 // Example of hash table implementation. This was just an exercise,
@@ -10,11 +19,12 @@
 
 
 // HashFn provides default hash functions for default key types
-// using template specialization.
+// using template specialization. The primary template has no hash()
+// and nothing is virtual: tables know their Hasher at compile time,
+// so its hash() call is resolved statically and can be inlined into
+// the probe loop.
 template <typename K>
-struct HashFn {
-    virtual unsigned int hash( K key ) = 0;
-};
+struct HashFn {};
 
 
 // Template specialization of HashFn for default key types. This
@@ -41,11 +51,15 @@ struct HashFn<int> {
 };
 
 
+// Strings can also be hashed as std::string_view or const char *,
+// which give the same hash as the equivalent std::string. Tables
+// accept any key type their Hasher can hash and compare to K, so
+// string keyed tables can be searched without building a std::string.
 template<>
 struct HashFn<std::string> {
     // djb2 hash function found on:
     // http://www.cse.yorku.ca/~oz/hash.html
-    unsigned int hash( std::string str ) {
+    unsigned int hash( std::string_view str ) {
         unsigned int hash = 5381;
         int c;
 
@@ -56,6 +70,14 @@ struct HashFn<std::string> {
 
         return hash;
     }
+
+    unsigned int hash( const std::string& str ) {
+        return hash( std::string_view( str ) );
+    }
+
+    unsigned int hash( const char * str ) {
+        return hash( std::string_view( str ) );
+    }
 };
 
 
@@ -71,35 +93,760 @@ struct MyIntHashFn : public HashFn<int> {
 };
 
 
+// Hashers return 32 or 64 bit hashes. HashValueOf is the unsigned type
+// tables store and index with for a Hasher: unsigned int for 32 bit
+// hashers such as HashFn, and uint64_t for 64 bit ones such as Hash64.
+// Only 64 bit hashes can index more than 2^32 buckets.
+template <class Hasher, typename K>
+using HashValueOf = typename std::conditional<
+    ( sizeof( decltype( std::declval<Hasher&>().hash( std::declval<const K&>() ) ) ) > 4 ),
+    uint64_t, unsigned int>::type;
+
+// sets lo and hi to the low and high halves of lo * hi
+inline void multiply128( uint64_t& lo, uint64_t& hi ) {
+#if defined(__SIZEOF_INT128__)
+    unsigned __int128 r = (unsigned __int128) lo * hi;
+    lo = uint64_t( r );
+    hi = uint64_t( r >> 64 );
+#else
+    uint64_t a = lo, b = hi;
+    uint64_t ha = a >> 32, hb = b >> 32, la = uint32_t( a ), lb = uint32_t( b );
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    uint64_t t = rl + ( rm0 << 32 );
+    uint64_t c = t < rl;
+    lo = t + ( rm1 << 32 );
+    c += lo < t;
+    hi = rh + ( rm0 >> 32 ) + ( rm1 >> 32 ) + c;
+#endif
+}
+
+
+// returned by lookups that find nothing, as no bucket has this index
+const size_t NOT_FOUND = size_t( -1 );
+
+// splitmix64 finalizer
+inline uint64_t mix64( uint64_t x ) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    x ^= x >> 31;
+    return x;
+}
+
+
+// Seedable hashers compute a different hash function for every seed,
+// so keys that pile up in one part of a table under one seed spread
+// out under another, see ProbeGuard. They extend HashFn<K> with
+//     void setSeed( uint64_t seed );
+//     uint64_t getSeed() const;
+// and start at seed 0. Hash64 is seedable, and Seeded makes any other
+// Hasher seedable.
+template <typename K>
+struct SeededHashFn : public HashFn<K> {
+    void setSeed( uint64_t _seed ) {
+        seed = _seed;
+    }
+
+    uint64_t getSeed() const {
+        return seed;
+    }
+
+    uint64_t seed = 0;
+};
+
+template <class Hasher, class = void>
+struct IsSeedable : std::false_type {};
+
+template <class Hasher>
+struct IsSeedable<Hasher, std::void_t<decltype( std::declval<Hasher&>().setSeed( uint64_t() ) )>>
+    : std::true_type {};
+
+// seed of hasher, or 0 if it isn't seedable
+template <class Hasher>
+uint64_t hasherSeed( const Hasher& hasher ) {
+    if constexpr( IsSeedable<Hasher>::value ) {
+        return hasher.getSeed();
+    } else {
+        return 0;
+    }
+}
+
+// does nothing if hasher isn't seedable
+template <class Hasher>
+void setHasherSeed( Hasher& hasher, uint64_t seed ) {
+    if constexpr( IsSeedable<Hasher>::value ) {
+        hasher.setSeed( seed );
+    } else {
+        (void) hasher;
+        (void) seed;
+    }
+}
+
+// Makes any Hasher seedable by mixing its hashes with the seed, e.g.
+//     LPHash<int, int, Seeded<MyIntHashFn>, Pow2Index> h( 1024, 0.9 );
+// Hashes keep the width of Hasher's. The mix runs at seed 0 too, so
+// Seeded<MyIntHashFn> is no longer the identity. Keys that Hasher maps
+// to the same hash collide under every seed.
+template <class Hasher>
+struct Seeded : public Hasher {
+    template <typename Q>
+    auto hash( const Q& key ) -> decltype( std::declval<Hasher&>().hash( key ) ) {
+        typedef decltype( std::declval<Hasher&>().hash( key ) ) Value;
+        return Value( mix64( uint64_t( Hasher::hash( key ) ) ^ seed ) );
+    }
+
+    void setSeed( uint64_t _seed ) {
+        seed = _seed;
+    }
+
+    uint64_t getSeed() const {
+        return seed;
+    }
+
+    uint64_t seed = 0;
+};
+
+
+// Guards LPHash and RHHash against probe sequences that degenerate into
+// long clusters, as with a weak Hasher or structured keys, which would
+// otherwise turn every lookup into a scan.
+// 1. Tables report the probe length of every insert that adds a key,
+// and the guard tracks the longest. Once one passes the table's limit,
+// factor times log2 of the capacity, scaled by how long probes get at
+// the table's load threshold, the table rebuilds.
+// 2. A table with a seedable Hasher rebuilds in place under a fresh
+// seed, up to MAX_RESEEDS times. Otherwise, or once those run out, it
+// doubles its capacity once. Then the guard gives up until the table
+// next grows on its own, so keys whose hashes are equal can't make it
+// rebuild or grow without bound.
+// 3. Seeds mix in the clock, so keys can't be picked ahead of time to
+// collide under the next seed as well.
+struct ProbeGuard {
+    static const int MAX_RESEEDS = 3;
+
+    explicit ProbeGuard( float _factor ) : factor(_factor) {}
+
+    // records an insert that probed probe slots past its home, and
+    // returns whether the table should rebuild. Only called when probe
+    // is longer than longest, so the limit is rarely computed.
+    bool exceeded( size_t probe, size_t limit ) {
+        longest = probe;
+        return factor > 0 && probe > limit && !grew;
+    }
+
+    // Picks how to rebuild, once exceeded() said to. Returns true after
+    // giving hasher a fresh seed, so the table rehashes every key at the
+    // same capacity, and false if the table should grow instead.
+    template <class Hasher>
+    bool reseed( Hasher& hasher ) {
+        longest = 0;
+
+        if( IsSeedable<Hasher>::value && reseeds < MAX_RESEEDS ) {
+            ++reseeds;
+            uint64_t ticks = uint64_t( std::chrono::steady_clock::now().time_since_epoch().count() );
+            setHasherSeed( hasher, mix64( hasherSeed( hasher ) ^ ticks ) );
+            return true;
+        }
+
+        grew = true;
+        return false;
+    }
+
+    // the table grew on its own, which allows rebuilds again. Probes
+    // taken before no longer say anything about the new array.
+    void grown() {
+        longest = 0;
+        reseeds = 0;
+        grew = false;
+    }
+
+    // ceil( log2( n ) ), at least 1
+    static int log2Ceil( size_t n ) {
+        int bits = 1;
+        while( bits < 64 && ( size_t( 1 ) << bits ) < n ) ++bits;
+        return bits;
+    }
+
+    // 0 turns the guard off
+    float factor;
+    size_t longest = 0;
+    int reseeds = 0;
+    bool grew = false;
+};
+
+
+// Index policies map a hash to a bucket index and step from one
+// bucket to the next while probing. Each one may round the requested
+// capacity, so tables must take their capacity from setBuckets().
+// None of them divide while stepping, only ModIndex divides at all.
+// index() takes 32 and 64 bit hashes, see HashValueOf.
+
+// Reduces the hash modulo the capacity. Works for any capacity, but
+// costs an integer division per lookup.
+struct ModIndex {
+    static size_t capacity( size_t requested ) {
+        return requested > 0 ? requested : 1;
+    }
+
+    void setCapacity( size_t _numBuckets ) {
+        numBuckets = _numBuckets;
+    }
+
+    size_t index( unsigned int hash ) const {
+        return hash % numBuckets;
+    }
+
+    size_t index( uint64_t hash ) const {
+        return hash % numBuckets;
+    }
+
+    size_t next( size_t idx ) const {
+        return ++idx == numBuckets ? 0 : idx;
+    }
+
+    size_t numBuckets;
+};
+
+
+// Rounds the capacity up to a power of two and masks off the low bits
+// of the hash, so it relies on the Hasher mixing its low bits well.
+struct Pow2Index {
+    static size_t capacity( size_t requested ) {
+        size_t n = 1;
+        while( n < requested ) n <<= 1;
+        return n;
+    }
+
+    void setCapacity( size_t _numBuckets ) {
+        mask = _numBuckets - 1;
+    }
+
+    size_t index( unsigned int hash ) const {
+        return hash & mask;
+    }
+
+    size_t index( uint64_t hash ) const {
+        return hash & mask;
+    }
+
+    size_t next( size_t idx ) const {
+        return ( idx + 1 ) & mask;
+    }
+
+    size_t mask;
+};
+
+
+// Fibonacci hashing. Power of two capacity, indexed by the high bits
+// of the hash multiplied by 2^32 / phi, or 2^64 / phi for 64 bit
+// hashes, which spreads out weak hashes such as the identity.
+struct FibonacciIndex {
+    static size_t capacity( size_t requested ) {
+        size_t n = 2;
+        while( n < requested ) n <<= 1;
+        return n;
+    }
+
+    void setCapacity( size_t _numBuckets ) {
+        mask = _numBuckets - 1;
+        bits = 0;
+        while( _numBuckets > 1 ) {
+            _numBuckets >>= 1;
+            ++bits;
+        }
+    }
+
+    size_t index( unsigned int hash ) const {
+        return (unsigned int)( hash * 2654435769u ) >> ( 32 - bits );
+    }
+
+    size_t index( uint64_t hash ) const {
+        return size_t( ( hash * 0x9e3779b97f4a7c15ull ) >> ( 64 - bits ) );
+    }
+
+    size_t next( size_t idx ) const {
+        return ( idx + 1 ) & mask;
+    }
+
+    size_t mask;
+    int bits;
+};
+
+
+// Lemire's fastrange: maps the hash onto [0, capacity) with a multiply
+// and a shift. Works for any capacity, and uses the high bits of the hash.
+// https://lemire.me/blog/2016/06/27/a-fast-alternative-to-the-modulo-reduction/
+struct FastRangeIndex {
+    static size_t capacity( size_t requested ) {
+        return requested > 0 ? requested : 1;
+    }
+
+    void setCapacity( size_t _numBuckets ) {
+        numBuckets = _numBuckets;
+    }
+
+    size_t index( unsigned int hash ) const {
+        return size_t( ( uint64_t( hash ) * numBuckets ) >> 32 );
+    }
+
+    size_t index( uint64_t hash ) const {
+        uint64_t lo = hash, hi = numBuckets;
+        multiply128( lo, hi );
+        return size_t( hi );
+    }
+
+    size_t next( size_t idx ) const {
+        return ++idx == numBuckets ? 0 : idx;
+    }
+
+    size_t numBuckets;
+};
+
+
+// Slot layouts say how the linear probing tables, LPHash and LazyLPHash,
+// tell full slots from empty ones. They are the tables' last template
+// argument.
+// FlaggedSlots, the default, keeps flags next to every key, and LPHash
+// also keeps its full hash. Any key type works, and keys are only
+// hashed once. RHHash always uses it, with the probe length of each
+// entry as its flag, as it reads that length at every slot it probes.
+// SentinelKeys reserves key values instead: a slot holding EMPTY is
+// empty, and in LazyLPHash one holding TOMBSTONE is deleted, e.g.
+//     LPHash<int, int, HashFn<int>, Pow2Index, std::allocator<char>,
+//            SentinelKeys<int, INT_MIN>> h;
+// An entry is then just its key and value, 8 bytes for <int, int>, so
+// twice as many entries share a cache line, and tables rehash a key
+// wherever they would have read its stored hash or probe length, which
+// suits keys with cheap hashes. Putting a reserved key throws.
+struct FlaggedSlots {
+    static const bool SENTINEL = false;
+
+    // whether deleted slots can be told from empty ones
+    static const bool TOMBSTONES = true;
+
+    // an all zero entry is empty
+    static const bool ZERO_IS_EMPTY = true;
+
+    template <typename Q>
+    static void checkKey( const Q& ) {}
+};
+
+template <typename K, K Empty, K Tombstone = Empty>
+struct SentinelKeys {
+    static const bool SENTINEL = true;
+    static constexpr K EMPTY = Empty;
+    static constexpr K TOMBSTONE = Tombstone;
+    static constexpr bool TOMBSTONES = Empty != Tombstone;
+    static constexpr bool ZERO_IS_EMPTY = Empty == K();
+
+    template <typename Q>
+    static void checkKey( const Q& key ) {
+        if( key == Empty || key == Tombstone ) {
+            throw std::runtime_error("Key is reserved by the SentinelKeys layout.");
+        }
+    }
+};
+
+// entry of a table in the SentinelKeys layout Layout
+template <typename K, typename V, class Layout>
+struct SentinelEntry {
+    SentinelEntry() : key(Layout::EMPTY) {}
+    SentinelEntry( K key, V val ) : key(key), val(val) {}
+
+    bool occupied() const {
+        return key != Layout::EMPTY && !deleted();
+    }
+
+    // only LazyLPHash, which needs a TOMBSTONE apart from EMPTY,
+    // deletes entries
+    bool deleted() const {
+        return Layout::TOMBSTONES && key == Layout::TOMBSTONE;
+    }
+
+    void clear() {
+        key = Layout::EMPTY;
+    }
+
+    K key;
+    V val;
+};
+
+
+// Hints the CPU to start loading the cache line holding addr, so that
+// batched operations overlap the cache misses of many keys.
+inline void prefetchLine( const void * addr ) {
+#if defined(__GNUC__) || defined(__clang__)
+    __builtin_prefetch( addr );
+#else
+    (void) addr;
+#endif
+}
+
+
+// Iteration. Table iterators are forward iterators that yield a
+// KeyValueRef, a key and a reference to its value, e.g.
+//     for( auto kv : table ) sum += kv.second;
+// They visit entries in bucket order, and any put or remove
+// invalidates them. Values can be assigned through them.
+template <typename K, typename V>
+struct KeyValueRef {
+    const K& first;
+    V& second;
+};
+
+// Iterator over the full slots of an open addressing table, which
+// provides
+//     size_t nextFull( size_t slot );    // first full slot >= slot, or numBuckets
+//     const K& keyAt( size_t slot );
+//     V& valAt( size_t slot );
+template <class Table>
+struct SlotIterator {
+    typedef typename Table::key_type K;
+    typedef typename Table::mapped_type V;
+
+    typedef std::forward_iterator_tag iterator_category;
+    typedef KeyValueRef<K, V> value_type;
+    typedef KeyValueRef<K, V> reference;
+    typedef std::ptrdiff_t difference_type;
+
+    // operator-> needs something to point to
+    struct pointer {
+        const reference * operator->() const {
+            return &ref;
+        }
+
+        reference ref;
+    };
+
+    SlotIterator( Table * table, size_t slot ) : table(table), slot(slot) {}
+
+    reference operator*() const {
+        return reference{ table->keyAt( slot ), table->valAt( slot ) };
+    }
+
+    pointer operator->() const {
+        return pointer{ **this };
+    }
+
+    SlotIterator& operator++() {
+        slot = table->nextFull( slot + 1 );
+        return *this;
+    }
+
+    SlotIterator operator++( int ) {
+        SlotIterator prev = *this;
+        ++*this;
+        return prev;
+    }
+
+    bool operator==( const SlotIterator& other ) const {
+        return slot == other.slot;
+    }
+
+    bool operator!=( const SlotIterator& other ) const {
+        return slot != other.slot;
+    }
+
+    Table * table;
+    size_t slot;
+};
+
+
+// Allocators that hand out zero-filled memory declare
+//     static const bool zero_filled = true;
+// so tables can skip initializing arrays whose empty state is all
+// zero bytes, and leave pages they never touch to the OS.
+template <class Alloc, class = void>
+struct AllocatorZeroFills : std::false_type {};
+
+template <class Alloc>
+struct AllocatorZeroFills<Alloc, std::void_t<decltype( Alloc::zero_filled )>>
+    : std::integral_constant<bool, Alloc::zero_filled> {};
+
+
 // Template for a generic hash table. The static assert guarantees
-// that the Hasher provides a method that hashes keys of type K to int.
-template <typename K, typename V, class Hasher = HashFn<K>>
+// that the Hasher provides a method that hashes keys of type K to an
+// unsigned integer, of 32 or 64 bits.
+// Index selects how hashes are mapped to buckets, see above.
+// Allocator provides the memory for bucket arrays, and is rebound to
+// whatever type the table stores.
+
+// IHash is a static interface using the curiously recurring template
+// pattern: Derived is the implementing table, which must provide
+//     template <bool Assign, typename KK, typename... Args>
+//     std::pair<V *, bool> insertHashed( HashValue hash, KK&& key, Args&&... args );
+//     template <typename Q> V * findHashed( const Q& key, HashValue hash );
+//     template <typename Q> void removeHashed( const Q& key, HashValue hash );
+//     void prefetch( HashValue hash );
+//     void resize( size_t newBuckets );
+// where hash is the Hasher's hash of key, as a HashValueOf<Hasher, K>.
+// IHash hashes keys once and passes the hash down, so batched
+// operations can hash and prefetch ahead of the probes.
+// Nothing is virtual, so tables carry no vtable pointer and every
+// call inlines into its caller. Operations shared by all tables can
+// reach the implementation through derived(). Code that needs runtime
+// polymorphism can wrap a table in AnyHash, see any_hash.hpp.
+
+// insert() constructs the value from args if key is missing, and
+// returns a pointer to the value and whether it was inserted. If key
+// exists, it assigns a value constructed from args when Assign is set,
+// and leaves the value untouched otherwise. find() returns a pointer
+// to the value, or nullptr if key doesn't exist; it never throws, so a
+// miss costs no more than the probe. Lookups take any key type Q that
+// the Hasher can hash and that compares equal to K. prefetch() starts
+// loading the buckets a probe for hash would touch first.
+// Tables also provide begin(), end() and erase_if( pred ), see
+// SlotIterator above.
+template <class Derived, typename K, typename V, class Hasher = HashFn<K>,
+         class Index = ModIndex, class Allocator = std::allocator<char>>
 struct IHash {
     static_assert( std::is_base_of<HashFn<K>, Hasher>::value,
             "IHash: Hasher does not hash type of key given!" );
 
-    virtual void put( K key, V val ) = 0;
-    virtual V get( K key ) = 0;
-    virtual void resize( int newBuckets ) = 0;
-    virtual void remove( K key ) = 0;
+    typedef K key_type;
+    typedef V mapped_type;
+    typedef Hasher hasher_type;
+    typedef Index index_type;
+    typedef Allocator allocator_type;
+    typedef HashValueOf<Hasher, K> HashValue;
+
+    template <class T>
+    using rebind_alloc = typename std::allocator_traits<Allocator>::template rebind_alloc<T>;
+
+    Derived& derived() {
+        return static_cast<Derived&>( *this );
+    }
+
+    template <bool Assign, typename KK, typename... Args>
+    std::pair<V *, bool> insert( KK&& key, Args&&... args ) {
+        HashValue hash = hasher.hash( key );
+        return derived().template insertHashed<Assign>( hash,
+                std::forward<KK>( key ), std::forward<Args>( args )... );
+    }
+
+    template <typename Q>
+    V * find( const Q& key ) {
+        return derived().findHashed( key, hasher.hash( key ) );
+    }
+
+    template <typename Q>
+    void remove( const Q& key ) {
+        derived().removeHashed( key, hasher.hash( key ) );
+    }
+
+    // inserts or replaces the value for key
+    template <typename KK, typename VV>
+    void put( KK&& key, VV&& val ) {
+        derived().template insert<true>(
+                std::forward<KK>( key ), std::forward<VV>( val ) );
+    }
+
+    // like put, but the value is constructed from args
+    template <typename KK, typename... Args>
+    std::pair<V *, bool> emplace( KK&& key, Args&&... args ) {
+        return derived().template insert<true>(
+                std::forward<KK>( key ), std::forward<Args>( args )... );
+    }
+
+    // throws if key doesn't exist. Prefer find, contains or get_or
+    // when misses are expected, as they don't throw.
+    template <typename Q>
+    V get( const Q& key ) {
+        V * val = derived().find( key );
 
-    int probeLength( int desired, int current ) {
+        if( !val ) {
+            throw std::runtime_error("Key doesn't exist.");
+        }
+
+        return *val;
+    }
+
+    template <typename Q>
+    bool contains( const Q& key ) {
+        return derived().find( key ) != nullptr;
+    }
+
+    // returns def if key doesn't exist
+    template <typename Q>
+    V get_or( const Q& key, const V& def ) {
+        V * val = derived().find( key );
+        return val ? *val : def;
+    }
+
+    // constructs the value from args only if key is missing; an
+    // existing value is left untouched
+    template <typename KK, typename... Args>
+    std::pair<V *, bool> try_emplace( KK&& key, Args&&... args ) {
+        return derived().template insert<false>(
+                std::forward<KK>( key ), std::forward<Args>( args )... );
+    }
+
+    // Batched operations. Keys are hashed and their buckets prefetched
+    // BATCH_GROUP at a time before any of them is probed, so the cache
+    // misses of a group overlap instead of being paid one by one. Puts
+    // and removes run in key order, so a key that appears twice in a
+    // put batch ends up with its last value.
+    static const int BATCH_GROUP = 16;
+
+    void put_batch( const K * keys, const V * vals, size_t n ) {
+        HashValue hashes[BATCH_GROUP];
+
+        for( size_t start = 0; start < n; start += BATCH_GROUP ) {
+            int m = int( std::min<size_t>( BATCH_GROUP, n - start ) );
+
+            hashGroup( keys + start, hashes, m );
+            uint64_t seed = hasherSeed( hasher );
+
+            for( int i = 0; i < m; ++i ) {
+                derived().template insertHashed<true>( hashes[i],
+                        keys[start + i], vals[start + i] );
+
+                // the insert rebuilt the table under a new seed, see
+                // ProbeGuard, so the rest of the group needs rehashing
+                if( hasherSeed( hasher ) != seed ) {
+                    seed = hasherSeed( hasher );
+                    hashGroup( keys + start + i + 1, hashes + i + 1, m - i - 1 );
+                }
+            }
+        }
+    }
+
+    // copies the value of keys[i] into vals[i] and sets found[i] to
+    // whether it exists. Returns the number of keys found.
+    template <typename Q>
+    size_t get_batch( const Q * keys, V * vals, bool * found, size_t n ) {
+        HashValue hashes[BATCH_GROUP];
+        size_t numFound = 0;
+
+        for( size_t start = 0; start < n; start += BATCH_GROUP ) {
+            int m = int( std::min<size_t>( BATCH_GROUP, n - start ) );
+
+            hashGroup( keys + start, hashes, m );
+
+            for( int i = 0; i < m; ++i ) {
+                V * val = derived().findHashed( keys[start + i], hashes[i] );
+
+                found[start + i] = val != nullptr;
+                if( val ) {
+                    vals[start + i] = *val;
+                    ++numFound;
+                }
+            }
+        }
+
+        return numFound;
+    }
+
+    template <typename Q>
+    void remove_batch( const Q * keys, size_t n ) {
+        HashValue hashes[BATCH_GROUP];
+
+        for( size_t start = 0; start < n; start += BATCH_GROUP ) {
+            int m = int( std::min<size_t>( BATCH_GROUP, n - start ) );
+
+            hashGroup( keys + start, hashes, m );
+
+            for( int i = 0; i < m; ++i ) {
+                derived().removeHashed( keys[start + i], hashes[i] );
+            }
+        }
+    }
+
+    template <typename Q>
+    void hashGroup( const Q * keys, HashValue * hashes, int m ) {
+        for( int i = 0; i < m; ++i ) {
+            hashes[i] = hasher.hash( keys[i] );
+            derived().prefetch( hashes[i] );
+        }
+    }
+
+    size_t probeLength( size_t desired, size_t current ) {
         return (current >= desired) ?
             ( current - desired ) : ( current + this->numBuckets - desired );
     }
 
-    int hash( K key ) {
-        return hasher.hash( key ) % numBuckets;
+    template <typename Q>
+    size_t hash( const Q& key ) {
+        return indexer.index( HashValue( hasher.hash( key ) ) );
+    }
+
+    size_t next( size_t idx ) {
+        return indexer.next( idx );
+    }
+
+    // the capacity setBuckets( _numBuckets ) would set, rounded as
+    // required by the index policy, without setting it, so a resize can
+    // allocate its new array before it changes the table. A 32 bit hash
+    // can't tell more than 2^32 buckets apart.
+    size_t capacityFor( size_t _numBuckets ) const {
+        size_t capacity = Index::capacity( _numBuckets );
+
+        if( sizeof( HashValue ) < 8 && capacity > ( size_t( 1 ) << 32 ) ) {
+            throw std::runtime_error("Capacity needs a 64 bit Hasher, such as Hash64.");
+        }
+
+        return capacity;
+    }
+
+    // sets the capacity, see capacityFor()
+    void setBuckets( size_t _numBuckets ) {
+        numBuckets = capacityFor( _numBuckets );
+        indexer.setCapacity( numBuckets );
     }
 
     float getLoadFactor( void ) {
         return float(numEntries) / float(numBuckets);
     }
 
-    int numEntries;
-    int numBuckets;
+    // Allocates n value-initialized T. Zero says that a T of all zero
+    // bytes is a valid empty T, in which case the initialization is
+    // skipped if the allocator zero fills. If a T() throws, the ones
+    // already built are destroyed and the memory is freed.
+    template <class T, bool Zero = false>
+    T * allocateArray( size_t n ) {
+        rebind_alloc<T> alloc( allocator );
+        T * arr = std::allocator_traits<rebind_alloc<T>>::allocate( alloc, n );
+
+        if( !( Zero && AllocatorZeroFills<Allocator>::value ) ) {
+            size_t i = 0;
+
+            try {
+                for( ; i < n; ++i ) {
+                    new (arr + i) T();
+                }
+            } catch( ... ) {
+                while( i > 0 ) {
+                    arr[--i].~T();
+                }
+                std::allocator_traits<rebind_alloc<T>>::deallocate( alloc, arr, n );
+                throw;
+            }
+        }
+
+        return arr;
+    }
+
+    template <class T>
+    void deallocateArray( T * arr, size_t n ) {
+        if( !arr ) return;
+
+        if( !std::is_trivially_destructible<T>::value ) {
+            for( size_t i = 0; i < n; ++i ) {
+                arr[i].~T();
+            }
+        }
+
+        rebind_alloc<T> alloc( allocator );
+        std::allocator_traits<rebind_alloc<T>>::deallocate( alloc, arr, n );
+    }
+
+    size_t numEntries;
+    size_t numBuckets;
     float loadThreshold;
     Hasher hasher;
+    Index indexer;
+    Allocator allocator;
 };
 
 // Note: You will see in the implementation classes that they use
@@ -0,0 +1,205 @@
+#pragma once
+
+#include "hash.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility> // for pair, index_sequence
+
+
+// 64-bit hash functions. Hash64<K> is a Hasher for any of the tables,
+// like HashFn<K>, e.g.
+//     RHHash<std::string, int, Hash64<std::string>> h( 1 << 20, 0.9 );
+// and covers
+//     - integers and enums, through a 64-bit mixer
+//     - std::string, also hashable as std::string_view or const char *,
+//       through wyhash
+//     - std::pair and std::tuple of hashable types, by combining the
+//       hashes of their members
+//     - any other trivially copyable type without padding, such as a
+//       struct of integers, by hashing its bytes with wyhash
+// Tables store and index with the full 64 bit hash, so they can grow
+// past 2^32 buckets, see HashValueOf. Every Hash64 is seedable, see
+// SeededHashFn, and hashes the same way at seed 0.
+
+// Key Concepts:
+// 1. wyhash reads its input 8 or 16 bytes at a time and folds them in
+// with 64x64 -> 128 bit multiplies, where djb2 spends a multiply-add
+// on every byte, so long keys such as URLs hash several times faster.
+// 2. Short inputs, up to 16 bytes, are read with at most four
+// overlapping loads and no loop.
+// 3. The integer mixer is the splitmix64 finalizer, whose every output
+// bit depends on every input bit, so keys that differ only in their
+// high bits, or form a stride, spread over all buckets under any
+// index policy.
+
+// wyhash, final version 4, by Wang Yi, released into the public domain:
+// https://github.com/wangyi-fudan/wyhash
+struct WyHash {
+    static const uint64_t SECRET0 = 0x2d358dccaa6c78a5ull;
+    static const uint64_t SECRET1 = 0x8bb84b93962eacc9ull;
+    static const uint64_t SECRET2 = 0x4b33a62ed433d4a3ull;
+    static const uint64_t SECRET3 = 0x4d5a2da51de1aa47ull;
+
+    static uint64_t mix( uint64_t a, uint64_t b ) {
+        multiply128( a, b );
+        return a ^ b;
+    }
+
+    // unaligned little endian loads
+    static uint64_t read8( const uint8_t * p ) {
+        uint64_t v;
+        memcpy( &v, p, 8 );
+        return v;
+    }
+
+    static uint64_t read4( const uint8_t * p ) {
+        uint32_t v;
+        memcpy( &v, p, 4 );
+        return v;
+    }
+
+    // 1 to 3 bytes
+    static uint64_t read3( const uint8_t * p, size_t k ) {
+        return ( uint64_t( p[0] ) << 16 ) | ( uint64_t( p[k >> 1] ) << 8 ) | p[k - 1];
+    }
+
+    static uint64_t hash( const void * key, size_t len, uint64_t seed = 0 ) {
+        const uint8_t * p = static_cast<const uint8_t *>( key );
+        uint64_t a, b;
+
+        seed ^= mix( seed ^ SECRET0, SECRET1 );
+
+        if( len <= 16 ) {
+            if( len >= 4 ) {
+                a = ( read4( p ) << 32 ) | read4( p + ( ( len >> 3 ) << 2 ) );
+                b = ( read4( p + len - 4 ) << 32 ) | read4( p + len - 4 - ( ( len >> 3 ) << 2 ) );
+            } else if( len > 0 ) {
+                a = read3( p, len );
+                b = 0;
+            } else {
+                a = b = 0;
+            }
+        } else {
+            size_t i = len;
+
+            // three independent lanes, so the multiplies overlap
+            if( i > 48 ) {
+                uint64_t see1 = seed, see2 = seed;
+
+                do {
+                    seed = mix( read8( p ) ^ SECRET1, read8( p + 8 ) ^ seed );
+                    see1 = mix( read8( p + 16 ) ^ SECRET2, read8( p + 24 ) ^ see1 );
+                    see2 = mix( read8( p + 32 ) ^ SECRET3, read8( p + 40 ) ^ see2 );
+                    p += 48;
+                    i -= 48;
+                } while( i > 48 );
+
+                seed ^= see1 ^ see2;
+            }
+
+            while( i > 16 ) {
+                seed = mix( read8( p ) ^ SECRET1, read8( p + 8 ) ^ seed );
+                i -= 16;
+                p += 16;
+            }
+
+            a = read8( p + i - 16 );
+            b = read8( p + i - 8 );
+        }
+
+        a ^= SECRET1;
+        b ^= seed;
+        multiply128( a, b );
+
+        return mix( a ^ SECRET0 ^ len, b ^ SECRET1 );
+    }
+};
+
+// hash of a sequence of values, from the hash so far and the next
+// value's hash
+inline uint64_t hashCombine( uint64_t seed, uint64_t hash ) {
+    return WyHash::mix( seed ^ WyHash::SECRET0, hash ^ WyHash::SECRET1 );
+}
+
+
+template <typename K>
+struct IsComposite : std::false_type {};
+
+template <typename A, typename B>
+struct IsComposite<std::pair<A, B>> : std::true_type {};
+
+template <typename... Ts>
+struct IsComposite<std::tuple<Ts...>> : std::true_type {};
+
+// types hashed by their bytes. Padding bytes have no defined value, and
+// floating point numbers have two zeros, so types with either are left
+// out.
+template <typename K>
+struct IsHashableBytes : std::integral_constant<bool,
+    !std::is_integral<K>::value && !std::is_enum<K>::value && !IsComposite<K>::value &&
+    std::is_trivially_copyable<K>::value && std::has_unique_object_representations<K>::value> {};
+
+
+// As with HashFn, the primary template has no hash(), so key types that
+// none of the specializations cover fail to compile.
+template <typename K, class Enable = void>
+struct Hash64 : public HashFn<K> {};
+
+template <typename K>
+struct Hash64<K, std::enable_if_t<std::is_integral<K>::value || std::is_enum<K>::value>>
+    : public SeededHashFn<K> {
+    uint64_t hash( K key ) {
+        return mix64( uint64_t( key ) ^ this->seed );
+    }
+};
+
+template <>
+struct Hash64<std::string> : public SeededHashFn<std::string> {
+    uint64_t hash( std::string_view str ) {
+        return WyHash::hash( str.data(), str.size(), this->seed );
+    }
+
+    uint64_t hash( const std::string& str ) {
+        return hash( std::string_view( str ) );
+    }
+
+    uint64_t hash( const char * str ) {
+        return hash( std::string_view( str ) );
+    }
+};
+
+template <typename K>
+struct Hash64<K, std::enable_if_t<IsHashableBytes<K>::value>> : public SeededHashFn<K> {
+    uint64_t hash( const K& key ) {
+        return WyHash::hash( &key, sizeof( K ), this->seed );
+    }
+};
+
+template <typename A, typename B>
+struct Hash64<std::pair<A, B>> : public SeededHashFn<std::pair<A, B>> {
+    uint64_t hash( const std::pair<A, B>& key ) {
+        return hashCombine( Hash64<A>().hash( key.first ) ^ this->seed,
+                Hash64<B>().hash( key.second ) );
+    }
+};
+
+template <typename... Ts>
+struct Hash64<std::tuple<Ts...>> : public SeededHashFn<std::tuple<Ts...>> {
+    uint64_t hash( const std::tuple<Ts...>& key ) {
+        return hashMembers( key, this->seed, std::index_sequence_for<Ts...>() );
+    }
+
+    template <size_t... I>
+    static uint64_t hashMembers( const std::tuple<Ts...>& key, uint64_t seed,
+            std::index_sequence<I...> ) {
+        uint64_t h = sizeof...( Ts ) ^ seed;
+        ( ( h = hashCombine( h, Hash64<std::tuple_element_t<I, std::tuple<Ts...>>>().hash(
+                std::get<I>( key ) ) ) ), ... );
+        return h;
+    }
+};
@@ -0,0 +1,308 @@
+#pragma once
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+
+// Instrumentation for the single-threaded tables. Compile with
+// -DHASH_STATS to give every table a TableStats member, stats, which
+// records as the table runs:
+//     - the probe length of each put, get hit, get miss and remove
+//     - the number of entries each RHHash or HopscotchHash put displaces
+//     - the number of entries each remove shifts back
+//     - the duration of each resize, and so their number
+// Without HASH_STATS the macros below expand to nothing, so tables pay
+// neither time nor space for them.
+//
+// Samples go into histograms, which merge, so the stats of the shards
+// of a ShardedHash, or of tables on many hosts, can be combined, and
+// are read through forEach() or exported with toJson() rather than
+// printed.
+
+// Key Concepts:
+// 1. Recording a sample is an increment of one counter, plus updates of
+// the count, sum and max. Nothing allocates.
+// 2. Values below EXACT get a bucket each, so short probe lengths are
+// exact. Larger ones share SUB_BUCKETS buckets per power of two, so a
+// percentile of durations is within 1/SUB_BUCKETS of the true value.
+// 3. Probe lengths are counted by the lookup, which doesn't know what
+// operation it serves, so it leaves them in scratch fields of the
+// stats and the operation records them.
+// 4. Tables that resize by inserting their entries again would count
+// those inserts as puts, so nothing but the resize itself is recorded
+// while a resize runs.
+
+
+#ifdef HASH_STATS
+#define HASH_STATS_INIT TableStats stats;
+#define HASH_STATS_SET( field, x ) this->stats.field = ( x );
+#define HASH_STATS_INC( field ) ++this->stats.field;
+#define HASH_STATS_OP( op ) \
+    if( !this->stats.resizing ) this->stats.probes[op].record( this->stats.probe );
+#define HASH_STATS_RECORD( hist, x ) \
+    if( !this->stats.resizing ) this->stats.hist.record( x );
+#define HASH_STATS_RESIZE ResizeTimer resizeTimer( this->stats );
+#else
+#define HASH_STATS_INIT
+#define HASH_STATS_SET( field, x )
+#define HASH_STATS_INC( field )
+#define HASH_STATS_OP( op )
+#define HASH_STATS_RECORD( hist, x )
+#define HASH_STATS_RESIZE
+#endif
+
+
+// Histogram of nonnegative integer samples, such as probe lengths or
+// durations in nanoseconds.
+struct Histogram {
+    static const int SUB_BITS = 3;
+    static const int SUB_BUCKETS = 1 << SUB_BITS;
+    static const int EXACT = 2 * SUB_BUCKETS;
+
+    // EXACT values, then SUB_BUCKETS for each power of two from
+    // 2^(SUB_BITS + 1) to 2^63
+    static const int NUM_BUCKETS = EXACT + ( 63 - SUB_BITS ) * SUB_BUCKETS;
+
+    Histogram() {
+        clear();
+    }
+
+    void clear() {
+        for( int b = 0; b < NUM_BUCKETS; ++b ) {
+            counts[b] = 0;
+        }
+
+        n = 0;
+        sum = 0;
+        sumSquares = 0;
+        maxValue = 0;
+    }
+
+    void record( uint64_t x ) {
+        ++counts[bucketOf( x )];
+        ++n;
+        sum += double( x );
+        sumSquares += double( x ) * double( x );
+        if( x > maxValue ) maxValue = x;
+    }
+
+    void merge( const Histogram& other ) {
+        for( int b = 0; b < NUM_BUCKETS; ++b ) {
+            counts[b] += other.counts[b];
+        }
+
+        n += other.n;
+        sum += other.sum;
+        sumSquares += other.sumSquares;
+        if( other.maxValue > maxValue ) maxValue = other.maxValue;
+    }
+
+    static int bucketOf( uint64_t x ) {
+        if( x < uint64_t( EXACT ) ) return int( x );
+
+        int log = 63;
+        while( !( x >> log ) ) --log;
+
+        int sub = int( x >> ( log - SUB_BITS ) ) & ( SUB_BUCKETS - 1 );
+        return EXACT + ( log - SUB_BITS - 1 ) * SUB_BUCKETS + sub;
+    }
+
+    // smallest and largest value that fall in bucket b
+    static uint64_t bucketLow( int b ) {
+        if( b < EXACT ) return uint64_t( b );
+
+        int log = ( b - EXACT ) / SUB_BUCKETS + SUB_BITS + 1;
+        int sub = ( b - EXACT ) % SUB_BUCKETS;
+        return uint64_t( SUB_BUCKETS + sub ) << ( log - SUB_BITS );
+    }
+
+    static uint64_t bucketHigh( int b ) {
+        if( b < EXACT ) return uint64_t( b );
+
+        int log = ( b - EXACT ) / SUB_BUCKETS + SUB_BITS + 1;
+        return bucketLow( b ) + ( uint64_t( 1 ) << ( log - SUB_BITS ) ) - 1;
+    }
+
+    uint64_t count() const {
+        return n;
+    }
+
+    uint64_t max() const {
+        return maxValue;
+    }
+
+    double mean() const {
+        return n ? sum / double( n ) : 0;
+    }
+
+    double variance() const {
+        if( n < 2 ) return 0;
+
+        double m = mean();
+        double v = ( sumSquares - m * sum ) / double( n - 1 );
+        return v > 0 ? v : 0;
+    }
+
+    double sd() const {
+        return sqrt( variance() );
+    }
+
+    // value at or below which a fraction p of the samples are. Values
+    // of at least EXACT are rounded up to the end of their bucket, but
+    // never past the largest sample.
+    uint64_t percentile( double p ) const {
+        if( !n ) return 0;
+
+        uint64_t rank = uint64_t( std::ceil( p * double( n ) ) );
+        if( rank < 1 ) rank = 1;
+
+        uint64_t seen = 0;
+
+        for( int b = 0; b < NUM_BUCKETS; ++b ) {
+            seen += counts[b];
+
+            if( seen >= rank ) {
+                uint64_t high = bucketHigh( b );
+                return high < maxValue ? high : maxValue;
+            }
+        }
+
+        return maxValue;
+    }
+
+    // appends a JSON object with the summary statistics and the non
+    // empty buckets, as [lowest value, count] pairs
+    void toJson( std::string& out ) const {
+        char buf[256];
+
+        snprintf( buf, sizeof( buf ),
+                "{\"count\":%llu,\"mean\":%.6g,\"sd\":%.6g,\"max\":%llu,"
+                "\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"p999\":%llu,\"buckets\":[",
+                (unsigned long long) n, mean(), sd(), (unsigned long long) maxValue,
+                (unsigned long long) percentile( 0.5 ), (unsigned long long) percentile( 0.9 ),
+                (unsigned long long) percentile( 0.99 ), (unsigned long long) percentile( 0.999 ) );
+        out += buf;
+
+        bool first = true;
+
+        for( int b = 0; b < NUM_BUCKETS; ++b ) {
+            if( !counts[b] ) continue;
+
+            snprintf( buf, sizeof( buf ), "%s[%llu,%llu]", first ? "" : ",",
+                    (unsigned long long) bucketLow( b ), (unsigned long long) counts[b] );
+            out += buf;
+            first = false;
+        }
+
+        out += "]}";
+    }
+
+    uint64_t counts[NUM_BUCKETS];
+    uint64_t n;
+    uint64_t maxValue;
+    double sum;
+    double sumSquares;
+};
+
+
+enum StatOp {
+    STAT_PUT,
+    STAT_GET_HIT,
+    STAT_GET_MISS,
+    STAT_REMOVE,
+    NUM_STAT_OPS
+};
+
+struct TableStats {
+    void clear() {
+        for( Histogram& h : probes ) {
+            h.clear();
+        }
+
+        swaps.clear();
+        shifts.clear();
+        resizes.clear();
+    }
+
+    void merge( const TableStats& other ) {
+        for( int op = 0; op < NUM_STAT_OPS; ++op ) {
+            probes[op].merge( other.probes[op] );
+        }
+
+        swaps.merge( other.swaps );
+        shifts.merge( other.shifts );
+        resizes.merge( other.resizes );
+    }
+
+    // calls fn( name, histogram ) for every histogram
+    template <class Fn>
+    void forEach( Fn fn ) const {
+        fn( "put_probes", probes[STAT_PUT] );
+        fn( "get_hit_probes", probes[STAT_GET_HIT] );
+        fn( "get_miss_probes", probes[STAT_GET_MISS] );
+        fn( "remove_probes", probes[STAT_REMOVE] );
+        fn( "put_swaps", swaps );
+        fn( "remove_shifts", shifts );
+        fn( "resize_ns", resizes );
+    }
+
+    std::string toJson() const {
+        std::string out = "{";
+        bool first = true;
+
+        forEach( [&]( const char * name, const Histogram& h ) {
+            if( !first ) out += ",";
+            out += "\"";
+            out += name;
+            out += "\":";
+            h.toJson( out );
+            first = false;
+        } );
+
+        out += "}";
+        return out;
+    }
+
+    // probe length for each kind of operation, counted from 0 at the
+    // key's home bucket
+    Histogram probes[NUM_STAT_OPS];
+
+    // entries displaced by each put of a new key
+    Histogram swaps;
+
+    // entries shifted back by each remove
+    Histogram shifts;
+
+    // duration of each resize in nanoseconds. For incremental resizes,
+    // only the start is timed.
+    Histogram resizes;
+
+    // scratch counts of the operation in progress
+    int probe = 0;
+    int moves = 0;
+
+    bool resizing = false;
+};
+
+// records the duration of a resize, from its construction to its
+// destruction, and pauses the other stats meanwhile
+struct ResizeTimer {
+    ResizeTimer( TableStats& stats )
+        : stats(stats), wasResizing(stats.resizing),
+          start(std::chrono::steady_clock::now()) {
+        stats.resizing = true;
+    }
+
+    ~ResizeTimer() {
+        stats.resizing = wasResizing;
+        stats.resizes.record( uint64_t( std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start ).count() ) );
+    }
+
+    TableStats& stats;
+    bool wasResizing;
+    std::chrono::steady_clock::time_point start;
+};
@@ -0,0 +1,457 @@
+#pragma once
+
+#include "hash.hpp"
+#include "hash_stats.hpp"
+#include <cstdint>
+#include <algorithm> // for min
+#include <stdexcept>
+#include <type_traits>
+#include <utility> // for forward, move, swap
+#include <vector>
+
+
+// Template for hash using hopscotch hashing, after Herlihy, Shavit and
+// Tzafrir.
+
+// Key Concepts:
+// 1. Every key lives within NEIGHBORHOOD slots of its home bucket. Each
+// bucket keeps a hop bitmap, with bit j set if slot home + j holds an
+// entry whose home is this bucket, so a lookup reads the bitmap and
+// compares only the keys it points to. A miss on a bucket that no key
+// calls home touches no key at all.
+// 2. An insert takes the first empty slot at or after the home bucket.
+// While that slot is too far away, an entry between the two whose own
+// neighborhood still covers the empty slot moves into it, and the slot
+// it leaves becomes the empty one, hopping the hole back towards home.
+// 3. If no entry can move, or there is no empty slot left, the table
+// grows. More than NEIGHBORHOOD keys with the same home bucket can't be
+// placed at any size, so an insert that still fails after MAX_GROWS
+// growths throws.
+// 4. Neighborhoods never wrap: the entry array ends in NEIGHBORHOOD - 1
+// extra slots past the last bucket, which only hold displaced entries.
+// 5. The hop bitmaps sit in their own array, one per bucket, and keys
+// and values together in a dense entry array, so a lookup reads one
+// line of bitmaps and then only the lines of the entries its bitmap
+// marks. Which slots are full is kept in a third array with one bit per
+// slot, which inserts scan for an empty slot 64 slots at a time.
+template<typename K, typename V, class Hasher = HashFn<K>, class Index = ModIndex,
+         class Allocator = std::allocator<char>>
+struct HopscotchHash : public IHash<HopscotchHash<K, V, Hasher, Index, Allocator>, K, V, Hasher, Index, Allocator> {
+    HASH_STATS_INIT
+
+    typedef HashValueOf<Hasher, K> HashValue;
+    typedef uint64_t HopBits;
+
+    // With random keys, tables of millions of buckets first fail to
+    // place a key at a load of about 0.93 with 64 slot neighborhoods,
+    // and about 0.84 with 32 slot ones. A neighborhood bounds how far a
+    // key may sit from home, not how far it does: keys still sit about
+    // as far as linear probing would put them, so the width only costs
+    // the few lookups of keys displaced that far.
+    static const int NEIGHBORHOOD = 64;
+    static const int MAX_GROWS = 2;
+
+    struct Entry {
+        K key;
+        V val;
+    };
+
+    // keys and values of empty slots are never read, so zero filled
+    // memory needs no initialization when they are trivial
+    static const bool ZERO_ENTRIES =
+        std::is_trivial<K>::value && std::is_trivial<V>::value;
+
+    // whether rebuild() can move entries into a fresh table without
+    // risking an exception halfway through
+    static const bool NOTHROW_MOVE =
+        std::is_nothrow_move_assignable<K>::value &&
+        std::is_nothrow_move_assignable<V>::value;
+
+    // index of the lowest set bit of a non-zero mask
+    static int lowestBit( HopBits mask ) {
+#if defined(__GNUC__) || defined(__clang__)
+        return __builtin_ctzll( mask );
+#else
+        int i = 0;
+        while( !( mask & 1 ) ) {
+            mask >>= 1;
+            ++i;
+        }
+        return i;
+#endif
+    }
+
+    HopscotchHash( size_t _numBuckets, float _loadThreshold,
+            const Allocator& _allocator = Allocator() ) {
+        this->allocator = _allocator;
+        this->setBuckets( _numBuckets );
+        this->loadThreshold = _loadThreshold;
+        this->numEntries = 0;
+
+        allocate();
+    }
+
+    HopscotchHash() : HopscotchHash(10, 0.7) {}
+
+    ~HopscotchHash() {
+        this->deallocateArray( hops, this->numBuckets );
+        this->deallocateArray( used, usedWords() );
+        this->deallocateArray( entries, numSlots() );
+    }
+
+    // buckets plus the slots past the last one that its neighborhood
+    // reaches
+    size_t numSlots() const {
+        return this->numBuckets + NEIGHBORHOOD - 1;
+    }
+
+    // words of the bitmap of full slots
+    size_t usedWords() const {
+        return ( numSlots() + 63 ) / 64;
+    }
+
+    // frees the arrays it got if a later one can't be allocated, as the
+    // destructor of a table whose constructor throws never runs
+    void allocate() {
+        try {
+            this->hops = this->template allocateArray<HopBits, true>( this->numBuckets );
+            this->used = this->template allocateArray<uint64_t, true>( usedWords() );
+            this->entries = this->template allocateArray<Entry, ZERO_ENTRIES>( numSlots() );
+        } catch( ... ) {
+            this->deallocateArray( hops, this->numBuckets );
+            this->deallocateArray( used, usedWords() );
+            throw;
+        }
+    }
+
+    bool full( size_t slot ) const {
+        return ( used[slot / 64] >> ( slot % 64 ) ) & 1;
+    }
+
+    void setFull( size_t slot ) {
+        used[slot / 64] |= uint64_t( 1 ) << ( slot % 64 );
+    }
+
+    void clearFull( size_t slot ) {
+        used[slot / 64] &= ~( uint64_t( 1 ) << ( slot % 64 ) );
+    }
+
+    // Grows or shrinks the table to newBuckets, doubling that until
+    // every entry fits, at most MAX_GROWS times. The table is left as it
+    // was if a size never fits or anything throws.
+    void resize( size_t newBuckets ) {
+        resizeWithin( newBuckets, MAX_GROWS );
+    }
+
+    // resize, doubling newBuckets at most maxGrows times, and returns
+    // how many times it did
+    int resizeWithin( size_t newBuckets, int maxGrows ) {
+        HASH_STATS_RESIZE
+
+        int grows = 0;
+
+        for( ; !rebuild( newBuckets ); ++grows ) {
+            if( grows == maxGrows ) {
+                throw std::runtime_error("Too many keys share a neighborhood, use a stronger Hasher.");
+            }
+
+            newBuckets *= 2;
+        }
+
+        return grows;
+    }
+
+    // Rebuilds the table at newBuckets in a fresh one, and swaps the
+    // fresh arrays in once it holds every entry. Entries are moved over
+    // as they are placed, or copied if moving them could throw, so only
+    // a copy can throw, and this table is left whole. If some key can't
+    // be placed, this returns false, after moving back any entries it
+    // moved, which origins maps from their new slots to their old ones.
+    bool rebuild( size_t newBuckets ) {
+        HopscotchHash fresh( newBuckets, this->loadThreshold, this->allocator );
+        fresh.hasher = this->hasher;
+
+        std::vector<size_t> origins( NOTHROW_MOVE ? fresh.numSlots() : 0 );
+
+        for( size_t i = nextFull( 0 ); i < numSlots(); i = nextFull( i + 1 ) ) {
+            Entry& from = this->entries[i];
+            size_t home = fresh.indexer.index( fresh.hasher.hash( from.key ) );
+            size_t idx = fresh.freeSlot( home, NOTHROW_MOVE ? origins.data() : nullptr );
+
+            if( idx == NOT_FOUND ) {
+                if constexpr( NOTHROW_MOVE ) {
+                    for( size_t j = fresh.nextFull( 0 ); j < fresh.numSlots(); j = fresh.nextFull( j + 1 ) ) {
+                        this->entries[origins[j]].key = std::move( fresh.entries[j].key );
+                        this->entries[origins[j]].val = std::move( fresh.entries[j].val );
+                    }
+                }
+                return false;
+            }
+
+            if constexpr( NOTHROW_MOVE ) {
+                origins[idx] = i;
+                fresh.entries[idx].key = std::move( from.key );
+                fresh.entries[idx].val = std::move( from.val );
+            } else {
+                fresh.entries[idx].key = from.key;
+                fresh.entries[idx].val = from.val;
+            }
+
+            fresh.setFull( idx );
+            fresh.hops[home] |= HopBits( 1 ) << ( idx - home );
+        }
+
+        // fresh frees the old arrays
+        std::swap( this->hops, fresh.hops );
+        std::swap( this->used, fresh.used );
+        std::swap( this->entries, fresh.entries );
+        std::swap( this->numBuckets, fresh.numBuckets );
+        std::swap( this->indexer, fresh.indexer );
+
+        return true;
+    }
+
+    // returns the index of key, or NOT_FOUND if it doesn't exist. The
+    // probe length is the distance from home of the last key compared.
+    template <typename Q>
+    size_t lookup( const Q& key, HashValue hash ) {
+        size_t home = this->indexer.index( hash );
+        HASH_STATS_SET( probe, 0 )
+
+        for( HopBits hop = this->hops[home]; hop; hop &= hop - 1 ) {
+            size_t idx = home + lowestBit( hop );
+            HASH_STATS_SET( probe, idx - home )
+
+            if( this->entries[idx].key == key ) {
+                return idx;
+            }
+        }
+
+        return NOT_FOUND;
+    }
+
+    template <typename Q>
+    size_t lookup( const Q& key ) {
+        return lookup( key, this->hasher.hash( key ) );
+    }
+
+    template <bool Assign, typename KK, typename... Args>
+    std::pair<V *, bool> insertHashed( HashValue hash, KK&& key, Args&&... args ) {
+        if( this->getLoadFactor() >= this->loadThreshold ) {
+            this->resize( this->numBuckets * 2 );
+        }
+
+        size_t idx = lookup( key, hash );
+        HASH_STATS_OP( STAT_PUT )
+
+        if( idx != NOT_FOUND ) {
+            if( Assign ) {
+                this->entries[idx].val = V( std::forward<Args>( args )... );
+            }
+            return std::make_pair( &this->entries[idx].val, false );
+        }
+
+        size_t home = this->indexer.index( hash );
+
+        // growths count once per insert, including those the resize
+        // makes until the old entries fit
+        for( int grows = 0; ( idx = freeSlot( home ) ) == NOT_FOUND; ) {
+            if( grows == MAX_GROWS ) {
+                throw std::runtime_error("Too many keys share a neighborhood, use a stronger Hasher.");
+            }
+
+            grows += 1 + resizeWithin( this->numBuckets * 2, MAX_GROWS - grows - 1 );
+            home = this->indexer.index( hash );
+        }
+
+        Entry& slot = this->entries[idx];
+        slot.key = K( std::forward<KK>( key ) );
+        slot.val = V( std::forward<Args>( args )... );
+        setFull( idx );
+        this->hops[home] |= HopBits( 1 ) << ( idx - home );
+
+        ++this->numEntries;
+
+        return std::make_pair( &slot.val, true );
+    }
+
+    // Finds an empty slot within the neighborhood of home, hopping the
+    // nearest empty slot back as far as needed, see Key Concepts 2.
+    // Returns NOT_FOUND if the table must grow first. Entries moved
+    // before a failure stay in their neighborhoods. If origins is given,
+    // hops move its elements along with the entries, see rebuild().
+    size_t freeSlot( size_t home, size_t * origins = nullptr ) {
+        size_t word = home / 64;
+        uint64_t empty = ~this->used[word] & ( ~uint64_t( 0 ) << ( home % 64 ) );
+
+        while( !empty ) {
+            if( ++word == usedWords() ) {
+                return NOT_FOUND;
+            }
+            empty = ~this->used[word];
+        }
+
+        size_t slot = word * 64 + size_t( lowestBit( empty ) );
+
+        // bits past the last slot read as empty
+        if( slot >= numSlots() ) {
+            return NOT_FOUND;
+        }
+
+        HASH_STATS_SET( moves, 0 )
+
+        while( slot - home >= size_t( NEIGHBORHOOD ) ) {
+            slot = hopBack( slot, origins );
+
+            if( slot == NOT_FOUND ) {
+                return NOT_FOUND;
+            }
+
+            HASH_STATS_INC( moves )
+        }
+
+        HASH_STATS_RECORD( swaps, this->stats.moves )
+        return slot;
+    }
+
+    // moves the entry furthest before the empty slot whose neighborhood
+    // covers it into it, and returns the slot the entry left, or
+    // NOT_FOUND if none can move
+    size_t hopBack( size_t empty, size_t * origins ) {
+        // slots past the last bucket are no entry's home
+        size_t last = std::min( empty, this->numBuckets );
+
+        for( size_t b = empty - ( NEIGHBORHOOD - 1 ); b < last; ++b ) {
+            // entries of b's neighborhood that sit before the empty slot
+            HopBits before = this->hops[b] & ( ( HopBits( 1 ) << ( empty - b ) ) - 1 );
+
+            if( !before ) {
+                continue;
+            }
+
+            int j = lowestBit( before );
+
+            Entry& from = this->entries[b + j];
+            Entry& to = this->entries[empty];
+
+            to.key = std::move( from.key );
+            to.val = std::move( from.val );
+
+            if( origins ) {
+                origins[empty] = origins[b + j];
+            }
+
+            setFull( empty );
+            clearFull( b + j );
+            this->hops[b] ^= ( HopBits( 1 ) << j ) | ( HopBits( 1 ) << ( empty - b ) );
+
+            return b + j;
+        }
+
+        return NOT_FOUND;
+    }
+
+    template <typename Q>
+    V * findHashed( const Q& key, HashValue hash ) {
+        size_t idx = lookup( key, hash );
+
+        if( idx != NOT_FOUND ) {
+            HASH_STATS_OP( STAT_GET_HIT )
+            return &this->entries[idx].val;
+        }
+
+        HASH_STATS_OP( STAT_GET_MISS )
+        return nullptr;
+    }
+
+    // removes need no tombstones or shifts, as lookups only follow the
+    // hop bitmap
+    template <typename Q>
+    void removeHashed( const Q& key, HashValue hash ) {
+        size_t idx = lookup( key, hash );
+        HASH_STATS_OP( STAT_REMOVE )
+
+        // Key does not exist, nothing removed
+        if( idx == NOT_FOUND ) return;
+
+        size_t home = this->indexer.index( hash );
+        this->hops[home] &= ~( HopBits( 1 ) << ( idx - home ) );
+        clearFull( idx );
+
+        --this->numEntries;
+    }
+
+    void prefetch( HashValue hash ) {
+        size_t home = this->indexer.index( hash );
+        prefetchLine( &this->hops[home] );
+        prefetchLine( &this->entries[home] );
+    }
+
+    // Iteration, see SlotIterator
+    typedef SlotIterator<HopscotchHash> iterator;
+
+    iterator begin() {
+        return iterator( this, nextFull( 0 ) );
+    }
+
+    iterator end() {
+        return iterator( this, numSlots() );
+    }
+
+    size_t nextFull( size_t slot ) {
+        while( slot < numSlots() && !full( slot ) ) {
+            ++slot;
+        }
+        return slot;
+    }
+
+    const K& keyAt( size_t slot ) {
+        return this->entries[slot].key;
+    }
+
+    V& valAt( size_t slot ) {
+        return this->entries[slot].val;
+    }
+
+    // Removes every entry for which pred( key, val ) is true, and
+    // returns how many were removed. Walks each bucket's hop bitmap, so
+    // every entry is visited with its home and nothing is rehashed.
+    template <class Pred>
+    size_t erase_if( Pred pred ) {
+        size_t erased = 0;
+
+        for( size_t home = 0; home < this->numBuckets; ++home ) {
+            for( HopBits hop = this->hops[home]; hop; hop &= hop - 1 ) {
+                int j = lowestBit( hop );
+                Entry& slot = this->entries[home + j];
+
+                if( pred( slot.key, slot.val ) ) {
+                    this->hops[home] ^= HopBits( 1 ) << j;
+                    clearFull( home + j );
+                    ++erased;
+                }
+            }
+        }
+
+        this->numEntries -= erased;
+        return erased;
+    }
+
+    // histogram of the distances of the entries in the table from their
+    // home buckets, which are all below NEIGHBORHOOD
+    Histogram get_dib_stats() {
+        Histogram dibs;
+
+        for( size_t home = 0; home < this->numBuckets; ++home ) {
+            for( HopBits hop = this->hops[home]; hop; hop &= hop - 1 ) {
+                dibs.record( lowestBit( hop ) );
+            }
+        }
+
+        return dibs;
+    }
+
+    HopBits * hops = nullptr;
+    uint64_t * used = nullptr;
+    Entry * entries = nullptr;
+};
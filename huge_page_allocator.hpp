@@ -0,0 +1,142 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+
+// Allocator backing large arrays with 2 MB huge pages, for tables big
+// enough that TLB misses on random probes cost as much as cache misses.
+// Use it as the Allocator argument of any table, e.g.
+//     RHHash<int, int, HashFn<int>, Pow2Index, HugePageAllocator<char>> h( 1 << 28, 0.9 );
+
+// Key Concepts:
+// 1. Arrays of at least HUGE_PAGE_SIZE bytes are mapped with mmap,
+// rounded up to whole huge pages and aligned to one. By default the
+// kernel is asked to back them with transparent huge pages through
+// madvise. With Explicit set they are mapped from the reserved hugetlb
+// pool instead (see /proc/sys/vm/nr_hugepages), falling back to
+// transparent huge pages if the pool is empty.
+// 2. Anonymous mappings are zero filled, and pages are only allocated
+// when first touched, so tables whose empty entries are all zero bytes
+// skip initializing their arrays, and untouched parts of a huge table
+// cost no memory.
+// 3. Smaller arrays, and every array on systems without mmap, come from
+// calloc, which is also zero filled.
+template <typename T, bool Explicit = false>
+struct HugePageAllocator {
+    typedef T value_type;
+
+    static const size_t HUGE_PAGE_SIZE = size_t( 2 ) << 20;
+
+    // see AllocatorZeroFills
+    static const bool zero_filled = true;
+
+    template <typename U>
+    struct rebind {
+        typedef HugePageAllocator<U, Explicit> other;
+    };
+
+    HugePageAllocator() {}
+
+    template <typename U>
+    HugePageAllocator( const HugePageAllocator<U, Explicit>& ) {}
+
+    T * allocate( size_t n ) {
+        if( n > size_t( -1 ) / sizeof( T ) ) {
+            throw std::bad_alloc();
+        }
+
+        size_t bytes = n * sizeof( T );
+
+        void * mem = mappable( bytes ) ? map( roundUp( bytes ) ) :
+            std::calloc( n ? n : 1, sizeof( T ) );
+
+        if( !mem ) {
+            throw std::bad_alloc();
+        }
+
+        return static_cast<T *>( mem );
+    }
+
+    void deallocate( T * ptr, size_t n ) {
+        size_t bytes = n * sizeof( T );
+
+        if( mappable( bytes ) ) {
+#ifdef __linux__
+            munmap( ptr, roundUp( bytes ) );
+#endif
+        } else {
+            std::free( ptr );
+        }
+    }
+
+    static bool mappable( size_t bytes ) {
+#ifdef __linux__
+        return bytes >= HUGE_PAGE_SIZE;
+#else
+        (void) bytes;
+        return false;
+#endif
+    }
+
+    static size_t roundUp( size_t bytes ) {
+        return ( bytes + HUGE_PAGE_SIZE - 1 ) & ~( HUGE_PAGE_SIZE - 1 );
+    }
+
+    // maps bytes, a multiple of HUGE_PAGE_SIZE, at a huge page boundary
+    static void * map( size_t bytes ) {
+#ifdef __linux__
+#ifdef MAP_HUGETLB
+        if( Explicit ) {
+            void * mem = mmap( nullptr, bytes, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0 );
+            if( mem != MAP_FAILED ) return mem;
+        }
+#endif
+
+        // over-map by a huge page, then trim both ends so the mapping
+        // starts on a huge page boundary, which transparent huge pages need
+        size_t padded = bytes + HUGE_PAGE_SIZE;
+        void * raw = mmap( nullptr, padded, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+        if( raw == MAP_FAILED ) return nullptr;
+
+        uintptr_t start = uintptr_t( raw );
+        uintptr_t aligned = ( start + HUGE_PAGE_SIZE - 1 ) & ~uintptr_t( HUGE_PAGE_SIZE - 1 );
+
+        if( aligned > start ) {
+            munmap( raw, aligned - start );
+        }
+
+        uintptr_t end = start + padded;
+        if( end > aligned + bytes ) {
+            munmap( (void *)( aligned + bytes ), end - ( aligned + bytes ) );
+        }
+
+#ifdef MADV_HUGEPAGE
+        madvise( (void *) aligned, bytes, MADV_HUGEPAGE );
+#endif
+
+        return (void *) aligned;
+#else
+        (void) bytes;
+        return nullptr;
+#endif
+    }
+};
+
+template <typename T, typename U, bool Explicit>
+bool operator==( const HugePageAllocator<T, Explicit>&, const HugePageAllocator<U, Explicit>& ) {
+    return true;
+}
+
+template <typename T, typename U, bool Explicit>
+bool operator!=( const HugePageAllocator<T, Explicit>&, const HugePageAllocator<U, Explicit>& ) {
+    return false;
+}
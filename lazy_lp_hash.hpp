@@ -1,106 +1,159 @@
 #pragma once
 
 #include "hash.hpp"
-#include "perfcheck.hpp"
+#include "hash_stats.hpp"
+#include <utility> // for move
 
 
 // Template for hash using linear probing with tombstoning or
-// lazy deletion.
-template<typename K, typename V, class Hasher = HashFn<K>>
-struct LazyLPHash : public IHash<K, V, Hasher> {
-    PERF_INIT;
+// lazy deletion. In the SentinelKeys layout, see FlaggedSlots, the
+// layout's TOMBSTONE marks deleted entries, and must differ from EMPTY.
+template<typename K, typename V, class Hasher = HashFn<K>, class Index = ModIndex,
+         class Allocator = std::allocator<char>, class Layout = FlaggedSlots>
+struct LazyLPHash : public IHash<LazyLPHash<K, V, Hasher, Index, Allocator, Layout>, K, V, Hasher, Index, Allocator> {
+    HASH_STATS_INIT
 
-    struct HashEntry {
-        HashEntry() {}
-        HashEntry( K key, V val ) : key(key), val(val) {}
+    static_assert( Layout::TOMBSTONES,
+            "LazyLPHash: SentinelKeys needs a TOMBSTONE apart from EMPTY" );
+
+    typedef HashValueOf<Hasher, K> HashValue;
+    typedef Layout layout_type;
+
+    struct FlaggedEntry {
+        FlaggedEntry() {}
+        FlaggedEntry( K key, V val ) : key(key), val(val) {}
+
+        bool occupied() const {
+            return full;
+        }
+
+        bool deleted() const {
+            return removed;
+        }
 
         K key;
         V val;
-        bool occupied = false;
-        bool deleted = false;
-    }; 
-
-    LazyLPHash( int _numBuckets, float _loadThreshold ) {
-        this->numBuckets = _numBuckets;
+        bool full = false;
+        bool removed = false;
+    };
+
+    typedef typename std::conditional<Layout::SENTINEL,
+            SentinelEntry<K, V, Layout>, FlaggedEntry>::type HashEntry;
+
+    // an entry of all zero bytes is empty, so zero filled memory
+    // needs no initialization when keys and values are trivial
+    static const bool ZERO_IS_EMPTY = Layout::ZERO_IS_EMPTY &&
+        std::is_trivial<K>::value && std::is_trivial<V>::value;
+
+    LazyLPHash( size_t _numBuckets, float _loadThreshold,
+            const Allocator& _allocator = Allocator() ) {
+        this->allocator = _allocator;
+        this->setBuckets( _numBuckets );
         this->loadThreshold = _loadThreshold;
         this->numEntries = 0;
 
-        this->buckets = new HashEntry[this->numBuckets];
+        this->buckets = this->template allocateArray<HashEntry, ZERO_IS_EMPTY>( this->numBuckets );
     }
 
     LazyLPHash() : LazyLPHash(10, 0.7) {}
 
     ~LazyLPHash() {
-        delete [] buckets;
+        this->deallocateArray( buckets, this->numBuckets );
     }
 
-    void resize(int newBuckets ) {
-        HashEntry * old = buckets;
-        int oldBuckets = this->numBuckets;
-        this->numBuckets = newBuckets;
+    void resize( size_t newBuckets ) {
+        HASH_STATS_RESIZE
+
+        // the table is only changed once the new array exists
+        size_t capacity = this->capacityFor( newBuckets );
+        HashEntry * grown = this->template allocateArray<HashEntry, ZERO_IS_EMPTY>( capacity );
 
-        this->buckets = new HashEntry[this->numBuckets];
+        HashEntry * old = buckets;
+        size_t oldBuckets = this->numBuckets;
+        this->setBuckets( capacity );
+        this->buckets = grown;
 
         this->numEntries = 0;
 
         // discard deleted entries
-        for( int i = 0; i < oldBuckets; ++i ) {
-            if( !old[i].deleted && old[i].occupied ) {
-                put( old[i].key, old[i].val );
+        for( size_t i = 0; i < oldBuckets; ++i ) {
+            if( old[i].occupied() ) {
+                this->template insert<true>( std::move( old[i].key ), std::move( old[i].val ) );
             }
         }
 
-        delete [] old;
+        this->deallocateArray( old, oldBuckets );
     }
 
-    int lookup( K key ) {
-        int idx = this->hash( key );
+    template <typename Q>
+    size_t lookup( const Q& key, HashValue hash ) {
+        size_t idx = this->indexer.index( hash );
 
         // we either get an empty slot or the slot with our key
-        while( this->buckets[idx].deleted ||
-                ( this->buckets[idx].occupied &&
+        while( this->buckets[idx].deleted() ||
+                ( this->buckets[idx].occupied() &&
                   this->buckets[idx].key != key ) ) {
-            idx = ( idx + 1 ) % this->numBuckets;
+            idx = this->next( idx );
         }
 
+        HASH_STATS_SET( probe, this->probeLength( this->indexer.index( hash ), idx ) )
         return idx;
     }
 
-    void put( K key, V val ) {
+    template <bool Assign, typename KK, typename... Args>
+    std::pair<V *, bool> insertHashed( HashValue hash, KK&& key, Args&&... args ) {
+        Layout::checkKey( key );
+
         if( this->getLoadFactor() >= this->loadThreshold ) {
             resize( this->numBuckets * 2 );
         }
 
-        int idx = lookup( key );
+        size_t idx = lookup( key, hash );
+        HASH_STATS_OP( STAT_PUT )
 
-        // either the entry has the same key or is empty/deleted
-        this->buckets[idx].occupied = true;
-        this->buckets[idx].key = key;
-        this->buckets[idx].val = val;
+        if( this->buckets[idx].occupied() ) {
+            if( Assign ) {
+                this->buckets[idx].val = V( std::forward<Args>( args )... );
+            }
+            return std::make_pair( &this->buckets[idx].val, false );
+        }
 
-        if( this->buckets[idx].deleted ) { 
-            this->buckets[idx].deleted = false;
-        } else {
+        // either the entry has the same key or is empty/deleted
+        if( !this->buckets[idx].deleted() ) {
             ++this->numEntries;
         }
+
+        this->buckets[idx].key = K( std::forward<KK>( key ) );
+        this->buckets[idx].val = V( std::forward<Args>( args )... );
+
+        if constexpr( !Layout::SENTINEL ) {
+            this->buckets[idx].full = true;
+            this->buckets[idx].removed = false;
+        }
+
+        return std::make_pair( &this->buckets[idx].val, true );
     }
 
-    V get( K key ) {
-        int idx = lookup( key );
+    template <typename Q>
+    V * findHashed( const Q& key, HashValue hash ) {
+        size_t idx = lookup( key, hash );
 
-        if( this->buckets[idx].occupied ) {
-            return this->buckets[idx].val;
+        if( this->buckets[idx].occupied() ) {
+            HASH_STATS_OP( STAT_GET_HIT )
+            return &this->buckets[idx].val;
         }
 
-        throw std::runtime_error("Key doesn't exist.");
+        HASH_STATS_OP( STAT_GET_MISS )
+        return nullptr;
     }
 
-    void remove( K key ) {
-        int idx = lookup( key );
+    template <typename Q>
+    void removeHashed( const Q& key, HashValue hash ) {
+        size_t idx = lookup( key, hash );
+        HASH_STATS_OP( STAT_REMOVE )
 
-        if( this->buckets[idx].occupied ) {
-            this->buckets[idx].occupied = false;
-            this->buckets[idx].deleted = true;
+        if( this->buckets[idx].occupied() ) {
+            markDeleted( this->buckets[idx] );
 
             // numEntries is not decremented, as we want to count
             // deleted entries in the load factor
@@ -109,15 +162,75 @@ struct LazyLPHash : public IHash<K, V, Hasher> {
         // Key does not exist, nothing removed
     }
 
-    void get_dib_stats() {
-        for( int i = 0; i < this->numBuckets; ++i ) {
-            if( this->buckets[i].occupied ) {
-                PERF_ADD( this->probeLength( this->hash( this->buckets[i].key ), i ) );
+    void markDeleted( HashEntry& entry ) {
+        if constexpr( Layout::SENTINEL ) {
+            entry.key = Layout::TOMBSTONE;
+        } else {
+            entry.full = false;
+            entry.removed = true;
+        }
+    }
+
+    void prefetch( HashValue hash ) {
+        prefetchLine( &this->buckets[this->indexer.index( hash )] );
+    }
+
+    // Iteration, see SlotIterator.
+    typedef SlotIterator<LazyLPHash> iterator;
+
+    iterator begin() {
+        return iterator( this, nextFull( 0 ) );
+    }
+
+    iterator end() {
+        return iterator( this, this->numBuckets );
+    }
+
+    size_t nextFull( size_t slot ) {
+        while( slot < this->numBuckets && !this->buckets[slot].occupied() ) {
+            ++slot;
+        }
+        return slot;
+    }
+
+    const K& keyAt( size_t slot ) {
+        return this->buckets[slot].key;
+    }
+
+    V& valAt( size_t slot ) {
+        return this->buckets[slot].val;
+    }
+
+    // Removes every entry for which pred( key, val ) is true, and
+    // returns how many were removed. Removed entries become tombstones,
+    // as with removeHashed, so nothing moves.
+    template <class Pred>
+    size_t erase_if( Pred pred ) {
+        size_t erased = 0;
+
+        for( size_t i = 0; i < this->numBuckets; ++i ) {
+            HashEntry& entry = this->buckets[i];
+
+            if( entry.occupied() && pred( entry.key, entry.val ) ) {
+                markDeleted( entry );
+                ++erased;
+            }
+        }
+
+        return erased;
+    }
+
+    // histogram of the probe lengths of the entries in the table
+    Histogram get_dib_stats() {
+        Histogram dibs;
+
+        for( size_t i = 0; i < this->numBuckets; ++i ) {
+            if( this->buckets[i].occupied() ) {
+                dibs.record( this->probeLength( this->hash( this->buckets[i].key ), i ) );
             }
         }
 
-        PERF_LOG;
-        PERF_CLEAR;
+        return dibs;
     }
 
     HashEntry * buckets;
@@ -1,7 +1,11 @@
 #pragma once
 
 #include "hash.hpp"
-#include "perfcheck.hpp"
+#include "hash_stats.hpp"
+#include "snapshot.hpp"
+#include <algorithm> // for lower_bound, max, min
+#include <utility> // for move
+#include <vector>
 
 
 // Template for hash using linear probing without lazy deletion.
@@ -9,121 +13,301 @@
 // LazyLPHash, but removing may require shifting successive occupied
 // entries so they are not missed from terminating early from the 
 // removed entries.
-template<typename K, typename V, class Hasher = HashFn<K>>
-struct LPHash : public IHash<K, V, Hasher> {
-    PERF_INIT;
+// Each entry keeps the full hash of its key, so probes skip the key
+// compare unless the hashes match, and resizing doesn't rehash keys.
+// In the SentinelKeys layout, see FlaggedSlots, entries keep neither.
+// Inserts that probe too far rebuild the table, see ProbeGuard.
+template<typename K, typename V, class Hasher = HashFn<K>, class Index = ModIndex,
+         class Allocator = std::allocator<char>, class Layout = FlaggedSlots>
+struct LPHash : public IHash<LPHash<K, V, Hasher, Index, Allocator, Layout>, K, V, Hasher, Index, Allocator> {
+    HASH_STATS_INIT
+
+    typedef HashValueOf<Hasher, K> HashValue;
+    typedef Layout layout_type;
+
+    struct FlaggedEntry {
+        FlaggedEntry() {}
+        FlaggedEntry( K key, V val ) : key(key), val(val) {}
+
+        bool occupied() const {
+            return full;
+        }
 
-    struct HashEntry {
-        HashEntry() {}
-        HashEntry( K key, V val ) : key(key), val(val) {}
+        void clear() {
+            full = false;
+        }
 
         K key;
         V val;
-        unsigned int hash;
-        bool occupied = false;
-    }; 
-
-    LPHash( int _numBuckets, float _loadThreshold ) {
-        this->numBuckets = _numBuckets;
+        HashValue hash;
+        bool full = false;
+    };
+
+    typedef typename std::conditional<Layout::SENTINEL,
+            SentinelEntry<K, V, Layout>, FlaggedEntry>::type HashEntry;
+
+    // an entry of all zero bytes is empty, so zero filled memory
+    // needs no initialization when keys and values are trivial
+    static const bool ZERO_IS_EMPTY = Layout::ZERO_IS_EMPTY &&
+        std::is_trivial<K>::value && std::is_trivial<V>::value;
+
+    LPHash( size_t _numBuckets, float _loadThreshold,
+            const Allocator& _allocator = Allocator() ) {
+        this->allocator = _allocator;
+        this->setBuckets( _numBuckets );
         this->loadThreshold = _loadThreshold;
         this->numEntries = 0;
 
-        this->buckets = new HashEntry[this->numBuckets];
+        this->buckets = this->template allocateArray<HashEntry, ZERO_IS_EMPTY>( this->numBuckets );
     }
 
     LPHash() : LPHash(10, 0.7) {}
 
     ~LPHash() {
-        delete [] buckets;
+        freeBuckets( buckets, this->numBuckets );
+    }
+
+    // bucket arrays are either allocated, or the mapping of an opened
+    // snapshot
+    void freeBuckets( HashEntry * arr, size_t n ) {
+        if( snapshot.holds( arr ) ) {
+            snapshot.release();
+        } else {
+            this->deallocateArray( arr, n );
+        }
     }
 
-    void resize(int newBuckets ) {
+    // Snapshots, as in RHHash, see snapshot.hpp.
+    void saveSnapshot( const char * path ) {
+        SnapshotHeader header = snapshotLayout<LPHash, HashEntry>( SNAPSHOT_LP );
+        header.numBuckets = this->numBuckets;
+        header.numEntries = this->numEntries;
+        header.loadThreshold = this->loadThreshold;
+        header.hasherSeed = hasherSeed( this->hasher );
+
+        writeSnapshot( path, header, buckets );
+    }
+
+    void openSnapshot( const char * path, SnapshotMode mode, bool verify = false ) {
+        SnapshotMapping opened;
+        SnapshotHeader header = openSnapshotFor<LPHash, HashEntry>( *this, SNAPSHOT_LP,
+                path, mode, verify,
+                []( const HashEntry& entry ) { return entry.occupied(); }, opened );
+
+        freeBuckets( buckets, this->numBuckets );
+        snapshot.swap( opened );
+
+        this->setBuckets( size_t( header.numBuckets ) );
+        this->numEntries = size_t( header.numEntries );
+        this->loadThreshold = header.loadThreshold;
+        setHasherSeed( this->hasher, header.hasherSeed );
+        buckets = static_cast<HashEntry *>( snapshot.data() );
+    }
+
+    void checkWritable() {
+        if( snapshot.readOnly ) {
+            throw std::runtime_error("LPHash: table is a read only snapshot.");
+        }
+    }
+
+    void resize( size_t newBuckets ) {
+        rebuild( newBuckets, false );
+    }
+
+    // moves every entry into a new array of newBuckets entries, and
+    // recomputes their hashes if rehash is set, as after a reseed
+    void rebuild( size_t newBuckets, bool rehash ) {
+        HASH_STATS_RESIZE
+
+        // the table is only changed once the new array exists
+        size_t capacity = this->capacityFor( newBuckets );
+        HashEntry * grown = this->template allocateArray<HashEntry, ZERO_IS_EMPTY>( capacity );
+
         HashEntry * old = buckets;
-        int oldBuckets = this->numBuckets;
-        this->numBuckets = newBuckets;
+        size_t oldBuckets = this->numBuckets;
+        this->setBuckets( capacity );
+        this->buckets = grown;
 
-        this->buckets = new HashEntry[this->numBuckets];
+        // entries are unique, so they only need an empty entry, and
+        // numEntries doesn't change
+        for( size_t i = 0; i < oldBuckets; ++i ) {
+            if( old[i].occupied() ) {
+                if( rehash ) {
+                    markFull( old[i], this->hasher.hash( old[i].key ) );
+                }
 
-        this->numEntries = 0;
+                size_t idx = this->indexer.index( hashOf( old[i] ) );
 
-        for( int i = 0; i < oldBuckets; ++i ) {
-            if( old[i].occupied ) {
-                put( old[i].key, old[i].val );
+                while( this->buckets[idx].occupied() ) {
+                    idx = this->next( idx );
+                }
+
+                this->buckets[idx] = std::move( old[i] );
             }
         }
 
-        delete [] old;
+        freeBuckets( old, oldBuckets );
     }
 
-    int lookup( K key, int& hash ) {
-        int idx = this->hash( key );
+    // Slot state. Entries in the SentinelKeys layout are full once
+    // their key is set, and their hash is recomputed when needed.
+    HashValue hashOf( const HashEntry& entry ) {
+        if constexpr( Layout::SENTINEL ) {
+            return this->hasher.hash( entry.key );
+        } else {
+            return entry.hash;
+        }
+    }
 
-        // save this for checking hash during deletions
-        hash = idx;
+    // whether entry may hold a key of hash hash
+    bool hashMatches( const HashEntry& entry, HashValue hash ) {
+        if constexpr( Layout::SENTINEL ) {
+            return true;
+        } else {
+            return entry.hash == hash;
+        }
+    }
 
-        while( this->buckets[idx].occupied &&
-                this->buckets[idx].key != key ) {
-            idx = ( idx + 1 ) % this->numBuckets;
+    void markFull( HashEntry& entry, HashValue hash ) {
+        if constexpr( !Layout::SENTINEL ) {
+            entry.full = true;
+            entry.hash = hash;
         }
+    }
+
+    // returns the entry holding key, or the empty entry where it
+    // would go
+    template <typename Q>
+    size_t lookup( const Q& key, HashValue hash ) {
+        size_t idx = this->indexer.index( hash );
 
+        while( this->buckets[idx].occupied() &&
+                ( !hashMatches( this->buckets[idx], hash ) || this->buckets[idx].key != key ) ) {
+            idx = this->next( idx );
+        }
+
+        HASH_STATS_SET( probe, this->probeLength( this->indexer.index( hash ), idx ) )
         return idx;
     }
 
-    int lookup( K key ) {
-        int temp;
-        return lookup( key, temp );
+    template <typename Q>
+    size_t lookup( const Q& key ) {
+        return lookup( key, this->hasher.hash( key ) );
     }
 
-    void put( K key, V val ) {
+    template <bool Assign, typename KK, typename... Args>
+    std::pair<V *, bool> insertHashed( HashValue hash, KK&& key, Args&&... args ) {
+        checkWritable();
+        Layout::checkKey( key );
+
         if( this->getLoadFactor() >= this->loadThreshold ) {
+            guard.grown();
             resize( this->numBuckets * 2 );
         }
 
-        int hash;
-        int idx = lookup( key, hash );
+        size_t idx = lookup( key, hash );
+        HASH_STATS_OP( STAT_PUT )
 
         // either the entry has the same key or is empty
-        this->buckets[idx].occupied = true;
-        this->buckets[idx].key = key;
-        this->buckets[idx].val = val;
-        this->buckets[idx].hash = hash;
+        if( this->buckets[idx].occupied() ) {
+            if( Assign ) {
+                this->buckets[idx].val = V( std::forward<Args>( args )... );
+            }
+            return std::make_pair( &this->buckets[idx].val, false );
+        }
+
+        this->buckets[idx].key = K( std::forward<KK>( key ) );
+        this->buckets[idx].val = V( std::forward<Args>( args )... );
+        markFull( this->buckets[idx], hash );
 
         ++this->numEntries;
+
+        size_t probe = this->probeLength( this->indexer.index( hash ), idx );
+        if( probe > guard.longest && guard.exceeded( probe, probeLimit() ) ) {
+            idx = rebuildAfter( idx );
+        }
+
+        return std::make_pair( &this->buckets[idx].val, true );
     }
 
-    V get( K key ) {
-        int idx = lookup( key );
+    // Longest probe an insert may take before the table rebuilds, see
+    // ProbeGuard. The longest probes of linear probing grow with
+    // 1 / ( 1 - load )^2, so the limit does too, at the current load
+    // rather than the threshold: keys piling into one cluster of a
+    // table far from full are caught before the cluster is as long as
+    // random keys could make it at the threshold. The scale is capped
+    // at MAX_PROBE_SCALE, above the longest probes of random keys at
+    // load 0.98, so tables with thresholds close to 1 still react.
+    static const int MAX_PROBE_SCALE = 512;
+
+    size_t probeLimit() {
+        float load = std::min( this->getLoadFactor(), this->loadThreshold );
+        float free = std::max( 1 - load, 0.01f );
+        float scale = std::min( 1 / ( free * free ), float( MAX_PROBE_SCALE ) );
+        return size_t( guard.factor * ProbeGuard::log2Ceil( this->numBuckets ) * scale );
+    }
 
-        if( this->buckets[idx].occupied ) {
-            return this->buckets[idx].val;
+    // rebuilds the table under a fresh seed, or at twice the capacity,
+    // and returns the new index of the key just inserted at idx
+    size_t rebuildAfter( size_t idx ) {
+        K key( this->buckets[idx].key );
+        uint64_t seed = hasherSeed( this->hasher );
+        ProbeGuard before = guard;
+        bool reseeded = guard.reseed( this->hasher );
+
+        try {
+            rebuild( reseeded ? this->numBuckets : this->numBuckets * 2, reseeded );
+        } catch( ... ) {
+            // the entries are still placed under the old seed
+            setHasherSeed( this->hasher, seed );
+            guard = before;
+            throw;
         }
 
-        throw std::runtime_error("Key doesn't exist.");
+        return lookup( key );
     }
 
-    void remove( K key ) {
+    template <typename Q>
+    V * findHashed( const Q& key, HashValue hash ) {
+        size_t idx = lookup( key, hash );
+
+        if( this->buckets[idx].occupied() ) {
+            HASH_STATS_OP( STAT_GET_HIT )
+            return &this->buckets[idx].val;
+        }
+
+        HASH_STATS_OP( STAT_GET_MISS )
+        return nullptr;
+    }
+
+    template <typename Q>
+    void removeHashed( const Q& key, HashValue hash ) {
+        checkWritable();
+
         // i is the empty entry
-        int i = lookup( key );
+        size_t i = lookup( key, hash );
+        HASH_STATS_OP( STAT_REMOVE )
 
         // Key does not exist, nothing removed
-        if( !this->buckets[i].occupied ) {
+        if( !this->buckets[i].occupied() ) {
             return;
         }
 
         // Key exists, mark it empty
-        this->buckets[i].occupied = false;
+        this->buckets[i].clear();
+        HASH_STATS_SET( moves, 0 )
 
-        int j = i;
+        size_t j = i;
 
         for(;;) {
             // j is the next entry which may or may not replace i
-            j = ( j + 1 ) % this->numBuckets;
+            j = this->next( j );
 
             // the next entry was empty, terminate
-            if( !this->buckets[j].occupied ) break;
+            if( !this->buckets[j].occupied() ) break;
 
             // k is where j should be if there was space at time of insertion
-            int k = this->buckets[j].hash;
+            size_t k = this->indexer.index( hashOf( this->buckets[j] ) );
 
             /*
                Logic is as follows. Originally, an entry was meant to be placed
@@ -145,27 +329,151 @@ struct LPHash : public IHash<K, V, Hasher> {
 
             if( ( c1 && c2 ) ||  (j < k && ( c1 || c2 ) ) ) {
                 // move entry j into the empty entry i
-                this->buckets[i] = this->buckets[j];
+                this->buckets[i] = std::move( this->buckets[j] );
 
                 // entry j is now empty, and we iterate on j
                 i = j;
-                this->buckets[i].occupied = false;
+                this->buckets[i].clear();
+                HASH_STATS_INC( moves )
             }
         }
 
+        HASH_STATS_RECORD( shifts, this->stats.moves )
         --this->numEntries;
     }
 
-    void get_dib_stats() {
-        for( int i = 0; i < this->numBuckets; ++i ) {
-            if( this->buckets[i].occupied ) {
-                PERF_ADD( this->probeLength( this->hash( this->buckets[i].key ), i ) );
+    void prefetch( HashValue hash ) {
+        prefetchLine( &this->buckets[this->indexer.index( hash )] );
+    }
+
+    // Iteration, see SlotIterator.
+    typedef SlotIterator<LPHash> iterator;
+
+    iterator begin() {
+        return iterator( this, nextFull( 0 ) );
+    }
+
+    iterator end() {
+        return iterator( this, this->numBuckets );
+    }
+
+    size_t nextFull( size_t slot ) {
+        while( slot < this->numBuckets && !this->buckets[slot].occupied() ) {
+            ++slot;
+        }
+        return slot;
+    }
+
+    const K& keyAt( size_t slot ) {
+        return this->buckets[slot].key;
+    }
+
+    V& valAt( size_t slot ) {
+        return this->buckets[slot].val;
+    }
+
+    // Removes every entry for which pred( key, val ) is true, and
+    // returns how many were removed, in one sweep over the buckets
+    // starting after an empty one. The sweep keeps the holes of the
+    // current cluster in order, and moves each kept entry into the
+    // first hole at or after its home bucket, which is the same rule
+    // removeHashed applies to a single hole. Unlike Robin Hood order,
+    // a later entry may have an earlier home, so holes passed over stay
+    // available until the cluster ends.
+    template <class Pred>
+    size_t erase_if( Pred pred ) {
+        checkWritable();
+
+        size_t n = this->numBuckets;
+        size_t start = 0;
+
+        while( start < n && this->buckets[start].occupied() ) {
+            ++start;
+        }
+
+        if( start == n ) {
+            return eraseEach( pred );
+        }
+
+        size_t erased = 0;
+
+        // holes of the current cluster, as offsets from start
+        std::vector<size_t> holes;
+
+        for( size_t k = 1, i = this->next( start ); k < n; ++k, i = this->next( i ) ) {
+            HashEntry& entry = this->buckets[i];
+
+            if( !entry.occupied() ) {
+                holes.clear();
+                continue;
+            }
+
+            if( pred( entry.key, entry.val ) ) {
+                entry.clear();
+                holes.push_back( k );
+                ++erased;
+                continue;
             }
+
+            if( holes.empty() ) continue;
+
+            // no cluster spans start, so home lies between start and i
+            size_t home = this->probeLength( start, this->indexer.index( hashOf( entry ) ) );
+
+            auto hole = std::lower_bound( holes.begin(), holes.end(), home );
+            if( hole == holes.end() ) continue;
+
+            size_t target = start + *hole >= n ? start + *hole - n : start + *hole;
+
+            this->buckets[target] = std::move( entry );
+            entry.clear();
+
+            holes.erase( hole );
+            holes.push_back( k );
+        }
+
+        this->numEntries -= erased;
+        return erased;
+    }
+
+    // removes matching entries one by one, as each removal may shift
+    // the others
+    template <class Pred>
+    size_t eraseEach( Pred pred ) {
+        std::vector<HashEntry> matches;
+
+        for( size_t i = 0; i < this->numBuckets; ++i ) {
+            HashEntry& entry = this->buckets[i];
+
+            if( entry.occupied() && pred( entry.key, entry.val ) ) {
+                matches.push_back( entry );
+            }
+        }
+
+        for( HashEntry& entry : matches ) {
+            removeHashed( entry.key, hashOf( entry ) );
         }
 
-        PERF_LOG;
-        PERF_CLEAR;
+        return matches.size();
+    }
+
+    // histogram of the probe lengths of the entries in the table
+    Histogram get_dib_stats() {
+        Histogram dibs;
+
+        for( size_t i = 0; i < this->numBuckets; ++i ) {
+            if( this->buckets[i].occupied() ) {
+                dibs.record( this->probeLength( this->indexer.index( hashOf( this->buckets[i] ) ), i ) );
+            }
+        }
+
+        return dibs;
     }
 
     HashEntry * buckets;
+    SnapshotMapping snapshot;
+
+    // factor 2 keeps the limit several times above the longest probes
+    // of random keys at any load threshold
+    ProbeGuard guard = ProbeGuard( 2 );
 };
@@ -0,0 +1,502 @@
+#pragma once
+
+#include "hash.hpp"
+#include "hash_stats.hpp"
+#include <cstdint>
+#include <stdexcept>
+#include <type_traits>
+#include <algorithm> // for min
+#include <utility> // for swap, move
+#include <vector>
+
+
+// Template for hash using Robin Hood hashing with backwards shifting,
+// like RHHash, but with a structure-of-arrays layout.
+
+// Key Concepts:
+// 1. Each slot's metadata is a single byte in its own dense array,
+// holding 0 for an empty slot or the probe length plus one. Keys and
+// values live in two separate arrays.
+// 2. The probe loop only scans the metadata array, and a key is only
+// compared when its stored probe length equals the current one, which
+// is exactly when the two keys have the same desired index. A 64 byte
+// cache line of metadata covers 64 slots.
+// 3. Since the probe length must fit in a byte, the table grows if an
+// insert would need a probe longer than MAX_DIST. More than MAX_DIST
+// keys with the same hash can't be placed at any size, so an insert
+// that still doesn't fit after MAX_GROWS growths throws, leaving the
+// table as it was.
+template<typename K, typename V, class Hasher = HashFn<K>, class Index = ModIndex,
+         class Allocator = std::allocator<char>>
+struct RHSoAHash : public IHash<RHSoAHash<K, V, Hasher, Index, Allocator>, K, V, Hasher, Index, Allocator> {
+    HASH_STATS_INIT
+
+    typedef HashValueOf<Hasher, K> HashValue;
+
+    static const int MAX_DIST = 254;
+    static const int MAX_GROWS = 2;
+
+    // keys and values of empty slots are never read, so zero filled
+    // memory needs no initialization when they are trivial
+    static const bool ZERO_KEYS = std::is_trivial<K>::value;
+    static const bool ZERO_VALS = std::is_trivial<V>::value;
+
+    // whether rebuild() can move entries into a fresh table without
+    // risking an exception halfway through
+    static const bool NOTHROW_MOVE =
+        std::is_nothrow_move_constructible<K>::value &&
+        std::is_nothrow_move_constructible<V>::value &&
+        std::is_nothrow_move_assignable<K>::value &&
+        std::is_nothrow_move_assignable<V>::value;
+
+    RHSoAHash( size_t _numBuckets, float _loadThreshold,
+            const Allocator& _allocator = Allocator() ) {
+        this->allocator = _allocator;
+        this->setBuckets( _numBuckets );
+        this->loadThreshold = _loadThreshold;
+        this->numEntries = 0;
+
+        allocate();
+    }
+
+    RHSoAHash() : RHSoAHash(10, 0.7) {}
+
+    ~RHSoAHash() {
+        this->deallocateArray( meta, this->numBuckets );
+        this->deallocateArray( keys, this->numBuckets );
+        this->deallocateArray( vals, this->numBuckets );
+    }
+
+    // frees the arrays it got if a later one can't be allocated, as the
+    // destructor of a table whose constructor throws never runs
+    void allocate() {
+        this->meta = this->template allocateArray<uint8_t, true>( this->numBuckets );
+
+        try {
+            this->keys = this->template allocateArray<K, ZERO_KEYS>( this->numBuckets );
+        } catch( ... ) {
+            this->deallocateArray( meta, this->numBuckets );
+            throw;
+        }
+
+        try {
+            this->vals = this->template allocateArray<V, ZERO_VALS>( this->numBuckets );
+        } catch( ... ) {
+            this->deallocateArray( meta, this->numBuckets );
+            this->deallocateArray( keys, this->numBuckets );
+            throw;
+        }
+    }
+
+    // Grows or shrinks the table to newBuckets, doubling that until
+    // every entry fits in MAX_DIST, at most MAX_GROWS times. The table
+    // is left as it was if a size never fits or anything throws.
+    void resize( size_t newBuckets ) {
+        resizeWithin( newBuckets, MAX_GROWS );
+    }
+
+    // resize, doubling newBuckets at most maxGrows times, and returns
+    // how many times it did
+    int resizeWithin( size_t newBuckets, int maxGrows ) {
+        HASH_STATS_RESIZE
+
+        int grows = 0;
+
+        for( ; !rebuild( newBuckets ); ++grows ) {
+            if( grows == maxGrows ) {
+                throw std::runtime_error("Too many keys share a hash to fit in MAX_DIST, use a stronger Hasher.");
+            }
+
+            newBuckets *= 2;
+        }
+
+        return grows;
+    }
+
+    // Rebuilds the table at newBuckets in a fresh one, and swaps the
+    // fresh arrays in once it holds every entry, as in
+    // HopscotchHash::rebuild. Entries are moved over, or copied if
+    // moving them could throw, so this table is left whole. If some
+    // entry would land past MAX_DIST, this returns false, after moving
+    // back any entries it moved, which origins maps from their new
+    // slots to their old ones.
+    bool rebuild( size_t newBuckets ) {
+        RHSoAHash fresh( newBuckets, this->loadThreshold, this->allocator );
+        fresh.hasher = this->hasher;
+
+        std::vector<size_t> origins( NOTHROW_MOVE ? fresh.numBuckets : 0 );
+
+        for( size_t i = nextFull( 0 ); i < this->numBuckets; i = nextFull( i + 1 ) ) {
+            if constexpr( NOTHROW_MOVE ) {
+                K key( std::move( this->keys[i] ) );
+                V val( std::move( this->vals[i] ) );
+                size_t origin = i;
+
+                if( !fresh.place( key, val, origin, origins.data() ) ) {
+                    this->keys[origin] = std::move( key );
+                    this->vals[origin] = std::move( val );
+
+                    for( size_t j = fresh.nextFull( 0 ); j < fresh.numBuckets; j = fresh.nextFull( j + 1 ) ) {
+                        this->keys[origins[j]] = std::move( fresh.keys[j] );
+                        this->vals[origins[j]] = std::move( fresh.vals[j] );
+                    }
+                    return false;
+                }
+            } else {
+                K key( this->keys[i] );
+                V val( this->vals[i] );
+                size_t origin = i;
+
+                if( !fresh.place( key, val, origin, nullptr ) ) {
+                    return false;
+                }
+            }
+        }
+
+        // fresh frees the old arrays
+        std::swap( this->meta, fresh.meta );
+        std::swap( this->keys, fresh.keys );
+        std::swap( this->vals, fresh.vals );
+        std::swap( this->numBuckets, fresh.numBuckets );
+        std::swap( this->indexer, fresh.indexer );
+
+        return true;
+    }
+
+    // Places an entry whose key isn't in the table, displacing richer
+    // entries as an insert does. If origins is given, its elements move
+    // along with the entries, and origin is the carried entry's. Returns
+    // false if the entry carried would land past MAX_DIST, leaving it in
+    // key, val and origin, and the entries placed so far in the table.
+    bool place( K& key, V& val, size_t& origin, size_t * origins ) {
+        size_t idx = this->indexer.index( this->hasher.hash( key ) );
+
+        for( int dist = 1; ; idx = this->next( idx ), ++dist ) {
+            if( dist > MAX_DIST + 1 ) {
+                return false;
+            }
+
+            if( !this->meta[idx] ) {
+                this->meta[idx] = uint8_t( dist );
+                this->keys[idx] = std::move( key );
+                this->vals[idx] = std::move( val );
+                if( origins ) {
+                    origins[idx] = origin;
+                }
+                return true;
+            }
+
+            if( this->meta[idx] < dist ) {
+                uint8_t existing = this->meta[idx];
+                this->meta[idx] = uint8_t( dist );
+                dist = existing;
+
+                std::swap( key, this->keys[idx] );
+                std::swap( val, this->vals[idx] );
+                if( origins ) {
+                    std::swap( origin, origins[idx] );
+                }
+            }
+        }
+    }
+
+    // whether an entry placed at idx with meta dist leaves every entry
+    // it displaces within MAX_DIST, read off the metadata alone
+    bool fits( size_t idx, int dist ) {
+        for( ; dist <= MAX_DIST + 1; idx = this->next( idx ), ++dist ) {
+            if( !this->meta[idx] ) {
+                return true;
+            }
+
+            if( this->meta[idx] < dist ) {
+                dist = this->meta[idx];
+            }
+        }
+
+        return false;
+    }
+
+    template <bool Assign, typename KK, typename... Args>
+    std::pair<V *, bool> insertHashed( HashValue hash, KK&& _key, Args&&... args ) {
+        return insertGrowing<Assign>( 0, hash,
+                std::forward<KK>( _key ), std::forward<Args>( args )... );
+    }
+
+    // insertHashed, having already grown the table grows times for
+    // this insert
+    template <bool Assign, typename KK, typename... Args>
+    std::pair<V *, bool> insertGrowing( int grows, HashValue hash, KK&& _key, Args&&... args ) {
+        if( this->getLoadFactor() >= this->loadThreshold ) {
+            this->resize( this->numBuckets * 2 );
+        }
+
+        size_t idx = this->indexer.index( hash );
+
+        // dist is the current probe length plus one, matching meta
+        int dist = 1;
+
+        // an existing entry for key can only sit where the stored
+        // probe length is at least ours
+        while( this->meta[idx] >= dist ) {
+            if( this->meta[idx] == dist && this->keys[idx] == _key ) {
+                HASH_STATS_SET( probe, dist - 1 )
+                HASH_STATS_OP( STAT_PUT )
+                if( Assign ) {
+                    this->vals[idx] = V( std::forward<Args>( args )... );
+                }
+                return std::make_pair( &this->vals[idx], false );
+            }
+
+            idx = this->next( idx );
+            ++dist;
+        }
+
+        // the whole displacement chain is checked before anything moves,
+        // so a growth that throws leaves every entry in place
+        if( !fits( idx, dist ) ) {
+            return insertGrowing<Assign>( grow( grows ), hash,
+                    std::forward<KK>( _key ), std::forward<Args>( args )... );
+        }
+
+        HASH_STATS_SET( probe, dist - 1 )
+        HASH_STATS_OP( STAT_PUT )
+        HASH_STATS_SET( moves, 0 )
+
+        K key( std::forward<KK>( _key ) );
+        V val( std::forward<Args>( args )... );
+
+        // the new entry lands here, and any entry already here is
+        // displaced further along
+        size_t placed = idx;
+
+        for(;;) {
+            if( !this->meta[idx] ) {
+                this->meta[idx] = uint8_t( dist );
+                this->keys[idx] = std::move( key );
+                this->vals[idx] = std::move( val );
+                HASH_STATS_RECORD( swaps, this->stats.moves )
+                break;
+            }
+
+            // steal from the rich, give to the poor
+            if( this->meta[idx] < dist ) {
+                uint8_t existing = this->meta[idx];
+                this->meta[idx] = uint8_t( dist );
+                dist = existing;
+                HASH_STATS_INC( moves )
+
+                std::swap( key, this->keys[idx] );
+                std::swap( val, this->vals[idx] );
+            }
+
+            idx = this->next( idx );
+            ++dist;
+        }
+
+        ++this->numEntries;
+
+        return std::make_pair( &this->vals[placed], true );
+    }
+
+    // doubles the table for an insert that has already grown it grows
+    // times, or throws if that's MAX_GROWS, and returns the growths
+    // counted so far, including those the resize makes until the old
+    // entries fit
+    int grow( int grows ) {
+        if( grows == MAX_GROWS ) {
+            throw std::runtime_error("Too many keys share a hash to fit in MAX_DIST, use a stronger Hasher.");
+        }
+
+        return grows + 1 + resizeWithin( this->numBuckets * 2, MAX_GROWS - grows - 1 );
+    }
+
+    // returns the index of key, or NOT_FOUND if it doesn't exist. An empty
+    // slot has meta 0, so it also satisfies the termination condition.
+    template <typename Q>
+    size_t lookup( const Q& key, HashValue hash ) {
+        size_t idx = this->indexer.index( hash );
+        int dist = 1;
+
+        while( this->meta[idx] >= dist ) {
+            if( this->meta[idx] == dist && this->keys[idx] == key ) {
+                HASH_STATS_SET( probe, dist - 1 )
+                return idx;
+            }
+
+            idx = this->next( idx );
+            ++dist;
+        }
+
+        HASH_STATS_SET( probe, dist - 1 )
+        return NOT_FOUND;
+    }
+
+    template <typename Q>
+    size_t lookup( const Q& key ) {
+        return lookup( key, this->hasher.hash( key ) );
+    }
+
+    template <typename Q>
+    V * findHashed( const Q& key, HashValue hash ) {
+        size_t idx = lookup( key, hash );
+
+        if( idx != NOT_FOUND ) {
+            HASH_STATS_OP( STAT_GET_HIT )
+            return &this->vals[idx];
+        }
+
+        HASH_STATS_OP( STAT_GET_MISS )
+        return nullptr;
+    }
+
+    template <typename Q>
+    void removeHashed( const Q& key, HashValue hash ) {
+        size_t i = lookup( key, hash );
+        HASH_STATS_OP( STAT_REMOVE )
+
+        // Key does not exist, nothing removed.
+        if( i == NOT_FOUND ) return;
+
+        size_t j = this->next( i );
+        HASH_STATS_SET( moves, 0 )
+
+        // shift entries back until an empty entry or one with probe
+        // length 0 (meta 1) is found
+        while( this->meta[j] > 1 ) {
+            this->meta[i] = this->meta[j] - 1;
+            this->keys[i] = std::move( this->keys[j] );
+            this->vals[i] = std::move( this->vals[j] );
+
+            i = j;
+            j = this->next( j );
+            HASH_STATS_INC( moves )
+        }
+
+        HASH_STATS_RECORD( shifts, this->stats.moves )
+        this->meta[i] = 0;
+        --this->numEntries;
+    }
+
+    void prefetch( HashValue hash ) {
+        size_t idx = this->indexer.index( hash );
+
+        prefetchLine( &this->meta[idx] );
+        prefetchLine( &this->keys[idx] );
+    }
+
+    // Iteration, see SlotIterator. Finding the next entry only reads
+    // the metadata array.
+    typedef SlotIterator<RHSoAHash> iterator;
+
+    iterator begin() {
+        return iterator( this, nextFull( 0 ) );
+    }
+
+    iterator end() {
+        return iterator( this, this->numBuckets );
+    }
+
+    size_t nextFull( size_t slot ) {
+        while( slot < this->numBuckets && !this->meta[slot] ) {
+            ++slot;
+        }
+        return slot;
+    }
+
+    const K& keyAt( size_t slot ) {
+        return this->keys[slot];
+    }
+
+    V& valAt( size_t slot ) {
+        return this->vals[slot];
+    }
+
+    // Removes every entry for which pred( key, val ) is true, and
+    // returns how many were removed, in one sweep that moves each kept
+    // entry back over the holes before it, as in RHHash::erase_if.
+    template <class Pred>
+    size_t erase_if( Pred pred ) {
+        size_t n = this->numBuckets;
+        size_t start = 0;
+
+        while( start < n && this->meta[start] > 1 ) {
+            ++start;
+        }
+
+        if( start == n ) {
+            return eraseEach( pred );
+        }
+
+        size_t erased = 0;
+        int numHoles = 0;
+
+        for( size_t k = 0, i = start; k < n; ++k, i = this->next( i ) ) {
+            if( !this->meta[i] ) {
+                numHoles = 0;
+                continue;
+            }
+
+            if( pred( this->keys[i], this->vals[i] ) ) {
+                this->meta[i] = 0;
+                ++numHoles;
+                ++erased;
+                continue;
+            }
+
+            int shift = std::min( numHoles, this->meta[i] - 1 );
+
+            if( shift == 0 ) {
+                numHoles = 0;
+                continue;
+            }
+
+            size_t target = i >= size_t( shift ) ? i - shift : i + n - shift;
+
+            this->meta[target] = uint8_t( this->meta[i] - shift );
+            this->keys[target] = std::move( this->keys[i] );
+            this->vals[target] = std::move( this->vals[i] );
+            this->meta[i] = 0;
+
+            numHoles = shift;
+        }
+
+        this->numEntries -= erased;
+        return erased;
+    }
+
+    // removes matching entries one by one, as each removal may shift
+    // the others
+    template <class Pred>
+    size_t eraseEach( Pred pred ) {
+        std::vector<K> matches;
+
+        for( size_t i = 0; i < this->numBuckets; ++i ) {
+            if( this->meta[i] && pred( this->keys[i], this->vals[i] ) ) {
+                matches.push_back( this->keys[i] );
+            }
+        }
+
+        for( K& key : matches ) {
+            this->remove( key );
+        }
+
+        return matches.size();
+    }
+
+    // histogram of the probe lengths of the entries in the table
+    Histogram get_dib_stats() {
+        Histogram dibs;
+
+        for( size_t i = 0; i < this->numBuckets; ++i ) {
+            if( this->meta[i] ) {
+                dibs.record( this->meta[i] - 1 );
+            }
+        }
+
+        return dibs;
+    }
+
+    uint8_t * meta;
+    K * keys;
+    V * vals;
+};
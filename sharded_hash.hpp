@@ -0,0 +1,288 @@
+#pragma once
+
+#include "hash.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+
+// Template for a thread-safe hash that partitions keys across N
+// independent single-threaded tables, e.g.
+//     ShardedHash<RHHash<int, int>, 16> h( 1 << 20, 0.9 );
+
+// Key Concepts:
+// 1. A key's shard is picked from the high bits of its hash passed
+// through the splitmix64 finalizer, which depend on all of the hash
+// bits and match no index policy's mapping, so the keys of a shard
+// still spread over all of its buckets. Multiplying by 2^32 / phi
+// instead would pick the same bits FibonacciIndex does, and crowd each
+// shard's keys into 1/N of its array. N should be a power of two, but
+// doesn't have to be.
+// 2. Each shard has its own lock, padded to a cache line so that
+// threads working on different shards don't contend on it, and resizes
+// on its own, so a resize only stalls 1/N of the keys.
+// 3. Batched operations group their keys by shard first, and take each
+// shard's lock once per batch rather than once per key.
+
+// Engine is any table implementing IHash. Engines may change their
+// buckets on any call, even lookups, so every operation takes the
+// shard's lock exclusively, and lookups return copies rather than
+// pointers into the engine.
+template <class Engine, int N>
+struct ShardedHash {
+    static_assert( N > 0, "ShardedHash: needs at least one shard" );
+
+    typedef typename Engine::key_type K;
+    typedef typename Engine::mapped_type V;
+    typedef typename Engine::hasher_type Hasher;
+
+    struct alignas(64) Shard {
+        Shard( size_t numBuckets, float loadThreshold )
+            : table( numBuckets, loadThreshold ) {}
+
+        std::mutex lock;
+        Engine table;
+    };
+
+    ShardedHash( size_t _numBuckets, float _loadThreshold ) {
+        size_t perShard = ( _numBuckets + N - 1 ) / N;
+
+        this->shards.reserve( N );
+        for( int i = 0; i < N; ++i ) {
+            this->shards.emplace_back( new Shard( perShard, _loadThreshold ) );
+        }
+    }
+
+    ShardedHash() : ShardedHash(10 * N, 0.7) {}
+
+    // a copy would have to copy every shard under its lock
+    ShardedHash( const ShardedHash& ) = delete;
+    ShardedHash& operator=( const ShardedHash& ) = delete;
+
+    // the top 32 bits of the mixed hash are mapped onto [0, N) as in
+    // FastRangeIndex, which takes their top log2(N) bits when N is a
+    // power of two
+    template <typename Q>
+    int shardOf( const Q& key ) {
+        if( N == 1 ) return 0;
+
+        uint64_t mixed = mix64( uint64_t( this->hasher.hash( key ) ) );
+        return int( ( ( mixed >> 32 ) * N ) >> 32 );
+    }
+
+    void put( const K& key, const V& val ) {
+        Shard& s = *this->shards[shardOf( key )];
+        std::lock_guard<std::mutex> guard( s.lock );
+        s.table.put( key, val );
+    }
+
+    // copies the value for key into val, and returns whether it exists
+    template <typename Q>
+    bool find( const Q& key, V& val ) {
+        Shard& s = *this->shards[shardOf( key )];
+        std::lock_guard<std::mutex> guard( s.lock );
+
+        V * ptr = s.table.find( key );
+        if( ptr ) val = *ptr;
+        return ptr != nullptr;
+    }
+
+    // throws if key doesn't exist. Prefer find, contains or get_or
+    // when misses are expected, as they don't throw.
+    template <typename Q>
+    V get( const Q& key ) {
+        V val;
+
+        if( !find( key, val ) ) {
+            throw std::runtime_error("Key doesn't exist.");
+        }
+
+        return val;
+    }
+
+    template <typename Q>
+    bool contains( const Q& key ) {
+        Shard& s = *this->shards[shardOf( key )];
+        std::lock_guard<std::mutex> guard( s.lock );
+        return s.table.contains( key );
+    }
+
+    // returns def if key doesn't exist
+    template <typename Q>
+    V get_or( const Q& key, const V& def ) {
+        Shard& s = *this->shards[shardOf( key )];
+        std::lock_guard<std::mutex> guard( s.lock );
+        return s.table.get_or( key, def );
+    }
+
+    template <typename Q>
+    void remove( const Q& key ) {
+        Shard& s = *this->shards[shardOf( key )];
+        std::lock_guard<std::mutex> guard( s.lock );
+        s.table.remove( key );
+    }
+
+    // Batched operations. Keys are grouped by shard, keeping their
+    // order within a shard, so a key that appears twice in a put batch
+    // ends up with its last value. Each shard's keys are handed to the
+    // engine's own batched operation, which prefetches their buckets.
+
+    void put_batch( const K * keys, const V * vals, size_t n ) {
+        std::vector<K> shardKeys;
+        std::vector<V> shardVals;
+
+        forEachShard( keys, n, [&]( Engine& table, const size_t * idx, size_t m ) {
+            shardKeys.clear();
+            shardVals.clear();
+
+            for( size_t j = 0; j < m; ++j ) {
+                shardKeys.push_back( keys[idx[j]] );
+                shardVals.push_back( vals[idx[j]] );
+            }
+
+            table.put_batch( shardKeys.data(), shardVals.data(), m );
+        } );
+    }
+
+    // copies the value of keys[i] into vals[i] and sets found[i] to
+    // whether it exists. Returns the number of keys found.
+    size_t get_batch( const K * keys, V * vals, bool * found, size_t n ) {
+        std::vector<K> shardKeys;
+        std::vector<V> shardVals;
+        std::unique_ptr<bool[]> shardFound( new bool[n] );
+        size_t numFound = 0;
+
+        forEachShard( keys, n, [&]( Engine& table, const size_t * idx, size_t m ) {
+            shardKeys.clear();
+
+            for( size_t j = 0; j < m; ++j ) {
+                shardKeys.push_back( keys[idx[j]] );
+            }
+
+            shardVals.resize( m );
+            numFound += table.get_batch( shardKeys.data(), shardVals.data(),
+                    shardFound.get(), m );
+
+            for( size_t j = 0; j < m; ++j ) {
+                found[idx[j]] = shardFound[j];
+                if( shardFound[j] ) vals[idx[j]] = shardVals[j];
+            }
+        } );
+
+        return numFound;
+    }
+
+    void remove_batch( const K * keys, size_t n ) {
+        std::vector<K> shardKeys;
+
+        forEachShard( keys, n, [&]( Engine& table, const size_t * idx, size_t m ) {
+            shardKeys.clear();
+
+            for( size_t j = 0; j < m; ++j ) {
+                shardKeys.push_back( keys[idx[j]] );
+            }
+
+            table.remove_batch( shardKeys.data(), m );
+        } );
+    }
+
+    // Calls fn( table, idx, m ) once for every shard holding any of the
+    // keys, with the lock of the shard held, where idx lists the m
+    // indices of its keys. Keys are counting sorted by shard.
+    template <class Fn>
+    void forEachShard( const K * keys, size_t n, Fn fn ) {
+        std::vector<int> shardIdx( n );
+        std::vector<size_t> start( N + 1, 0 );
+        std::vector<size_t> order( n );
+
+        for( size_t i = 0; i < n; ++i ) {
+            shardIdx[i] = shardOf( keys[i] );
+            ++start[shardIdx[i] + 1];
+        }
+
+        for( int s = 0; s < N; ++s ) {
+            start[s + 1] += start[s];
+        }
+
+        std::vector<size_t> pos( start.begin(), start.end() - 1 );
+        for( size_t i = 0; i < n; ++i ) {
+            order[pos[shardIdx[i]]++] = i;
+        }
+
+        for( int s = 0; s < N; ++s ) {
+            if( start[s] == start[s + 1] ) continue;
+
+            Shard& shard = *this->shards[s];
+            std::lock_guard<std::mutex> guard( shard.lock );
+
+            fn( shard.table, order.data() + start[s], start[s + 1] - start[s] );
+        }
+    }
+
+    // removes every entry for which pred( key, val ) is true from each
+    // shard in turn, holding only that shard's lock, and returns how
+    // many were removed
+    template <class Pred>
+    size_t erase_if( Pred pred ) {
+        size_t erased = 0;
+
+        for( auto& s : shards ) {
+            std::lock_guard<std::mutex> guard( s->lock );
+            erased += s->table.erase_if( pred );
+        }
+
+        return erased;
+    }
+
+#ifdef HASH_STATS
+    // the stats of every shard merged, see hash_stats.hpp
+    TableStats collectStats() {
+        TableStats total;
+
+        for( auto& s : shards ) {
+            std::lock_guard<std::mutex> guard( s->lock );
+            total.merge( s->table.stats );
+        }
+
+        return total;
+    }
+#endif
+
+    // resizes every shard to its share of newBuckets
+    void resize( size_t newBuckets ) {
+        for( auto& s : shards ) {
+            std::lock_guard<std::mutex> guard( s->lock );
+            s->table.resize( ( newBuckets + N - 1 ) / N );
+        }
+    }
+
+    size_t size() {
+        size_t total = 0;
+
+        for( auto& s : shards ) {
+            std::lock_guard<std::mutex> guard( s->lock );
+            total += s->table.numEntries;
+        }
+
+        return total;
+    }
+
+    float getLoadFactor( void ) {
+        size_t entries = 0;
+        size_t buckets = 0;
+
+        for( auto& s : shards ) {
+            std::lock_guard<std::mutex> guard( s->lock );
+            entries += s->table.numEntries;
+            buckets += s->table.numBuckets;
+        }
+
+        return float( entries ) / buckets;
+    }
+
+    std::vector<std::unique_ptr<Shard>> shards;
+    Hasher hasher;
+};
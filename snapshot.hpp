@@ -0,0 +1,430 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <typeinfo>
+#include <utility> // for swap
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+// On-disk snapshots of a table's bucket array, so a large table can be
+// reopened without rehashing a single key, e.g.
+//     RHHash<int, int> h( 1 << 20, 0.9 );
+//     ...
+//     h.saveSnapshot( "table.snap" );
+//
+//     RHHash<int, int> g;
+//     g.openSnapshot( "table.snap", SNAPSHOT_READ_ONLY );
+
+// Key Concepts:
+// 1. A snapshot is a header followed by the bucket array exactly as it
+// is laid out in memory, starting on a page boundary. Opening one maps
+// the file and points the table's buckets at the mapping, so there is
+// nothing to deserialize, and start up costs only the page faults of
+// the buckets that are actually probed.
+// 2. The header records everything the layout depends on: the engine,
+// the size and alignment of an entry, the key, value, Hasher, index
+// policy and slot layout types, and the capacity and tail, along with
+// the entry count, longest probe and load threshold. Opening fails
+// unless the engine, entry and types match the table's own. The types
+// are identified by their typeid names, which are stable for
+// a given compiler, so snapshots are meant to be read by the binary
+// that wrote them, or one built alongside it.
+// 3. A Hasher may keep its type but change what it computes, which
+// would leave every entry in the wrong bucket. Entries store their full
+// hash, so opening rehashes the first few keys and compares. Entries
+// in the SentinelKeys layout store none, so their keys must instead be
+// reachable from the home bucket they rehash to. The seed of a seedable
+// Hasher is saved too, and restored on opening.
+// 4. The header carries a checksum of itself and of the bucket array.
+// The header is always verified. Verifying the buckets reads the whole
+// file, so it is optional.
+// 5. SNAPSHOT_READ_ONLY maps the file read only, and puts and removes
+// throw. SNAPSHOT_COPY_ON_WRITE maps it privately, so the table can be
+// modified, and pages are copied as they are first written; the file
+// never changes. Either way, resizing moves the table onto the heap
+// and unmaps the file.
+// Only tables with trivially copyable keys and values can be saved.
+
+enum SnapshotMode {
+    SNAPSHOT_READ_ONLY,
+    SNAPSHOT_COPY_ON_WRITE
+};
+
+enum SnapshotEngine : uint32_t {
+    SNAPSHOT_RH = 1,
+    SNAPSHOT_LP = 2
+};
+
+struct SnapshotHeader {
+    static const uint32_t VERSION = 4;
+
+    // the bucket array starts this far into the file
+    static const size_t DATA_OFFSET = 4096;
+
+    char magic[8];
+    uint32_t version;
+    uint32_t engine;
+    uint64_t entrySize;
+    uint64_t entryAlign;
+    uint64_t keyId;
+    uint64_t valId;
+    uint64_t hasherId;
+    uint64_t indexId;
+    uint64_t layoutId;
+    uint64_t numBuckets;
+
+    // slots past the last bucket, see RHHash, and the longest probe
+    // length plus one of their entries
+    uint64_t tailSlots;
+    uint32_t maxDist;
+
+    uint64_t numEntries;
+    float loadThreshold;
+
+    // seed of a seedable Hasher, see SeededHashFn, or 0
+    uint64_t hasherSeed;
+    uint64_t dataChecksum;
+
+    // checksum of every field above
+    uint64_t headerChecksum;
+};
+
+static_assert( sizeof( SnapshotHeader ) <= SnapshotHeader::DATA_OFFSET,
+        "SnapshotHeader: header overlaps the bucket array" );
+
+static const char SNAPSHOT_MAGIC[8] = { 'H', 'A', 'S', 'H', 'S', 'N', 'A', 'P' };
+
+
+// FNV-1a over 8 byte words, with the tail folded into one last word.
+inline uint64_t snapshotChecksum( const void * data, size_t bytes ) {
+    const unsigned char * p = static_cast<const unsigned char *>( data );
+    uint64_t sum = 14695981039346656037ull;
+    size_t i = 0;
+
+    for( ; i + 8 <= bytes; i += 8 ) {
+        uint64_t word;
+        std::memcpy( &word, p + i, 8 );
+        sum = ( sum ^ word ) * 1099511628211ull;
+    }
+
+    uint64_t tail = 0;
+    std::memcpy( &tail, p + i, bytes - i );
+    sum = ( sum ^ tail ^ bytes ) * 1099511628211ull;
+
+    return sum;
+}
+
+template <typename T>
+uint64_t snapshotTypeId() {
+    const char * name = typeid( T ).name();
+    return snapshotChecksum( name, std::strlen( name ) );
+}
+
+
+// Memory holding the buckets of an opened snapshot: a mapping of the
+// file, or a heap copy of its buckets on systems without mmap. A table
+// frees its bucket array through release() when holds() it, and
+// through its allocator otherwise.
+struct SnapshotMapping {
+    SnapshotMapping() {}
+    SnapshotMapping( const SnapshotMapping& ) = delete;
+    SnapshotMapping& operator=( const SnapshotMapping& ) = delete;
+
+    ~SnapshotMapping() {
+        release();
+    }
+
+    void * data() const {
+        return base ? static_cast<char *>( base ) + offset : nullptr;
+    }
+
+    bool holds( const void * ptr ) const {
+        return base && ptr == data();
+    }
+
+    void release() {
+        if( !base ) return;
+
+#ifdef __linux__
+        munmap( base, length );
+#else
+        std::free( base );
+#endif
+
+        base = nullptr;
+        length = 0;
+        offset = 0;
+        readOnly = false;
+    }
+
+    void swap( SnapshotMapping& other ) {
+        std::swap( base, other.base );
+        std::swap( length, other.length );
+        std::swap( offset, other.offset );
+        std::swap( readOnly, other.readOnly );
+    }
+
+    void * base = nullptr;
+    size_t length = 0;
+    size_t offset = 0;
+    bool readOnly = false;
+};
+
+
+// Fills in the fields describing Table's layout. Entry is the type of
+// its buckets.
+template <class Table, class Entry>
+SnapshotHeader snapshotLayout( SnapshotEngine engine ) {
+    static_assert( std::is_trivially_copyable<typename Table::key_type>::value &&
+            std::is_trivially_copyable<typename Table::mapped_type>::value,
+            "snapshot: keys and values must be trivially copyable" );
+
+    SnapshotHeader header;
+    std::memset( &header, 0, sizeof( header ) );
+
+    std::memcpy( header.magic, SNAPSHOT_MAGIC, sizeof( header.magic ) );
+    header.version = SnapshotHeader::VERSION;
+    header.engine = engine;
+    header.entrySize = sizeof( Entry );
+    header.entryAlign = alignof( Entry );
+    header.keyId = snapshotTypeId<typename Table::key_type>();
+    header.valId = snapshotTypeId<typename Table::mapped_type>();
+    header.hasherId = snapshotTypeId<typename Table::hasher_type>();
+    header.indexId = snapshotTypeId<typename Table::index_type>();
+    header.layoutId = snapshotTypeId<typename Table::layout_type>();
+
+    return header;
+}
+
+inline uint64_t snapshotHeaderChecksum( const SnapshotHeader& header ) {
+    return snapshotChecksum( &header, offsetof( SnapshotHeader, headerChecksum ) );
+}
+
+// Writes header and the numBuckets + tailSlots entries of the bucket
+// array to path, replacing it. Throws if the file can't be written.
+inline void writeSnapshot( const char * path, SnapshotHeader header,
+        const void * buckets ) {
+    size_t bytes = ( header.numBuckets + header.tailSlots ) * header.entrySize;
+
+    header.dataChecksum = snapshotChecksum( buckets, bytes );
+    header.headerChecksum = snapshotHeaderChecksum( header );
+
+    std::FILE * file = std::fopen( path, "wb" );
+    if( !file ) {
+        throw std::runtime_error( std::string( "snapshot: can't create " ) + path );
+    }
+
+    char page[SnapshotHeader::DATA_OFFSET] = {};
+    std::memcpy( page, &header, sizeof( header ) );
+
+    bool ok = std::fwrite( page, sizeof( page ), 1, file ) == 1 &&
+        ( bytes == 0 || std::fwrite( buckets, bytes, 1, file ) == 1 );
+
+    if( std::fclose( file ) != 0 || !ok ) {
+        throw std::runtime_error( std::string( "snapshot: can't write " ) + path );
+    }
+}
+
+// Opens the snapshot at path into mapping, and returns its header.
+// expected is the table's own snapshotLayout, which the snapshot's
+// must match. Throws if the file is unreadable, corrupt or was written
+// by a table of another layout.
+inline SnapshotHeader readSnapshot( const char * path, const SnapshotHeader& expected,
+        SnapshotMode mode, bool verify, SnapshotMapping& mapping ) {
+    std::string name( path );
+
+    auto fail = [&]( const char * why ) {
+        return std::runtime_error( "snapshot: " + name + ": " + why );
+    };
+
+    SnapshotHeader header;
+
+    std::FILE * file = std::fopen( path, "rb" );
+    if( !file ) {
+        throw fail( "can't open" );
+    }
+
+    bool ok = std::fread( &header, sizeof( header ), 1, file ) == 1;
+    std::fclose( file );
+
+    if( !ok || std::memcmp( header.magic, SNAPSHOT_MAGIC, sizeof( header.magic ) ) != 0 ) {
+        throw fail( "not a snapshot" );
+    }
+
+    if( header.version != SnapshotHeader::VERSION ) {
+        throw fail( "unsupported version" );
+    }
+
+    if( header.headerChecksum != snapshotHeaderChecksum( header ) ) {
+        throw fail( "corrupt header" );
+    }
+
+    if( header.engine != expected.engine ||
+            header.entrySize != expected.entrySize ||
+            header.entryAlign != expected.entryAlign ||
+            header.keyId != expected.keyId ||
+            header.valId != expected.valId ||
+            header.hasherId != expected.hasherId ||
+            header.indexId != expected.indexId ||
+            header.layoutId != expected.layoutId ) {
+        throw fail( "written by a table of another type" );
+    }
+
+    uint64_t numSlots = header.numBuckets + header.tailSlots;
+
+    if( header.numBuckets == 0 || header.numEntries > header.numBuckets ||
+            numSlots < header.numBuckets || header.maxDist > header.tailSlots ||
+            numSlots > size_t( -1 ) / header.entrySize ) {
+        throw fail( "corrupt header" );
+    }
+
+    size_t bytes = size_t( numSlots ) * header.entrySize;
+    size_t length = SnapshotHeader::DATA_OFFSET + bytes;
+
+    SnapshotMapping opened;
+
+#ifdef __linux__
+    int fd = open( path, O_RDONLY );
+    struct stat st;
+
+    if( fd < 0 || fstat( fd, &st ) != 0 || size_t( st.st_size ) < length ) {
+        if( fd >= 0 ) close( fd );
+        throw fail( "truncated" );
+    }
+
+    bool readOnly = mode == SNAPSHOT_READ_ONLY;
+    void * base = mmap( nullptr, length, readOnly ? PROT_READ : PROT_READ | PROT_WRITE,
+            MAP_PRIVATE, fd, 0 );
+    close( fd );
+
+    if( base == MAP_FAILED ) {
+        throw fail( "can't map" );
+    }
+
+    opened.base = base;
+    opened.length = length;
+    opened.offset = SnapshotHeader::DATA_OFFSET;
+    opened.readOnly = readOnly;
+#else
+    // without mmap the buckets are read into memory, and only made
+    // read only by the table refusing puts and removes
+    file = std::fopen( path, "rb" );
+    opened.base = std::malloc( bytes ? bytes : 1 );
+
+    ok = file && opened.base &&
+        std::fseek( file, SnapshotHeader::DATA_OFFSET, SEEK_SET ) == 0 &&
+        std::fread( opened.base, bytes, 1, file ) == 1;
+    if( file ) std::fclose( file );
+
+    if( !ok ) {
+        throw fail( "truncated" );
+    }
+
+    opened.length = bytes;
+    opened.readOnly = mode == SNAPSHOT_READ_ONLY;
+#endif
+
+    if( verify && snapshotChecksum( opened.data(), bytes ) != header.dataChecksum ) {
+        throw fail( "corrupt buckets" );
+    }
+
+    mapping.swap( opened );
+    return header;
+}
+
+template <class Entry, class = void>
+struct SnapshotStoresHash : std::false_type {};
+
+template <class Entry>
+struct SnapshotStoresHash<Entry, std::void_t<decltype( std::declval<Entry&>().hash )>>
+    : std::true_type {};
+
+// Rehashes the keys of up to the first SAMPLE occupied entries of the
+// numSlots in buckets, and returns whether they all match their stored
+// hashes. Entries without a stored hash match if no slot from the home
+// bucket of their key, under index, up to their own is empty. Probes
+// wrap around unless the array has a tail.
+template <class HashValue, class Entry, class Occupied, class Hasher, class Index>
+bool snapshotHashesMatch( const Entry * buckets, size_t numSlots, bool wraps,
+        Occupied occupied, Hasher& hasher, const Index& index ) {
+    static const int SAMPLE = 64;
+    int checked = 0;
+
+    for( size_t i = 0; i < numSlots && checked < SAMPLE; ++i ) {
+        if( !occupied( buckets[i] ) ) continue;
+
+        HashValue hash = hasher.hash( buckets[i].key );
+
+        if constexpr( SnapshotStoresHash<Entry>::value ) {
+            if( hash != buckets[i].hash ) {
+                return false;
+            }
+        } else {
+            size_t home = index.index( hash );
+            if( !wraps && home > i ) {
+                return false;
+            }
+
+            for( size_t j = home; j != i; j = wraps ? index.next( j ) : j + 1 ) {
+                if( !occupied( buckets[j] ) ) {
+                    return false;
+                }
+            }
+        }
+
+        ++checked;
+    }
+
+    return true;
+}
+
+// Opens the snapshot at path into mapping for table, whose buckets are
+// of type Entry, and returns its header. occupied( entry ) tells
+// whether an entry holds a key. Throws if the snapshot doesn't fit the
+// table, leaving both untouched.
+template <class Table, class Entry, class Occupied>
+SnapshotHeader openSnapshotFor( Table& table, SnapshotEngine engine, const char * path,
+        SnapshotMode mode, bool verify, Occupied occupied, SnapshotMapping& mapping ) {
+    typedef typename Table::index_type Index;
+
+    SnapshotMapping opened;
+    SnapshotHeader header = readSnapshot( path,
+            snapshotLayout<Table, Entry>( engine ), mode, verify, opened );
+
+    size_t numBuckets = size_t( header.numBuckets );
+
+    if( uint64_t( numBuckets ) != header.numBuckets ||
+            Index::capacity( numBuckets ) != numBuckets ) {
+        throw std::runtime_error( std::string( "snapshot: " ) + path +
+                ": capacity not valid for the index policy" );
+    }
+
+    typename Table::hasher_type hasher( table.hasher );
+    setHasherSeed( hasher, header.hasherSeed );
+
+    Index index;
+    index.setCapacity( numBuckets );
+
+    if( !snapshotHashesMatch<typename Table::HashValue>( static_cast<const Entry *>( opened.data() ),
+                numBuckets + size_t( header.tailSlots ), header.tailSlots == 0,
+                occupied, hasher, index ) ) {
+        throw std::runtime_error( std::string( "snapshot: " ) + path +
+                ": keys don't match their hashes, the Hasher has changed" );
+    }
+
+    mapping.swap( opened );
+    return header;
+}
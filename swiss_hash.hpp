@@ -0,0 +1,404 @@
+#pragma once
+
+#include "hash.hpp"
+#include "hash_stats.hpp"
+#include <cstdint>
+#include <utility> // for forward, move
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+
+// Template for hash using SIMD group probing, in the style of
+// Abseil's Swiss tables.
+
+// Key Concepts:
+// 1. Every slot has a control byte, kept in its own array. A full slot
+// stores a 7 bit fingerprint of the key's hash, while empty and deleted
+// slots store negative markers.
+// 2. Slots are probed a group of 16 at a time. One SSE2 compare of the
+// group's control bytes against the fingerprint finds every candidate
+// slot, so keys are only compared when their fingerprints match, and
+// a miss usually ends after a single group without touching any key.
+// 3. Groups are aligned and probed linearly from the home group, which
+// the index policy picks from the hash. A lookup stops at the first group with
+// an empty slot, so removes may only mark a slot empty if its group
+// already has one; otherwise they leave a tombstone (DELETED).
+template<typename K, typename V, class Hasher = HashFn<K>, class Index = ModIndex,
+         class Allocator = std::allocator<char>>
+struct SwissHash : public IHash<SwissHash<K, V, Hasher, Index, Allocator>, K, V, Hasher, Index, Allocator> {
+    HASH_STATS_INIT
+
+    typedef HashValueOf<Hasher, K> HashValue;
+
+    static const int GROUP_SIZE = 16;
+    static const int8_t EMPTY = -128;
+    static const int8_t DELETED = -2;
+
+    struct HashEntry {
+        HashEntry() {}
+        HashEntry( K key, V val ) : key(key), val(val) {}
+
+        K key;
+        V val;
+    };
+
+    // slots are only read once their control byte says they are full,
+    // so zero filled memory needs no initialization when keys and
+    // values are trivial
+    static const bool ZERO_SLOTS =
+        std::is_trivial<K>::value && std::is_trivial<V>::value;
+
+    // Matches the control bytes of one group. Each method returns a
+    // mask with bit i set if slot i of the group matches.
+    struct Group {
+#ifdef __SSE2__
+        Group( const int8_t * pos ) {
+            ctrl = _mm_loadu_si128( reinterpret_cast<const __m128i *>( pos ) );
+        }
+
+        unsigned int match( int8_t h2 ) const {
+            return _mm_movemask_epi8( _mm_cmpeq_epi8( _mm_set1_epi8( h2 ), ctrl ) );
+        }
+
+        unsigned int matchEmpty() const {
+            return _mm_movemask_epi8( _mm_cmpeq_epi8( _mm_set1_epi8( EMPTY ), ctrl ) );
+        }
+
+        // full slots are non-negative, so the sign bits are exactly
+        // the empty and deleted slots
+        unsigned int matchEmptyOrDeleted() const {
+            return _mm_movemask_epi8( ctrl );
+        }
+
+        __m128i ctrl;
+#else
+        Group( const int8_t * pos ) : ctrl(pos) {}
+
+        unsigned int match( int8_t h2 ) const {
+            unsigned int mask = 0;
+            for( int i = 0; i < GROUP_SIZE; ++i ) {
+                if( ctrl[i] == h2 ) mask |= 1u << i;
+            }
+            return mask;
+        }
+
+        unsigned int matchEmpty() const {
+            return match( EMPTY );
+        }
+
+        unsigned int matchEmptyOrDeleted() const {
+            unsigned int mask = 0;
+            for( int i = 0; i < GROUP_SIZE; ++i ) {
+                if( ctrl[i] < 0 ) mask |= 1u << i;
+            }
+            return mask;
+        }
+
+        const int8_t * ctrl;
+#endif
+    };
+
+    // index of the lowest set bit of a non-zero mask
+    static int lowestBit( unsigned int mask ) {
+#if defined(__GNUC__) || defined(__clang__)
+        return __builtin_ctz( mask );
+#else
+        int i = 0;
+        while( !( mask & 1 ) ) {
+            mask >>= 1;
+            ++i;
+        }
+        return i;
+#endif
+    }
+
+    SwissHash( size_t _numBuckets, float _loadThreshold,
+            const Allocator& _allocator = Allocator() ) {
+        this->allocator = _allocator;
+        this->loadThreshold = _loadThreshold;
+        this->numEntries = 0;
+        this->numDeleted = 0;
+
+        allocate( _numBuckets );
+    }
+
+    SwissHash() : SwissHash(16, 0.875) {}
+
+    ~SwissHash() {
+        this->deallocateArray( ctrl, this->numBuckets );
+        this->deallocateArray( slots, this->numBuckets );
+    }
+
+    // capacity is rounded up to a whole number of groups. The index
+    // policy maps hashes to groups rather than to slots. Both arrays are
+    // allocated before the table changes, so if either allocation
+    // throws, the table still describes the arrays it had.
+    void allocate( size_t _numBuckets ) {
+        size_t groups = Index::capacity( ( _numBuckets + GROUP_SIZE - 1 ) / GROUP_SIZE );
+        size_t capacity = groups * GROUP_SIZE;
+
+        int8_t * newCtrl = this->template allocateArray<int8_t, true>( capacity );
+        HashEntry * newSlots;
+
+        try {
+            newSlots = this->template allocateArray<HashEntry, ZERO_SLOTS>( capacity );
+        } catch( ... ) {
+            this->deallocateArray( newCtrl, capacity );
+            throw;
+        }
+
+        for( size_t i = 0; i < capacity; ++i ) {
+            newCtrl[i] = EMPTY;
+        }
+
+        this->numGroups = groups;
+        this->numBuckets = capacity;
+        this->indexer.setCapacity( this->numGroups );
+        this->ctrl = newCtrl;
+        this->slots = newSlots;
+    }
+
+    void resize( size_t newBuckets ) {
+        HASH_STATS_RESIZE
+        int8_t * oldCtrl = ctrl;
+        HashEntry * oldSlots = slots;
+        size_t oldBuckets = this->numBuckets;
+
+        allocate( newBuckets );
+
+        this->numEntries = 0;
+        this->numDeleted = 0;
+
+        for( size_t i = 0; i < oldBuckets; ++i ) {
+            if( oldCtrl[i] >= 0 ) {
+                this->template insert<true>( std::move( oldSlots[i].key ), std::move( oldSlots[i].val ) );
+            }
+        }
+
+        this->deallocateArray( oldCtrl, oldBuckets );
+        this->deallocateArray( oldSlots, oldBuckets );
+    }
+
+    // home group and fingerprint of a key. The fingerprint is the low 7
+    // bits of the hash run through mix64, each of which depends on every
+    // hash bit, so it stays unrelated to whatever the index policy
+    // computes from the hash for the group, including FibonacciIndex's
+    // top bits of the hash times 2^w / phi.
+    size_t homeGroup( HashValue hash ) {
+        return this->indexer.index( hash );
+    }
+
+    static int8_t fingerprint( uint64_t hash ) {
+        return int8_t( mix64( hash ) & 0x7f );
+    }
+
+    size_t nextGroup( size_t g ) {
+        return this->indexer.next( g );
+    }
+
+    // returns the index of key, or NOT_FOUND if it doesn't exist
+    template <typename Q>
+    size_t lookup( const Q& key, HashValue hash ) {
+        int8_t h2 = fingerprint( hash );
+        size_t g = homeGroup( hash );
+
+        for(;;) {
+            Group group( this->ctrl + g * GROUP_SIZE );
+
+            for( unsigned int mask = group.match( h2 ); mask; mask &= mask - 1 ) {
+                size_t idx = g * GROUP_SIZE + lowestBit( mask );
+
+                if( this->slots[idx].key == key ) {
+                    HASH_STATS_SET( probe, groupDistance( homeGroup( hash ), g ) )
+                    return idx;
+                }
+            }
+
+            // the key would have been placed in this group's empty slot
+            if( group.matchEmpty() ) {
+                HASH_STATS_SET( probe, groupDistance( homeGroup( hash ), g ) )
+                return NOT_FOUND;
+            }
+
+            g = nextGroup( g );
+        }
+    }
+
+    template <typename Q>
+    size_t lookup( const Q& key ) {
+        return lookup( key, this->hasher.hash( key ) );
+    }
+
+    template <bool Assign, typename KK, typename... Args>
+    std::pair<V *, bool> insertHashed( HashValue hash, KK&& key, Args&&... args ) {
+        // tombstones count towards the load, as they lengthen probes.
+        // If many of them are tombstones, rehashing at the same size
+        // is enough to clear them.
+        if( float( this->numEntries + this->numDeleted ) >=
+                this->loadThreshold * this->numBuckets ||
+                this->numEntries + this->numDeleted + 1 >= this->numBuckets ) {
+            bool grow = this->numDeleted * 2 <= this->numEntries;
+            this->resize( grow ? this->numBuckets * 2 : this->numBuckets );
+        }
+
+        size_t idx = lookup( key, hash );
+        HASH_STATS_OP( STAT_PUT )
+
+        if( idx != NOT_FOUND ) {
+            if( Assign ) {
+                this->slots[idx].val = V( std::forward<Args>( args )... );
+            }
+            return std::make_pair( &this->slots[idx].val, false );
+        }
+
+        // take the first empty or deleted slot along the probe sequence
+        size_t g = homeGroup( hash );
+        unsigned int mask;
+
+        while( !( mask = Group( this->ctrl + g * GROUP_SIZE ).matchEmptyOrDeleted() ) ) {
+            g = nextGroup( g );
+        }
+
+        idx = g * GROUP_SIZE + lowestBit( mask );
+
+        if( this->ctrl[idx] == DELETED ) {
+            --this->numDeleted;
+        }
+
+        this->ctrl[idx] = fingerprint( hash );
+        this->slots[idx].key = K( std::forward<KK>( key ) );
+        this->slots[idx].val = V( std::forward<Args>( args )... );
+
+        ++this->numEntries;
+
+        return std::make_pair( &this->slots[idx].val, true );
+    }
+
+    template <typename Q>
+    V * findHashed( const Q& key, HashValue hash ) {
+        size_t idx = lookup( key, hash );
+
+        if( idx != NOT_FOUND ) {
+            HASH_STATS_OP( STAT_GET_HIT )
+            return &this->slots[idx].val;
+        }
+
+        HASH_STATS_OP( STAT_GET_MISS )
+        return nullptr;
+    }
+
+    template <typename Q>
+    void removeHashed( const Q& key, HashValue hash ) {
+        size_t idx = lookup( key, hash );
+        HASH_STATS_OP( STAT_REMOVE )
+
+        // Key does not exist, nothing removed
+        if( idx == NOT_FOUND ) return;
+
+        // if the group has an empty slot, no probe sequence continues
+        // past this group, so the slot can simply become empty
+        size_t g = idx / GROUP_SIZE;
+
+        if( Group( this->ctrl + g * GROUP_SIZE ).matchEmpty() ) {
+            this->ctrl[idx] = EMPTY;
+        } else {
+            this->ctrl[idx] = DELETED;
+            ++this->numDeleted;
+        }
+
+        --this->numEntries;
+    }
+
+    void prefetch( HashValue hash ) {
+        size_t g = homeGroup( hash );
+
+        prefetchLine( this->ctrl + g * GROUP_SIZE );
+        prefetchLine( this->slots + g * GROUP_SIZE );
+    }
+
+    // Iteration, see SlotIterator. Finding the next entry only reads
+    // the control bytes.
+    typedef SlotIterator<SwissHash> iterator;
+
+    iterator begin() {
+        return iterator( this, nextFull( 0 ) );
+    }
+
+    iterator end() {
+        return iterator( this, this->numBuckets );
+    }
+
+    size_t nextFull( size_t slot ) {
+        while( slot < this->numBuckets && this->ctrl[slot] < 0 ) {
+            ++slot;
+        }
+        return slot;
+    }
+
+    const K& keyAt( size_t slot ) {
+        return this->slots[slot].key;
+    }
+
+    V& valAt( size_t slot ) {
+        return this->slots[slot].val;
+    }
+
+    // Removes every entry for which pred( key, val ) is true, and
+    // returns how many were removed, a group at a time. As in
+    // removeHashed, removed slots only become empty if their group
+    // already had an empty slot, and become tombstones otherwise.
+    template <class Pred>
+    size_t erase_if( Pred pred ) {
+        size_t erased = 0;
+
+        for( size_t g = 0; g < this->numGroups; ++g ) {
+            int8_t * group = this->ctrl + g * GROUP_SIZE;
+            int8_t marker = EMPTY;
+
+            if( !Group( group ).matchEmpty() ) {
+                marker = DELETED;
+            }
+
+            for( int j = 0; j < GROUP_SIZE; ++j ) {
+                HashEntry& slot = this->slots[g * GROUP_SIZE + j];
+
+                if( group[j] >= 0 && pred( slot.key, slot.val ) ) {
+                    group[j] = marker;
+                    if( marker == DELETED ) ++this->numDeleted;
+                    ++erased;
+                }
+            }
+        }
+
+        this->numEntries -= erased;
+        return erased;
+    }
+
+    // number of groups from group home to group g along the probe
+    // sequence
+    size_t groupDistance( size_t home, size_t g ) {
+        return ( g - home + this->numGroups ) % this->numGroups;
+    }
+
+    // histogram of the probe lengths of the entries in the table,
+    // measured in groups, as are the probe lengths in stats
+    Histogram get_dib_stats() {
+        Histogram dibs;
+
+        for( size_t i = 0; i < this->numBuckets; ++i ) {
+            if( this->ctrl[i] >= 0 ) {
+                size_t home = homeGroup( this->hasher.hash( this->slots[i].key ) );
+                dibs.record( groupDistance( home, i / GROUP_SIZE ) );
+            }
+        }
+
+        return dibs;
+    }
+
+    size_t numGroups;
+    size_t numDeleted;
+    int8_t * ctrl;
+    HashEntry * slots;
+};